@@ -0,0 +1,338 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "../imageio/image_enc.h"
+#include "../src/thumbnailer.h"
+#include "../src/utils/thumbnailer_utils.h"
+#include "../test/test_generator.h"
+#include "../test/thumbnailer_test_peer.h"
+#include "benchmark/benchmark.h"
+
+namespace {
+
+using libwebp::Thumbnailer;
+
+// Most benchmarks take the frame count, the width (the height is 9/16 of it),
+// whether the frames are opaque or translucent, and their content (see
+// WebPTestGenerator::Content).
+void FrameArgs(benchmark::internal::Benchmark* const benchmark) {
+  benchmark->ArgNames({"frames", "width", "opaque", "content"});
+  for (const int frames : {5, 20}) {
+    for (const int width : {160, 320}) {
+      for (const int opaque : {0, 1}) {
+        for (int content = 0; content < WebPTestGenerator::kNumContents;
+             ++content) {
+          benchmark->Args({frames, width, opaque, content});
+        }
+      }
+    }
+  }
+}
+
+// Same as FrameArgs() for a single frame, with the first argument being a
+// benchmark-specific mode.
+void ModeArgs(benchmark::internal::Benchmark* const benchmark,
+              const char* const mode_name, int num_modes) {
+  benchmark->ArgNames({mode_name, "width", "opaque", "content"});
+  for (int mode = 0; mode < num_modes; ++mode) {
+    for (const int width : {160, 320}) {
+      for (const int opaque : {0, 1}) {
+        for (int content = 0; content < WebPTestGenerator::kNumContents;
+             ++content) {
+          benchmark->Args({mode, width, opaque, content});
+        }
+      }
+    }
+  }
+}
+
+std::vector<EnclosedWebPPicture> GeneratePics(const benchmark::State& state,
+                                              int pic_count) {
+  const int width = state.range(1);
+  return WebPTestGenerator(pic_count, width, width * 9 / 16,
+                           state.range(2) ? 0xff : 0xaf,
+                           WebPTestGenerator::Content(state.range(3)))
+      .GeneratePics();
+}
+
+bool AddFrames(const std::vector<EnclosedWebPPicture>& pics,
+               Thumbnailer* const thumbnailer) {
+  for (std::size_t i = 0; i < pics.size(); ++i) {
+    if (thumbnailer->AddFrame(*pics[i], (i + 1) * 100) != Thumbnailer::kOk) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int64_t GetEncodes(const thumbnailer::ThumbnailerStats& stats) {
+  return stats.lossy_encodes() + stats.lossless_encodes() +
+         stats.near_lossless_encodes();
+}
+
+// End-to-end generation with each method, on a new Thumbnailer every time so
+// that no result is cached between iterations.
+void BM_GenerateAnimation(benchmark::State& state, Thumbnailer::Method method) {
+  const std::vector<EnclosedWebPPicture> pics =
+      GeneratePics(state, state.range(0));
+  int64_t num_encodes = 0, num_assemblies = 0, num_bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    Thumbnailer thumbnailer;
+    if (!AddFrames(pics, &thumbnailer)) {
+      state.SkipWithError("AddFrame() failed");
+      break;
+    }
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    thumbnailer::ThumbnailerStats stats;
+    state.ResumeTiming();
+
+    const Thumbnailer::Status status =
+        thumbnailer.GenerateAnimation(&webp_data, method, &stats);
+    if (status != Thumbnailer::kOk && status != Thumbnailer::kByteBudgetError) {
+      state.SkipWithError("GenerateAnimation() failed");
+      break;
+    }
+    num_encodes += GetEncodes(stats);
+    num_assemblies += stats.assemblies();
+    num_bytes += webp_data.size;
+    WebPDataClear(&webp_data);
+  }
+  state.counters["encodes"] =
+      benchmark::Counter(num_encodes, benchmark::Counter::kIsRate);
+  state.counters["assemblies"] =
+      benchmark::Counter(num_assemblies, benchmark::Counter::kIsRate);
+  state.counters["bytes"] =
+      benchmark::Counter(num_bytes, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK_CAPTURE(BM_GenerateAnimation, equal_quality,
+                  Thumbnailer::kEqualQuality)
+    ->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_GenerateAnimation, equal_psnr, Thumbnailer::kEqualPSNR)
+    ->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_GenerateAnimation, near_ll_equal,
+                  Thumbnailer::kNearllEqual)
+    ->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_GenerateAnimation, near_ll_diff, Thumbnailer::kNearllDiff)
+    ->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_GenerateAnimation, slope_optim, Thumbnailer::kSlopeOptim)
+    ->Apply(FrameArgs);
+BENCHMARK_CAPTURE(BM_GenerateAnimation, temporal_decimation,
+                  Thumbnailer::kTemporalDecimation)
+    ->Apply(FrameArgs);
+
+// A single lossy (mode 0), lossless (mode 1) or near-lossless (mode 2)
+// encoding and distortion measurement.
+void BM_GetPictureStats(benchmark::State& state) {
+  const std::vector<EnclosedWebPPicture> pics = GeneratePics(state, 1);
+  Thumbnailer thumbnailer;
+  if (!AddFrames(pics, &thumbnailer)) {
+    state.SkipWithError("AddFrame() failed");
+    return;
+  }
+  libwebp::ThumbnailerTestPeer peer(&thumbnailer);
+  const int mode = state.range(0);
+  peer.SetConfig(/*lossless=*/mode != 0, /*quality=*/mode == 0 ? 75 : 100,
+                 /*near_lossless=*/mode == 2 ? 60 : 100);
+
+  size_t size = 0;
+  float psnr;
+  for (auto _ : state) {
+    peer.ClearCaches();
+    if (peer.GetPictureStats(0, &size, &psnr) != Thumbnailer::kOk) {
+      state.SkipWithError("GetPictureStats() failed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * pics[0]->width *
+                          pics[0]->height * 4);
+  state.counters["encodes"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["bytes"] = size;
+}
+BENCHMARK(BM_GetPictureStats)->Apply([](benchmark::internal::Benchmark* b) {
+  ModeArgs(b, "mode", 3);
+});
+
+// Assembly of the animation with fixed lossy settings.
+void BM_GenerateAnimationConfigured(benchmark::State& state) {
+  const std::vector<EnclosedWebPPicture> pics =
+      GeneratePics(state, state.range(0));
+  Thumbnailer thumbnailer;
+  if (!AddFrames(pics, &thumbnailer)) {
+    state.SkipWithError("AddFrame() failed");
+    return;
+  }
+  libwebp::ThumbnailerTestPeer peer(&thumbnailer);
+  peer.SetConfig(/*lossless=*/false, /*quality=*/75);
+
+  size_t size = 0;
+  for (auto _ : state) {
+    peer.ClearCaches();
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    if (peer.GenerateAnimationConfigured(&webp_data) != Thumbnailer::kOk) {
+      state.SkipWithError("GenerateAnimationConfigured() failed");
+      break;
+    }
+    size = webp_data.size;
+    WebPDataClear(&webp_data);
+  }
+  state.counters["encodes"] = benchmark::Counter(
+      state.iterations() * pics.size(), benchmark::Counter::kIsRate);
+  state.counters["bytes"] = size;
+}
+BENCHMARK(BM_GenerateAnimationConfigured)->Apply(FrameArgs);
+
+// PSNR of all frames of a generated animation against the originals.
+void BM_AnimData2PSNR(benchmark::State& state) {
+  std::vector<EnclosedWebPPicture> pics = GeneratePics(state, state.range(0));
+  Thumbnailer thumbnailer;
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  if (!AddFrames(pics, &thumbnailer) ||
+      thumbnailer.GenerateAnimation(&webp_data) != Thumbnailer::kOk) {
+    state.SkipWithError("GenerateAnimation() failed");
+    return;
+  }
+  std::vector<libwebp::Frame> frames;
+  for (std::size_t i = 0; i < pics.size(); ++i) {
+    frames.push_back({std::move(pics[i]), int(i + 1) * 100});
+  }
+
+  for (auto _ : state) {
+    libwebp::ThumbnailStatsPSNR stats;
+    if (libwebp::AnimData2PSNR(frames, &webp_data, &stats) != libwebp::kOk) {
+      state.SkipWithError("AnimData2PSNR() failed");
+      break;
+    }
+  }
+  state.counters["frames"] = benchmark::Counter(
+      state.iterations() * frames.size(), benchmark::Counter::kIsRate);
+  state.counters["bytes"] = webp_data.size;
+  WebPDataClear(&webp_data);
+}
+BENCHMARK(BM_AnimData2PSNR)->Apply(FrameArgs);
+
+// The JPEG formats differ by how they are read: as is, downscaled to a
+// quarter of their width (mostly by libjpeg's DCT-domain scaling), or as YUV.
+enum Format {
+  kWebPLossy = 0,
+  kWebPLossless,
+  kPNG,
+  kTIFF,
+  kPAM,
+  kJPEG,
+  kJPEGScaled,
+  kJPEGYUV,
+  kNumFormats
+};
+
+// Encodes 'pic' to 'format' in '*data'. Returns false on error.
+bool EncodePicture(const WebPPicture& pic, Format format,
+                   std::vector<uint8_t>* const data) {
+  if (format == kWebPLossy || format == kWebPLossless) {
+    WebPConfig config;
+    if (!WebPConfigInit(&config)) return false;
+    config.lossless = (format == kWebPLossless);
+    WebPPicture copy;
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    if (!WebPPictureCopy(&pic, &copy)) return false;
+    copy.writer = WebPMemoryWrite;
+    copy.custom_ptr = &writer;
+    const bool ok = WebPEncode(&config, &copy);
+    if (ok) data->assign(writer.mem, writer.mem + writer.size);
+    WebPPictureFree(&copy);
+    WebPMemoryWriterClear(&writer);
+    return ok;
+  }
+  if (format == kJPEG || format == kJPEGScaled || format == kJPEGYUV) {
+    const std::string jpeg = EncodeJPEG(pic, /*quality=*/90);
+    data->assign(jpeg.begin(), jpeg.end());
+    return true;
+  }
+
+  // The image_enc.h writers take decoded RGBA samples.
+  std::vector<uint8_t> rgba;
+  for (int y = 0; y < pic.height; ++y) {
+    for (int x = 0; x < pic.width; ++x) {
+      const uint32_t argb = pic.argb[y * pic.argb_stride + x];
+      rgba.insert(rgba.end(), {uint8_t(argb >> 16), uint8_t(argb >> 8),
+                               uint8_t(argb), uint8_t(argb >> 24)});
+    }
+  }
+  WebPDecBuffer buffer;
+  if (!WebPInitDecBuffer(&buffer)) return false;
+  buffer.colorspace = MODE_RGBA;
+  buffer.width = pic.width;
+  buffer.height = pic.height;
+  buffer.is_external_memory = 1;
+  buffer.u.RGBA.rgba = rgba.data();
+  buffer.u.RGBA.stride = pic.width * 4;
+  buffer.u.RGBA.size = rgba.size();
+
+  char* mem = nullptr;
+  size_t mem_size = 0;
+  FILE* const file = open_memstream(&mem, &mem_size);
+  if (file == nullptr) return false;
+  const bool ok = (format == kPNG)    ? WebPWritePNG(file, &buffer)
+                  : (format == kTIFF) ? WebPWriteTIFF(file, &buffer)
+                                      : WebPWritePAM(file, &buffer);
+  fclose(file);
+  if (ok) data->assign(mem, mem + mem_size);
+  free(mem);
+  return ok;
+}
+
+// Decoding of a picture in each format (see Format).
+void BM_ReadPicture(benchmark::State& state) {
+  const std::vector<EnclosedWebPPicture> pics = GeneratePics(state, 1);
+  const Format format = Format(state.range(0));
+  std::vector<uint8_t> data;
+  if (!EncodePicture(*pics[0], format, &data)) {
+    state.SkipWithError("Encoding failed");
+    return;
+  }
+  libwebp::ReadPictureOption option;
+  if (format == kJPEGScaled) option.target_width = pics[0]->width / 4;
+  option.allow_yuv = (format == kJPEGYUV);
+
+  for (auto _ : state) {
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic) ||
+        !libwebp::ReadPicture(data.data(), data.size(), &pic, option)) {
+      state.SkipWithError("ReadPicture() failed");
+      break;
+    }
+    WebPPictureFree(&pic);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  state.counters["pictures"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["bytes"] = data.size();
+}
+BENCHMARK(BM_ReadPicture)->Apply([](benchmark::internal::Benchmark* b) {
+  ModeArgs(b, "format", kNumFormats);
+});
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,456 @@
+// Copyright 2020 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Animated WebP and GIF decoder
+
+#include "./animdec.h"
+
+#ifdef HAVE_CONFIG_H
+#include "webp/config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webp/decode.h"
+#include "webp/demux.h"
+#include "webp/encode.h"
+#include "./imageio_util.h"
+
+// GIF disposal methods.
+enum {
+  GIF_DISPOSE_NONE = 1,
+  GIF_DISPOSE_BACKGROUND = 2,
+  GIF_DISPOSE_PREVIOUS = 3
+};
+
+#define GIF_MAX_CODES 4096  // LZW codes are at most 12-bit long.
+
+struct AnimReader {
+  int width, height;        // Canvas dimensions.
+  int timestamp_ms;         // Ending timestamp of the last frame.
+
+  // Animated WebP.
+  WebPAnimDecoder* dec;
+
+  // GIF.
+  const uint8_t* data;
+  size_t data_size;
+  size_t pos;               // Read position in 'data'.
+  uint32_t* canvas;         // In-memory layout of WebPPicture::argb.
+  uint32_t* prev_canvas;    // Canvas saved for GIF_DISPOSE_PREVIOUS.
+  uint32_t palette[256];    // Global color table.
+  int dispose;              // Disposal method of the last frame and its
+  int rect_left, rect_top;  // rectangle, clipped to the canvas.
+  int rect_right, rect_bottom;
+  uint8_t* lzw;             // Image data gathered from its sub-blocks.
+  size_t lzw_capacity;
+};
+
+static int CopyCanvas(const uint8_t* const canvas, int width, int height,
+                      WebPPicture* const pic) {
+  pic->use_argb = 1;
+  pic->width = width;
+  pic->height = height;
+  if (!WebPPictureAlloc(pic)) return 0;
+  ImgIoUtilCopyPlane(canvas, width * 4, (uint8_t*)pic->argb,
+                     pic->argb_stride * 4, width * 4, height);
+  return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Animated WebP
+
+static int WebPReaderInit(AnimReader* const reader, const uint8_t* const data,
+                          size_t data_size) {
+  WebPData webp_data;
+  WebPAnimDecoderOptions options;
+  WebPAnimInfo info;
+  webp_data.bytes = data;
+  webp_data.size = data_size;
+  if (!WebPAnimDecoderOptionsInit(&options)) return 0;
+  // Decode straight into the in-memory layout of WebPPicture::argb.
+#ifdef WORDS_BIGENDIAN
+  options.color_mode = MODE_ARGB;
+#else
+  options.color_mode = MODE_BGRA;
+#endif
+  reader->dec = WebPAnimDecoderNew(&webp_data, &options);
+  if (reader->dec == NULL || !WebPAnimDecoderGetInfo(reader->dec, &info)) {
+    fprintf(stderr, "Error parsing WebP animation.\n");
+    return 0;
+  }
+  reader->width = (int)info.canvas_width;
+  reader->height = (int)info.canvas_height;
+  return 1;
+}
+
+static AnimStatus WebPReadFrame(AnimReader* const reader,
+                                WebPPicture* const pic) {
+  uint8_t* canvas;
+  if (!WebPAnimDecoderHasMoreFrames(reader->dec)) return ANIM_END;
+  if (!WebPAnimDecoderGetNext(reader->dec, &canvas, &reader->timestamp_ms) ||
+      !CopyCanvas(canvas, reader->width, reader->height, pic)) {
+    return ANIM_ERROR;
+  }
+  return ANIM_FRAME_OK;
+}
+
+// -----------------------------------------------------------------------------
+// GIF
+
+// Returns a pointer to the next 'size' bytes, or NULL if the data is too short.
+static const uint8_t* GIFRead(AnimReader* const reader, size_t size) {
+  const uint8_t* const ptr = reader->data + reader->pos;
+  if (size > reader->data_size - reader->pos) return NULL;
+  reader->pos += size;
+  return ptr;
+}
+
+static int GIFReadPalette(AnimReader* const reader, int num_colors,
+                          uint32_t palette[256]) {
+  const uint8_t* const rgb = GIFRead(reader, 3 * num_colors);
+  int i;
+  if (rgb == NULL) return 0;
+  for (i = 0; i < num_colors; ++i) {
+    palette[i] = 0xff000000u | ((uint32_t)rgb[3 * i + 0] << 16) |
+                 ((uint32_t)rgb[3 * i + 1] << 8) | rgb[3 * i + 2];
+  }
+  for (; i < 256; ++i) palette[i] = 0xff000000u;  // out-of-range: black
+  return 1;
+}
+
+// Skips a sequence of data sub-blocks, or gathers them into 'reader->lzw' if
+// 'lzw_size' is not NULL.
+static int GIFReadSubBlocks(AnimReader* const reader, size_t* const lzw_size) {
+  if (lzw_size != NULL) *lzw_size = 0;
+  while (1) {
+    const uint8_t* const block_size = GIFRead(reader, 1);
+    const uint8_t* block;
+    if (block_size == NULL) return 0;
+    if (*block_size == 0) return 1;
+    block = GIFRead(reader, *block_size);
+    if (block == NULL) return 0;
+    if (lzw_size == NULL) continue;
+    if (*lzw_size + *block_size > reader->lzw_capacity) {
+      const size_t new_capacity = 2 * (*lzw_size + *block_size);
+      uint8_t* const new_lzw = (uint8_t*)realloc(reader->lzw, new_capacity);
+      if (new_lzw == NULL) return 0;
+      reader->lzw = new_lzw;
+      reader->lzw_capacity = new_capacity;
+    }
+    memcpy(reader->lzw + *lzw_size, block, *block_size);
+    *lzw_size += *block_size;
+  }
+}
+
+static int GIFReaderInit(AnimReader* const reader, const uint8_t* const data,
+                         size_t data_size) {
+  const uint8_t* screen;
+  reader->data = data;
+  reader->data_size = data_size;
+  reader->pos = 6;   // signature
+  screen = GIFRead(reader, 7);
+  if (screen == NULL) return 0;
+  reader->width = screen[0] | (screen[1] << 8);
+  reader->height = screen[2] | (screen[3] << 8);
+  if (reader->width == 0 || reader->height == 0 ||
+      reader->width > WEBP_MAX_DIMENSION ||
+      reader->height > WEBP_MAX_DIMENSION) {
+    fprintf(stderr, "Invalid %dx%d dimension for GIF\n",
+            reader->width, reader->height);
+    return 0;
+  }
+  if (screen[4] & 0x80) {
+    if (!GIFReadPalette(reader, 2 << (screen[4] & 7), reader->palette)) {
+      return 0;
+    }
+  } else {
+    (void)GIFReadPalette(reader, 0, reader->palette);
+  }
+  // The background color is ignored: like gif2webp, the canvas starts (and is
+  // disposed to) fully transparent.
+  reader->canvas = (uint32_t*)calloc((size_t)reader->width * reader->height,
+                                     sizeof(*reader->canvas));
+  return (reader->canvas != NULL);
+}
+
+static int GIFInterlacedRow(int i, int height) {
+  const int pass1 = (height + 7) / 8;
+  const int pass2 = (height + 3) / 8;
+  const int pass3 = (height + 1) / 4;
+  if (i < pass1) return i * 8;
+  i -= pass1;
+  if (i < pass2) return 4 + i * 8;
+  i -= pass2;
+  if (i < pass3) return 2 + i * 4;
+  i -= pass3;
+  return 1 + i * 2;
+}
+
+typedef struct {
+  AnimReader* reader;
+  const uint32_t* palette;
+  int transparent;           // Transparent color index, or -1.
+  int left, top, width, height, interlaced;
+  int col, row;              // Position in the frame of the next index.
+  uint32_t* dst;             // Canvas row of 'row', NULL if clipped.
+} GIFWriter;
+
+static void GIFWriterSetRow(GIFWriter* const writer) {
+  const int y = writer->top +
+      (writer->interlaced ? GIFInterlacedRow(writer->row, writer->height)
+                          : writer->row);
+  writer->dst = (y < writer->reader->height)
+              ? writer->reader->canvas + (size_t)y * writer->reader->width
+              : NULL;
+}
+
+static void GIFWriterPut(GIFWriter* const writer, int index) {
+  const int x = writer->left + writer->col;
+  if (writer->dst != NULL && x < writer->reader->width &&
+      index != writer->transparent) {
+    writer->dst[x] = writer->palette[index];
+  }
+  if (++writer->col == writer->width) {
+    writer->col = 0;
+    if (++writer->row < writer->height) GIFWriterSetRow(writer);
+  }
+}
+
+// Decodes the LZW-compressed color indices of a frame onto the canvas.
+// Truncated data leaves the rest of the frame untouched, like browsers do.
+static int GIFDecodeIndices(GIFWriter* const writer, int min_code_size,
+                            const uint8_t* const data, size_t data_size) {
+  const int clear_code = 1 << min_code_size;
+  const int end_code = clear_code + 1;
+  uint16_t prefix[GIF_MAX_CODES];
+  uint8_t suffix[GIF_MAX_CODES];
+  uint8_t stack[GIF_MAX_CODES];
+  int next_code = clear_code + 2;
+  int code_size = min_code_size + 1;
+  int prev_code = -1;
+  int first = 0;   // First index of the string of 'prev_code'.
+  uint32_t bits = 0;
+  int num_bits = 0;
+  size_t pos = 0;
+
+  GIFWriterSetRow(writer);
+  while (writer->row < writer->height) {
+    int code, in_code, sp = 0;
+    while (num_bits < code_size) {
+      if (pos == data_size) return 1;
+      bits |= (uint32_t)data[pos++] << num_bits;
+      num_bits += 8;
+    }
+    code = bits & ((1u << code_size) - 1);
+    bits >>= code_size;
+    num_bits -= code_size;
+
+    if (code == clear_code) {
+      next_code = clear_code + 2;
+      code_size = min_code_size + 1;
+      prev_code = -1;
+      continue;
+    }
+    if (code == end_code) break;
+    if (prev_code == -1) {
+      if (code > clear_code) return 0;
+      GIFWriterPut(writer, code);
+      prev_code = first = code;
+      continue;
+    }
+    if (code > next_code) return 0;
+
+    in_code = code;
+    if (code == next_code) {   // The string of 'prev_code' plus its first.
+      stack[sp++] = first;
+      code = prev_code;
+    }
+    while (code > clear_code) {
+      stack[sp++] = suffix[code];
+      code = prefix[code];
+    }
+    first = code;
+    stack[sp++] = first;
+    if (next_code < GIF_MAX_CODES) {
+      prefix[next_code] = prev_code;
+      suffix[next_code] = first;
+      ++next_code;
+      if (next_code == (1 << code_size) && code_size < 12) ++code_size;
+    }
+    prev_code = in_code;
+    while (sp > 0 && writer->row < writer->height) {
+      GIFWriterPut(writer, stack[--sp]);
+    }
+  }
+  return 1;
+}
+
+// Applies the disposal method of the last frame.
+static void GIFDispose(AnimReader* const reader) {
+  int y;
+  if (reader->dispose == GIF_DISPOSE_BACKGROUND) {
+    for (y = reader->rect_top; y < reader->rect_bottom; ++y) {
+      memset(reader->canvas + (size_t)y * reader->width + reader->rect_left, 0,
+             (reader->rect_right - reader->rect_left) *
+                 sizeof(*reader->canvas));
+    }
+  } else if (reader->dispose == GIF_DISPOSE_PREVIOUS) {
+    memcpy(reader->canvas, reader->prev_canvas,
+           (size_t)reader->width * reader->height * sizeof(*reader->canvas));
+  }
+}
+
+static AnimStatus GIFReadFrame(AnimReader* const reader,
+                               WebPPicture* const pic) {
+  int dispose = GIF_DISPOSE_NONE;
+  int delay_ms = 0;
+  int transparent = -1;
+  uint32_t local_palette[256];
+  const uint8_t* desc;
+  const uint8_t* min_code_size;
+  size_t lzw_size;
+  GIFWriter writer;
+
+  // Skip to the next image descriptor, keeping its graphic control extension.
+  while (1) {
+    const uint8_t* const block = GIFRead(reader, 1);
+    if (block == NULL || *block == 0x3b) return ANIM_END;  // trailer
+    if (*block == 0x2c) break;
+    if (*block == 0x21) {   // extension
+      const uint8_t* const label = GIFRead(reader, 1);
+      if (label == NULL) return ANIM_ERROR;
+      if (*label == 0xf9) {
+        const uint8_t* const gce = GIFRead(reader, 5);
+        if (gce == NULL || gce[0] != 4) return ANIM_ERROR;
+        dispose = (gce[1] >> 2) & 7;
+        delay_ms = 10 * (gce[2] | (gce[3] << 8));
+        transparent = (gce[1] & 1) ? gce[4] : -1;
+      }
+      if (!GIFReadSubBlocks(reader, NULL)) return ANIM_ERROR;
+    } else {
+      fprintf(stderr, "Invalid GIF block 0x%02x.\n", *block);
+      return ANIM_ERROR;
+    }
+  }
+
+  desc = GIFRead(reader, 9);
+  if (desc == NULL) return ANIM_ERROR;
+  writer.reader = reader;
+  writer.palette = reader->palette;
+  writer.transparent = transparent;
+  writer.left = desc[0] | (desc[1] << 8);
+  writer.top = desc[2] | (desc[3] << 8);
+  writer.width = desc[4] | (desc[5] << 8);
+  writer.height = desc[6] | (desc[7] << 8);
+  writer.interlaced = !!(desc[8] & 0x40);
+  writer.col = writer.row = 0;
+  if (desc[8] & 0x80) {
+    if (!GIFReadPalette(reader, 2 << (desc[8] & 7), local_palette)) {
+      return ANIM_ERROR;
+    }
+    writer.palette = local_palette;
+  }
+  min_code_size = GIFRead(reader, 1);
+  if (min_code_size == NULL || *min_code_size < 1 || *min_code_size > 8 ||
+      !GIFReadSubBlocks(reader, &lzw_size)) {
+    return ANIM_ERROR;
+  }
+
+  GIFDispose(reader);
+  if (dispose == GIF_DISPOSE_PREVIOUS) {
+    const size_t canvas_size =
+        (size_t)reader->width * reader->height * sizeof(*reader->canvas);
+    if (reader->prev_canvas == NULL) {
+      reader->prev_canvas = (uint32_t*)malloc(canvas_size);
+      if (reader->prev_canvas == NULL) return ANIM_ERROR;
+    }
+    memcpy(reader->prev_canvas, reader->canvas, canvas_size);
+  }
+  if (writer.width > 0 && writer.height > 0 &&
+      !GIFDecodeIndices(&writer, *min_code_size, reader->lzw, lzw_size)) {
+    fprintf(stderr, "Invalid GIF image data.\n");
+    return ANIM_ERROR;
+  }
+  reader->dispose = dispose;
+  reader->rect_left = (writer.left < reader->width) ? writer.left
+                                                    : reader->width;
+  reader->rect_top = (writer.top < reader->height) ? writer.top
+                                                   : reader->height;
+  reader->rect_right = (writer.left + writer.width < reader->width)
+                     ? writer.left + writer.width : reader->width;
+  reader->rect_bottom = (writer.top + writer.height < reader->height)
+                      ? writer.top + writer.height : reader->height;
+
+  // Browsers (and gif2webp) display frames with a tiny delay for 100 ms.
+  if (delay_ms <= 10) delay_ms = 100;
+  reader->timestamp_ms += delay_ms;
+  return CopyCanvas((const uint8_t*)reader->canvas, reader->width,
+                    reader->height, pic) ? ANIM_FRAME_OK : ANIM_ERROR;
+}
+
+// -----------------------------------------------------------------------------
+
+static int IsGIF(const uint8_t* const data, size_t data_size) {
+  return data_size >= 6 &&
+         (!memcmp(data, "GIF87a", 6) || !memcmp(data, "GIF89a", 6));
+}
+
+static int IsWebP(const uint8_t* const data, size_t data_size) {
+  return data_size >= 12 && !memcmp(data, "RIFF", 4) &&
+         !memcmp(data + 8, "WEBP", 4);
+}
+
+int AnimReaderIsSupported(const uint8_t* const data, size_t data_size) {
+  return (data != NULL) && (IsGIF(data, data_size) || IsWebP(data, data_size));
+}
+
+AnimReader* AnimReaderNew(const uint8_t* const data, size_t data_size) {
+  AnimReader* reader;
+  int ok;
+  if (!AnimReaderIsSupported(data, data_size)) {
+    fprintf(stderr, "Unsupported animation format.\n");
+    return NULL;
+  }
+  reader = (AnimReader*)calloc(1, sizeof(*reader));
+  if (reader == NULL) return NULL;
+  ok = IsGIF(data, data_size) ? GIFReaderInit(reader, data, data_size)
+                              : WebPReaderInit(reader, data, data_size);
+  if (!ok) {
+    AnimReaderDelete(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+void AnimReaderDelete(AnimReader* const reader) {
+  if (reader == NULL) return;
+  WebPAnimDecoderDelete(reader->dec);
+  free(reader->canvas);
+  free(reader->prev_canvas);
+  free(reader->lzw);
+  free(reader);
+}
+
+AnimStatus AnimReaderReadFrame(AnimReader* const reader,
+                               WebPPicture* const pic,
+                               int* const timestamp_ms) {
+  AnimStatus status;
+  if (reader == NULL || pic == NULL || timestamp_ms == NULL) {
+    return ANIM_ERROR;
+  }
+  status = (reader->dec != NULL) ? WebPReadFrame(reader, pic)
+                                 : GIFReadFrame(reader, pic);
+  if (status == ANIM_FRAME_OK) *timestamp_ms = reader->timestamp_ms;
+  return status;
+}
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,51 @@
+// Copyright 2020 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Frame-by-frame reader for animated WebP and GIF images.
+
+#ifndef WEBP_IMAGEIO_ANIMDEC_H_
+#define WEBP_IMAGEIO_ANIMDEC_H_
+
+#include "webp/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct WebPPicture;
+
+typedef struct AnimReader AnimReader;
+
+typedef enum {
+  ANIM_FRAME_OK = 0,  // A frame was read.
+  ANIM_END,           // No more frames.
+  ANIM_ERROR          // Malformed animation or memory error.
+} AnimStatus;
+
+// Returns true if 'data' starts like a WebP or GIF image.
+int AnimReaderIsSupported(const uint8_t* const data, size_t data_size);
+
+// Creates a reader for the WebP or GIF image in 'data', which must outlive the
+// reader. Returns NULL on error.
+AnimReader* AnimReaderNew(const uint8_t* const data, size_t data_size);
+
+// Releases 'reader'.
+void AnimReaderDelete(AnimReader* const reader);
+
+// Composes the next frame on the canvas of 'reader' and copies it into 'pic'
+// as ARGB. '*timestamp_ms' is set to the ending timestamp of the frame.
+AnimStatus AnimReaderReadFrame(AnimReader* const reader,
+                               struct WebPPicture* const pic,
+                               int* const timestamp_ms);
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif  // WEBP_IMAGEIO_ANIMDEC_H_
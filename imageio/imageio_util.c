@@ -15,6 +15,13 @@
 #if defined(_WIN32)
 #include <fcntl.h>   // for _O_BINARY
 #include <io.h>      // for _setmode()
+#elif defined(__unix__) || defined(__APPLE__)
+#define IMGIO_USE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 #include <stdlib.h>
 #include <string.h>
@@ -113,6 +120,106 @@ int ImgIoUtilReadFile(const char* const file_name,
   return 1;
 }
 
+#if defined(IMGIO_USE_MMAP)
+// Reads all the remaining data of 'fd', which may be a pipe that cannot be
+// opened a second time. Same output as ImgIoUtilReadFile().
+static int ReadFromFd(int fd, const char* const file_name,
+                      const uint8_t** data, size_t* data_size) {
+  static const size_t kBlockSize = 16384;  // default initial size
+  size_t max_size = 0;
+  size_t size = 0;
+  uint8_t* input = NULL;
+
+  while (1) {
+    ssize_t result;
+    if (size == max_size) {
+      // We double the buffer size each time and read as much as possible.
+      const size_t extra_size = (max_size == 0) ? kBlockSize : max_size;
+      // we allocate one extra byte for the \0 terminator
+      void* const new_data = realloc(input, max_size + extra_size + 1);
+      if (new_data == NULL) goto Error;
+      input = (uint8_t*)new_data;
+      max_size += extra_size;
+    }
+    result = read(fd, input + size, max_size - size);
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0) goto Error;
+    if (result == 0) break;
+    size += (size_t)result;
+  }
+  input[size] = '\0';  // convenient 0-terminator
+  *data = input;
+  *data_size = size;
+  return 1;
+
+ Error:
+  free(input);
+  WFPRINTF(stderr, "Could not read data from file %s\n",
+           (const W_CHAR*)file_name);
+  return 0;
+}
+#endif  // IMGIO_USE_MMAP
+
+int ImgIoUtilMapFile(const char* const file_name,
+                     const uint8_t** data, size_t* data_size, int* is_mapped) {
+  const int from_stdin = (file_name == NULL) || !WSTRCMP(file_name, "-");
+
+  if (data == NULL || data_size == NULL || is_mapped == NULL) return 0;
+  *data = NULL;
+  *data_size = 0;
+  *is_mapped = 0;
+
+#if defined(IMGIO_USE_MMAP)
+  if (!from_stdin) {
+    struct stat st;
+    int ok;
+    const int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+      WFPRINTF(stderr, "cannot open input file '%s'\n",
+               (const W_CHAR*)file_name);
+      return 0;
+    }
+    // Only regular files can be mapped, everything else is read.
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uint64_t)st.st_size == (size_t)st.st_size) {
+      void* const mapping =
+          mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED) {
+        // The decoders read the input front to back.
+        (void)madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+        close(fd);
+        *data = (const uint8_t*)mapping;
+        *data_size = (size_t)st.st_size;
+        *is_mapped = 1;
+        return 1;
+      }
+    }
+    // Pipes and devices are read from the same descriptor: reopening them
+    // would lose the data of the first opening.
+    ok = ReadFromFd(fd, file_name, data, data_size);
+    close(fd);
+    return ok;
+  }
+#else
+  (void)from_stdin;
+#endif
+  return ImgIoUtilReadFile(file_name, data, data_size);
+}
+
+void ImgIoUtilUnmapFile(const uint8_t* data, size_t data_size, int is_mapped) {
+  if (data == NULL) return;
+#if defined(IMGIO_USE_MMAP)
+  if (is_mapped) {
+    munmap((void*)data, data_size);
+    return;
+  }
+#else
+  (void)data_size;
+  (void)is_mapped;
+#endif
+  free((void*)data);
+}
+
 // -----------------------------------------------------------------------------
 
 int ImgIoUtilWriteFile(const char* const file_name,
@@ -148,6 +255,23 @@ void ImgIoUtilCopyPlane(const uint8_t* src, int src_stride,
 
 // -----------------------------------------------------------------------------
 
+void ImgIoUtilFitDimensions(int width, int height, int max_width,
+                            int max_height, int* fit_width, int* fit_height) {
+  int w = width, h = height;
+  if (max_width > 0 && w > max_width) {
+    h = (int)(((int64_t)h * max_width + w / 2) / w);
+    w = max_width;
+  }
+  if (max_height > 0 && h > max_height) {
+    w = (int)(((int64_t)w * max_height + h / 2) / h);
+    h = max_height;
+  }
+  *fit_width = (w < 1) ? 1 : w;
+  *fit_height = (h < 1) ? 1 : h;
+}
+
+// -----------------------------------------------------------------------------
+
 int ImgIoUtilCheckSizeArgumentsOverflow(uint64_t nmemb, size_t size) {
   const uint64_t total_size = nmemb * size;
   int ok = (total_size == (size_t)total_size);
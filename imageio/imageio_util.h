@@ -41,6 +41,20 @@ int ImgIoUtilReadFile(const char* const file_name,
 // Same as ImgIoUtilReadFile(), but reads until EOF from stdin instead.
 int ImgIoUtilReadFromStdin(const uint8_t** data, size_t* data_size);
 
+// Memory-maps the file 'file_name' read-only and returns the mapping and its
+// size in 'data' and 'data_size'. If the file can't be mapped (pipes, empty
+// files), it is read from the opened descriptor instead. Stdin and platforms
+// without mmap() fall back to ImgIoUtilReadFile().
+// '*is_mapped' is set to 1 if 'data' is a mapping, and to 0 if it was read
+// into memory. Returns 1 on success, 0 otherwise. '*data' should be released
+// using ImgIoUtilUnmapFile().
+// Note: unlike ImgIoUtilReadFile(), a mapped file is not null-terminated.
+int ImgIoUtilMapFile(const char* const file_name,
+                     const uint8_t** data, size_t* data_size, int* is_mapped);
+
+// Releases the 'data' returned by ImgIoUtilMapFile().
+void ImgIoUtilUnmapFile(const uint8_t* data, size_t data_size, int is_mapped);
+
 // Write a data segment into a file named 'file_name'. Returns true if ok.
 // If 'file_name' is NULL or equal to "-", output is written to stdout.
 int ImgIoUtilWriteFile(const char* const file_name,
@@ -54,6 +68,15 @@ void ImgIoUtilCopyPlane(const uint8_t* src, int src_stride,
 
 //------------------------------------------------------------------------------
 
+// Computes the largest dimensions fitting in 'max_width' x 'max_height' while
+// preserving the aspect ratio of 'width' x 'height', and stores them in
+// '*fit_width' and '*fit_height'. Pictures are never upscaled. A 'max_width'
+// or 'max_height' of 0 leaves that dimension unconstrained.
+void ImgIoUtilFitDimensions(int width, int height, int max_width,
+                            int max_height, int* fit_width, int* fit_height);
+
+//------------------------------------------------------------------------------
+
 // Returns 0 in case of overflow of nmemb * size.
 int ImgIoUtilCheckSizeArgumentsOverflow(uint64_t nmemb, size_t size);
 
@@ -255,15 +255,112 @@ static void ContextSetup(volatile struct jpeg_decompress_struct* const cinfo,
   ctx->pub.next_input_byte = NULL;
 }
 
+// Sets the smallest DCT scaling factor (M/8) for which the output is at least
+// as large as the image fitting in 'max_width' x 'max_height', which is
+// stored in 'fit_width' x 'fit_height'.
+static void SetupScaling(j_decompress_ptr dinfo, int max_width, int max_height,
+                         int* const fit_width, int* const fit_height) {
+  int scale_num;
+  ImgIoUtilFitDimensions((int)dinfo->image_width, (int)dinfo->image_height,
+                         max_width, max_height, fit_width, fit_height);
+  if (max_width <= 0 && max_height <= 0) return;
+  for (scale_num = 1; scale_num < 8; ++scale_num) {
+    // Same rounding as jpeg_calc_output_dimensions().
+    const int64_t scaled_width =
+        ((int64_t)dinfo->image_width * scale_num + 7) / 8;
+    const int64_t scaled_height =
+        ((int64_t)dinfo->image_height * scale_num + 7) / 8;
+    if (scaled_width >= *fit_width && scaled_height >= *fit_height) break;
+  }
+  dinfo->scale_num = scale_num;
+  dinfo->scale_denom = 8;
+}
+
+// Returns true if the YCbCr samples of the image can be used as is for a
+// YUV420 picture, i.e. if it is 4:2:0 and not scaled.
+static int IsRawYUV420(j_decompress_ptr dinfo) {
+  const jpeg_component_info* const comp = dinfo->comp_info;
+  return dinfo->num_components == 3 &&
+         dinfo->jpeg_color_space == JCS_YCbCr &&
+         comp[0].h_samp_factor == 2 && comp[0].v_samp_factor == 2 &&
+         comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1 &&
+         comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1 &&
+         dinfo->scale_num == dinfo->scale_denom;
+}
+
+// Decodes the samples of a 4:2:0 JPEG with jpeg_read_raw_data() into the
+// allocated YUV420 'pic'. JFIF samples are full-range, so they are mapped to
+// the limited range (Y in [16, 235], U/V in [16, 240]) used by libwebp.
+static void ReadRawYUV420(j_decompress_ptr dinfo, WebPPicture* const pic) {
+  // One iMCU row is made of 16 luma rows and 8 chroma rows.
+  const int luma_rows = dinfo->max_v_samp_factor * DCTSIZE;
+  const int chroma_rows = DCTSIZE;
+  const int uv_width = (pic->width + 1) >> 1;
+  const int uv_height = (pic->height + 1) >> 1;
+  uint8_t y_map[256], uv_map[256];
+  JSAMPARRAY rows[3];
+  int c, i;
+
+  for (i = 0; i < 256; ++i) {
+    y_map[i] = (uint8_t)(16 + (219 * i + 127) / 255);
+    uv_map[i] = (uint8_t)(16 + (224 * i + 127) / 255);
+  }
+
+  // libjpeg writes whole blocks, which may be wider and taller than the
+  // picture planes, so decode into scratch rows from the image pool.
+  for (c = 0; c < 3; ++c) {
+    rows[c] = (*dinfo->mem->alloc_sarray)(
+        (j_common_ptr)dinfo, JPOOL_IMAGE,
+        dinfo->comp_info[c].width_in_blocks * DCTSIZE,
+        (c == 0) ? luma_rows : chroma_rows);
+  }
+
+  while (dinfo->output_scanline < dinfo->output_height) {
+    const int y0 = (int)dinfo->output_scanline;
+    int x, y;
+    if (jpeg_read_raw_data(dinfo, rows, luma_rows) == 0) {
+      ERREXIT(dinfo, JERR_FILE_READ);
+    }
+    for (y = 0; y < luma_rows && y0 + y < pic->height; ++y) {
+      const JSAMPLE* const src = rows[0][y];
+      uint8_t* const dst = pic->y + (y0 + y) * pic->y_stride;
+      for (x = 0; x < pic->width; ++x) dst[x] = y_map[src[x]];
+    }
+    for (y = 0; y < chroma_rows && y0 / 2 + y < uv_height; ++y) {
+      const JSAMPLE* const src_u = rows[1][y];
+      const JSAMPLE* const src_v = rows[2][y];
+      uint8_t* const dst_u = pic->u + (y0 / 2 + y) * pic->uv_stride;
+      uint8_t* const dst_v = pic->v + (y0 / 2 + y) * pic->uv_stride;
+      for (x = 0; x < uv_width; ++x) {
+        dst_u[x] = uv_map[src_u[x]];
+        dst_v[x] = uv_map[src_v[x]];
+      }
+    }
+  }
+}
+
 int ReadJPEG(const uint8_t* const data, size_t data_size,
              WebPPicture* const pic, int keep_alpha,
              Metadata* const metadata) {
+  return ReadJPEGScaled(data, data_size, pic, keep_alpha, metadata, 0, 0,
+                        NULL, NULL);
+}
+
+int ReadJPEGScaled(const uint8_t* const data, size_t data_size,
+                   WebPPicture* const pic, int keep_alpha,
+                   Metadata* const metadata,
+                   int max_width, int max_height,
+                   int* const fit_width, int* const fit_height) {
   volatile int ok = 0;
   int width, height;
+  int scaled_width, scaled_height;
   int64_t stride;
   volatile struct jpeg_decompress_struct dinfo;
   struct my_error_mgr jerr;
   uint8_t* volatile rgb = NULL;
+  volatile int pic_allocated = 0;
+  int direct_argb = 0;
+  int raw_yuv;
   JSAMPROW buffer[1];
   JPEGReadContext ctx;
 
@@ -282,6 +379,7 @@ int ReadJPEG(const uint8_t* const data, size_t data_size,
  Error:
     MetadataFree(metadata);
     jpeg_destroy_decompress((j_decompress_ptr)&dinfo);
+    if (pic_allocated) WebPPictureFree(pic);
     goto End;
   }
 
@@ -291,30 +389,73 @@ int ReadJPEG(const uint8_t* const data, size_t data_size,
   jpeg_read_header((j_decompress_ptr)&dinfo, TRUE);
 
   dinfo.out_color_space = JCS_RGB;
+#if defined(JCS_ALPHA_EXTENSIONS)
+  // libjpeg-turbo can output the in-memory layout of WebPPicture::argb
+  // directly (using its SIMD color converters), so that scanlines are decoded
+  // straight into the picture without an intermediate RGB buffer.
+  direct_argb = pic->use_argb;
+  if (direct_argb) {
+#ifdef WORDS_BIGENDIAN
+    dinfo.out_color_space = JCS_EXT_ARGB;
+#else
+    dinfo.out_color_space = JCS_EXT_BGRA;
+#endif
+  }
+#endif
   dinfo.do_fancy_upsampling = TRUE;
+  SetupScaling((j_decompress_ptr)&dinfo, max_width, max_height,
+               &scaled_width, &scaled_height);
+  if (fit_width != NULL) *fit_width = scaled_width;
+  if (fit_height != NULL) *fit_height = scaled_height;
+
+  // YUV output of a 4:2:0 image skips both the YCbCr->RGB conversion here and
+  // the RGB->YUV one in the lossy encoder.
+  raw_yuv = !pic->use_argb && IsRawYUV420((j_decompress_ptr)&dinfo);
+  if (raw_yuv) {
+    dinfo.out_color_space = JCS_YCbCr;
+    dinfo.raw_data_out = TRUE;
+  }
 
   jpeg_start_decompress((j_decompress_ptr)&dinfo);
 
-  if (dinfo.output_components != 3) {
+  if (!raw_yuv && dinfo.output_components != (direct_argb ? 4 : 3)) {
     goto Error;
   }
 
   width = dinfo.output_width;
   height = dinfo.output_height;
-  stride = (int64_t)dinfo.output_width * dinfo.output_components * sizeof(*rgb);
 
-  if (stride != (int)stride ||
-      !ImgIoUtilCheckSizeArgumentsOverflow(stride, height)) {
-    goto Error;
-  }
+  if (raw_yuv) {
+    pic->width = width;
+    pic->height = height;
+    pic->colorspace = WEBP_YUV420;
+    if (!WebPPictureAlloc(pic)) goto Error;
+    pic_allocated = 1;
+    ReadRawYUV420((j_decompress_ptr)&dinfo, pic);
+  } else if (direct_argb) {
+    pic->width = width;
+    pic->height = height;
+    if (!WebPPictureAlloc(pic)) goto Error;
+    pic_allocated = 1;
+    stride = (int64_t)pic->argb_stride * sizeof(*pic->argb);
+    buffer[0] = (JSAMPLE*)pic->argb;
+  } else {
+    stride =
+        (int64_t)dinfo.output_width * dinfo.output_components * sizeof(*rgb);
+
+    if (stride != (int)stride ||
+        !ImgIoUtilCheckSizeArgumentsOverflow(stride, height)) {
+      goto Error;
+    }
 
-  rgb = (uint8_t*)malloc((size_t)stride * height);
-  if (rgb == NULL) {
-    goto Error;
+    rgb = (uint8_t*)malloc((size_t)stride * height);
+    if (rgb == NULL) {
+      goto Error;
+    }
+    buffer[0] = (JSAMPLE*)rgb;
   }
-  buffer[0] = (JSAMPLE*)rgb;
 
-  while (dinfo.output_scanline < dinfo.output_height) {
+  while (!raw_yuv && dinfo.output_scanline < dinfo.output_height) {
     if (jpeg_read_scanlines((j_decompress_ptr)&dinfo, buffer, 1) != 1) {
       goto Error;
     }
@@ -333,10 +474,14 @@ int ReadJPEG(const uint8_t* const data, size_t data_size,
   jpeg_destroy_decompress((j_decompress_ptr)&dinfo);
 
   // WebP conversion.
-  pic->width = width;
-  pic->height = height;
-  ok = WebPPictureImportRGB(pic, rgb, (int)stride);
-  if (!ok) goto Error;
+  if (direct_argb || raw_yuv) {
+    ok = 1;
+  } else {
+    pic->width = width;
+    pic->height = height;
+    ok = WebPPictureImportRGB(pic, rgb, (int)stride);
+    if (!ok) goto Error;
+  }
 
  End:
   free(rgb);
@@ -355,6 +500,18 @@ int ReadJPEG(const uint8_t* const data, size_t data_size,
           "development package before building.\n");
   return 0;
 }
+
+int ReadJPEGScaled(const uint8_t* const data, size_t data_size,
+                   struct WebPPicture* const pic, int keep_alpha,
+                   struct Metadata* const metadata,
+                   int max_width, int max_height,
+                   int* const fit_width, int* const fit_height) {
+  (void)max_width;
+  (void)max_height;
+  (void)fit_width;
+  (void)fit_height;
+  return ReadJPEG(data, data_size, pic, keep_alpha, metadata);
+}
 #endif  // WEBP_HAVE_JPEG
 
 // -----------------------------------------------------------------------------
@@ -22,7 +22,8 @@ struct Metadata;
 struct WebPPicture;
 
 // Reads a JPEG from 'data', returning the decoded output in 'pic'.
-// The output is RGB or YUV depending on pic->use_argb value.
+// The output is RGB or YUV depending on pic->use_argb value. The samples of
+// 4:2:0 JPEGs are copied to the YUV output without colorspace conversion.
 // Returns true on success.
 // 'keep_alpha' has no effect, but is kept for coherence with other signatures
 // for image readers.
@@ -30,6 +31,19 @@ int ReadJPEG(const uint8_t* const data, size_t data_size,
              struct WebPPicture* const pic, int keep_alpha,
              struct Metadata* const metadata);
 
+// Same as ReadJPEG(), but uses libjpeg's DCT-domain scaling to decode the
+// image directly at the smallest M/8 scale whose dimensions are still at least
+// the ones fitting in 'max_width' x 'max_height' (see ImgIoUtilFitDimensions).
+// The output may thus be slightly larger than requested and still needs to be
+// rescaled to the exact dimensions, which are stored in 'fit_width' x
+// 'fit_height' if not NULL. They are computed from the original dimensions of
+// the image, so that the rounding matches the one of the other formats.
+int ReadJPEGScaled(const uint8_t* const data, size_t data_size,
+                   struct WebPPicture* const pic, int keep_alpha,
+                   struct Metadata* const metadata,
+                   int max_width, int max_height,
+                   int* const fit_width, int* const fit_height);
+
 #ifdef __cplusplus
 }    // extern "C"
 #endif
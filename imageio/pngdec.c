@@ -242,6 +242,8 @@ int ReadPNG(const uint8_t* const data, size_t data_size,
   png_uint_32 width, height, y;
   int64_t stride;
   uint8_t* volatile rgb = NULL;
+  volatile int pic_allocated = 0;
+  int direct_argb;
 
   if (data == NULL || data_size == 0 || pic == NULL) return 0;
 
@@ -256,6 +258,7 @@ int ReadPNG(const uint8_t* const data, size_t data_size,
   if (setjmp(png_jmpbuf(png))) {
  Error:
     MetadataFree(metadata);
+    if (pic_allocated) WebPPictureFree(pic);
     goto End;
   }
 
@@ -304,17 +307,43 @@ int ReadPNG(const uint8_t* const data, size_t data_size,
     has_alpha = 0;
   }
 
+  // Have libpng output the in-memory layout of WebPPicture::argb, so that rows
+  // are decoded straight into the picture without an intermediate RGB buffer.
+  direct_argb = pic->use_argb;
+  if (direct_argb) {
+#ifdef WORDS_BIGENDIAN
+    if (has_alpha) {
+      png_set_swap_alpha(png);
+    } else {
+      png_set_filler(png, 0xff, PNG_FILLER_BEFORE);
+    }
+#else
+    png_set_bgr(png);
+    if (!has_alpha) png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+#endif
+  }
+
   num_passes = png_set_interlace_handling(png);
   png_read_update_info(png, info);
 
-  stride = (int64_t)(has_alpha ? 4 : 3) * width * sizeof(*rgb);
-  if (stride != (int)stride ||
-      !ImgIoUtilCheckSizeArgumentsOverflow(stride, height)) {
-    goto Error;
-  }
+  if (direct_argb) {
+    if (png_get_rowbytes(png, info) != (png_size_t)width * 4) goto Error;
+    pic->width = (int)width;
+    pic->height = (int)height;
+    if (!WebPPictureAlloc(pic)) goto Error;
+    pic_allocated = 1;
+    stride = (int64_t)pic->argb_stride * sizeof(*pic->argb);
+    rgb = (uint8_t*)pic->argb;
+  } else {
+    stride = (int64_t)(has_alpha ? 4 : 3) * width * sizeof(*rgb);
+    if (stride != (int)stride ||
+        !ImgIoUtilCheckSizeArgumentsOverflow(stride, height)) {
+      goto Error;
+    }
 
-  rgb = (uint8_t*)malloc((size_t)stride * height);
-  if (rgb == NULL) goto Error;
+    rgb = (uint8_t*)malloc((size_t)stride * height);
+    if (rgb == NULL) goto Error;
+  }
   for (p = 0; p < num_passes; ++p) {
     png_bytep row = rgb;
     for (y = 0; y < height; ++y) {
@@ -330,13 +359,17 @@ int ReadPNG(const uint8_t* const data, size_t data_size,
     goto Error;
   }
 
-  pic->width = (int)width;
-  pic->height = (int)height;
-  ok = has_alpha ? WebPPictureImportRGBA(pic, rgb, (int)stride)
-                 : WebPPictureImportRGB(pic, rgb, (int)stride);
+  if (direct_argb) {
+    ok = 1;
+  } else {
+    pic->width = (int)width;
+    pic->height = (int)height;
+    ok = has_alpha ? WebPPictureImportRGBA(pic, rgb, (int)stride)
+                   : WebPPictureImportRGB(pic, rgb, (int)stride);
 
-  if (!ok) {
-    goto Error;
+    if (!ok) {
+      goto Error;
+    }
   }
 
  End:
@@ -344,7 +377,7 @@ int ReadPNG(const uint8_t* const data, size_t data_size,
     png_destroy_read_struct((png_structpp)&png,
                             (png_infopp)&info, (png_infopp)&end_info);
   }
-  free(rgb);
+  if (!pic_allocated) free(rgb);
   return ok;
 }
 #else  // !WEBP_HAVE_PNG
@@ -137,10 +137,32 @@ static size_t ReadPAMFields(PNMInfo* const info, size_t off) {
   return off;
 }
 
+// Reads the next decimal value of a P5/P6 header, skipping the whitespaces
+// and comments before it. Returns the offset following the single whitespace
+// that ends the value, or 0 on error.
+static size_t ReadPNMValue(const uint8_t* const data, size_t off,
+                           size_t data_size, int* const value) {
+  while (off < data_size) {
+    if (data[off] == '#') {
+      while (off < data_size && data[off] != '\n') ++off;
+    } else if (isspace(data[off])) {
+      ++off;
+    } else {
+      break;
+    }
+  }
+  if (off == data_size || !isdigit(data[off])) return 0;
+  *value = 0;
+  while (off < data_size && isdigit(data[off])) {
+    if (*value > 65535) return 0;   // larger than any valid field
+    *value = *value * 10 + (data[off++] - '0');
+  }
+  if (off == data_size || !isspace(data[off])) return 0;
+  return off + 1;
+}
+
 static size_t ReadHeader(PNMInfo* const info) {
   size_t off = 0;
-  char out[MAX_LINE_SIZE + 1];
-  size_t out_size;
   if (info == NULL) return 0;
   if (info->data == NULL || info->data_size < kMinPNMHeaderSize) return 0;
 
@@ -151,17 +173,22 @@ static size_t ReadHeader(PNMInfo* const info) {
   info->depth = 0;
   info->max_value = 0;
 
-  off = ReadLine(info->data, off, info->data_size, out, &out_size);
-  if (off == 0 || sscanf(out, "P%d", &info->type) != 1) return 0;
+  if (info->data[0] != 'P' || !isdigit(info->data[1]) ||
+      !isspace(info->data[2])) {
+    return 0;
+  }
+  info->type = info->data[1] - '0';
+  off = 3;
   if (info->type == 7) {
     off = ReadPAMFields(info, off);
   } else {
-    off = ReadLine(info->data, off, info->data_size, out, &out_size);
-    if (off == 0 || sscanf(out, "%d %d", &info->width, &info->height) != 2) {
-      return 0;
-    }
-    off = ReadLine(info->data, off, info->data_size, out, &out_size);
-    if (off == 0 || sscanf(out, "%d", &info->max_value) != 1) return 0;
+    // The fields are whitespace-separated, possibly on a single line.
+    off = ReadPNMValue(info->data, off, info->data_size, &info->width);
+    if (off == 0) return 0;
+    off = ReadPNMValue(info->data, off, info->data_size, &info->height);
+    if (off == 0) return 0;
+    off = ReadPNMValue(info->data, off, info->data_size, &info->max_value);
+    if (off == 0) return 0;
 
     // finish initializing missing fields
     info->depth = (info->type == 5) ? 1 : 3;
@@ -177,6 +204,19 @@ static size_t ReadHeader(PNMInfo* const info) {
   return off;
 }
 
+size_t ReadPNMHeader(const uint8_t* const data, size_t data_size,
+                     uint64_t* const pixel_bytes) {
+  size_t offset;
+  PNMInfo info;
+  if (pixel_bytes == NULL) return 0;
+  info.data = data;
+  info.data_size = data_size;
+  offset = ReadHeader(&info);
+  if (offset == 0) return 0;
+  *pixel_bytes = (uint64_t)info.width * info.height * info.bytes_per_px;
+  return offset;
+}
+
 int ReadPNM(const uint8_t* const data, size_t data_size,
             WebPPicture* const pic, int keep_alpha,
             struct Metadata* const metadata) {
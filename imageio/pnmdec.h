@@ -30,6 +30,12 @@ int ReadPNM(const uint8_t* const data, size_t data_size,
             struct WebPPicture* const pic, int keep_alpha,
             struct Metadata* const metadata);
 
+// Parses the PNM header at the start of 'data'. Returns the header size in
+// bytes and stores the size of the pixel data following it in
+// '*pixel_bytes', or returns 0 on error.
+size_t ReadPNMHeader(const uint8_t* const data, size_t data_size,
+                     uint64_t* const pixel_bytes);
+
 #ifdef __cplusplus
 }    // extern "C"
 #endif
@@ -0,0 +1,375 @@
+// Copyright 2020 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Y4M and PAM stream decoder
+
+#include "./streamdec.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webp/encode.h"
+#include "./imageio_util.h"
+#include "./pnmdec.h"
+#include "../examples/unicode.h"
+
+#define MAX_LINE_SIZE 1024
+static const char kY4MSignature[] = "YUV4MPEG2";
+
+typedef enum {
+  STREAM_Y4M,
+  STREAM_PAM
+} StreamFormat;
+
+struct StreamReader {
+  FILE* file;
+  int close_file;
+  StreamFormat format;
+  int fps_num, fps_den;
+  int frame_count;
+
+  // Y4M only.
+  int width, height;
+  int is_mono;          // Luma only, chroma is set to neutral.
+  int is_full_range;    // Samples use the [0, 255] range.
+
+  // PAM only: current frame (header and pixel data), passed to ReadPNM().
+  uint8_t* buffer;
+  size_t buffer_size;
+  size_t buffer_capacity;
+};
+
+// -----------------------------------------------------------------------------
+// Helpers
+
+// Reads one line (including its '\n') into 'out'. Returns the number of bytes
+// read, 0 at the end of the file, or -1 if the line is too long.
+static int ReadLine(FILE* const file, char out[MAX_LINE_SIZE + 1]) {
+  int size = 0;
+  int c;
+  while ((c = getc(file)) != EOF) {
+    if (size == MAX_LINE_SIZE) return -1;
+    out[size++] = (char)c;
+    if (c == '\n') break;
+  }
+  out[size] = 0;   // safety sentinel
+  return size;
+}
+
+static int ReadBytes(FILE* const file, uint8_t* const dst, size_t size) {
+  return (size == 0) || (fread(dst, size, 1, file) == 1);
+}
+
+static int AppendToBuffer(StreamReader* const reader,
+                          const void* const data, size_t size) {
+  if (reader->buffer_size + size > reader->buffer_capacity) {
+    size_t new_capacity = 2 * reader->buffer_capacity;
+    uint8_t* new_buffer;
+    if (new_capacity < reader->buffer_size + size) {
+      new_capacity = reader->buffer_size + size;
+    }
+    new_buffer = (uint8_t*)realloc(reader->buffer, new_capacity);
+    if (new_buffer == NULL) return 0;
+    reader->buffer = new_buffer;
+    reader->buffer_capacity = new_capacity;
+  }
+  if (data != NULL) memcpy(reader->buffer + reader->buffer_size, data, size);
+  reader->buffer_size += size;
+  return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Y4M
+
+// inspired from https://wiki.multimedia.cx/index.php/YUV4MPEG2
+static int ReadY4MHeader(StreamReader* const reader, char* line) {
+  char* token;
+  int colorspace_ok = 1;
+  for (token = strtok(line + strlen(kY4MSignature), " \n"); token != NULL;
+       token = strtok(NULL, " \n")) {
+    switch (token[0]) {
+      case 'W': reader->width = atoi(token + 1); break;
+      case 'H': reader->height = atoi(token + 1); break;
+      case 'F':
+        if (sscanf(token + 1, "%d:%d", &reader->fps_num,
+                   &reader->fps_den) != 2) {
+          reader->fps_num = 0;
+        }
+        break;
+      case 'C':
+        // The chroma siting of the 4:2:0 variants is not taken into account.
+        reader->is_mono = !strcmp(token, "Cmono");
+        colorspace_ok = reader->is_mono || !strcmp(token, "C420") ||
+                        !strcmp(token, "C420jpeg") ||
+                        !strcmp(token, "C420paldv") ||
+                        !strcmp(token, "C420mpeg2");
+        if (!colorspace_ok) {
+          fprintf(stderr, "Unsupported Y4M colorspace %s.\n", token + 1);
+        }
+        break;
+      case 'X':
+        if (!strcmp(token, "XCOLORRANGE=FULL")) reader->is_full_range = 1;
+        break;
+      default:   // interlacing, aspect ratio: not relevant
+        break;
+    }
+  }
+  if (reader->width <= 0 || reader->height <= 0 ||
+      reader->width > WEBP_MAX_DIMENSION ||
+      reader->height > WEBP_MAX_DIMENSION) {
+    fprintf(stderr, "Invalid %dx%d dimension for Y4M\n",
+            reader->width, reader->height);
+    return 0;
+  }
+  if (reader->fps_num <= 0 || reader->fps_den <= 0) {
+    fprintf(stderr, "Invalid Y4M frame rate.\n");
+    return 0;
+  }
+  return colorspace_ok;
+}
+
+static void RemapPlane(uint8_t* plane, int width, int height, int stride,
+                       const uint8_t map[256]) {
+  int x, y;
+  for (y = 0; y < height; ++y, plane += stride) {
+    for (x = 0; x < width; ++x) plane[x] = map[plane[x]];
+  }
+}
+
+static StreamStatus ReadY4MFrame(StreamReader* const reader,
+                                 WebPPicture* const pic) {
+  const int use_argb = pic->use_argb;
+  const int uv_width = (reader->width + 1) >> 1;
+  const int uv_height = (reader->height + 1) >> 1;
+  char line[MAX_LINE_SIZE + 1];
+  int size, y;
+
+  size = ReadLine(reader->file, line);
+  if (size == 0) return STREAM_END;
+  if (size < 0 || strncmp(line, "FRAME", 5)) {
+    fprintf(stderr, "Invalid Y4M frame header.\n");
+    return STREAM_ERROR;
+  }
+
+  // Y4M samples are YUV, read them straight into the picture planes.
+  pic->width = reader->width;
+  pic->height = reader->height;
+  pic->use_argb = 0;
+  pic->colorspace = WEBP_YUV420;
+  if (!WebPPictureAlloc(pic)) return STREAM_ERROR;
+
+  for (y = 0; y < pic->height; ++y) {
+    if (!ReadBytes(reader->file, pic->y + y * pic->y_stride, pic->width)) {
+      goto Truncated;
+    }
+  }
+  if (reader->is_mono) {
+    for (y = 0; y < uv_height; ++y) {
+      memset(pic->u + y * pic->uv_stride, 128, uv_width);
+      memset(pic->v + y * pic->uv_stride, 128, uv_width);
+    }
+  } else {
+    for (y = 0; y < uv_height; ++y) {
+      if (!ReadBytes(reader->file, pic->u + y * pic->uv_stride, uv_width)) {
+        goto Truncated;
+      }
+    }
+    for (y = 0; y < uv_height; ++y) {
+      if (!ReadBytes(reader->file, pic->v + y * pic->uv_stride, uv_width)) {
+        goto Truncated;
+      }
+    }
+  }
+
+  if (reader->is_full_range) {
+    // Map to the limited range (Y in [16, 235], U/V in [16, 240]) used by
+    // libwebp.
+    uint8_t y_map[256], uv_map[256];
+    int i;
+    for (i = 0; i < 256; ++i) {
+      y_map[i] = (uint8_t)(16 + (219 * i + 127) / 255);
+      uv_map[i] = (uint8_t)(16 + (224 * i + 127) / 255);
+    }
+    RemapPlane(pic->y, pic->width, pic->height, pic->y_stride, y_map);
+    RemapPlane(pic->u, uv_width, uv_height, pic->uv_stride, uv_map);
+    RemapPlane(pic->v, uv_width, uv_height, pic->uv_stride, uv_map);
+  }
+
+  if (use_argb && !WebPPictureYUVAToARGB(pic)) {
+    WebPPictureFree(pic);
+    return STREAM_ERROR;
+  }
+  return STREAM_FRAME_OK;
+
+ Truncated:
+  fprintf(stderr, "Truncated Y4M frame #%d.\n", reader->frame_count);
+  WebPPictureFree(pic);
+  return STREAM_ERROR;
+}
+
+// -----------------------------------------------------------------------------
+// PAM
+
+// Gathers the header of the next frame in the buffer. P7 headers end with
+// the ENDHDR line. P5/P6 headers are whitespace-separated fields and comments,
+// possibly on a single line, so they end where ReadPNMHeader() first succeeds
+// after a whitespace. Returns STREAM_END if there are no more frames.
+static StreamStatus ReadPAMHeader(StreamReader* const reader) {
+  char line[MAX_LINE_SIZE + 1];
+  uint64_t pixel_bytes;
+  int c, size;
+
+  reader->buffer_size = 0;
+  c = getc(reader->file);
+  if (c == EOF) return STREAM_END;
+  // Signature: 'P', the type and a whitespace.
+  while (1) {
+    const uint8_t byte = (uint8_t)c;
+    if (!AppendToBuffer(reader, &byte, 1)) return STREAM_ERROR;
+    if (reader->buffer_size == 3) break;
+    c = getc(reader->file);
+    if (c == EOF) goto Invalid;
+  }
+  if (reader->buffer[0] != 'P' || !isspace(reader->buffer[2]) ||
+      (reader->buffer[1] != '5' && reader->buffer[1] != '6' &&
+       reader->buffer[1] != '7')) {
+    goto Invalid;
+  }
+
+  if (reader->buffer[1] == '7') {
+    do {
+      size = ReadLine(reader->file, line);
+      if (size <= 0) goto Invalid;
+      if (!AppendToBuffer(reader, line, size)) return STREAM_ERROR;
+    } while (strcmp(line, "ENDHDR\n"));
+  } else {
+    while (ReadPNMHeader(reader->buffer, reader->buffer_size,
+                         &pixel_bytes) != reader->buffer_size) {
+      do {   // up to the next whitespace
+        uint8_t byte;
+        c = getc(reader->file);
+        if (c == EOF || reader->buffer_size >= MAX_LINE_SIZE) goto Invalid;
+        byte = (uint8_t)c;
+        if (!AppendToBuffer(reader, &byte, 1)) return STREAM_ERROR;
+      } while (!isspace(c));
+    }
+  }
+  return STREAM_FRAME_OK;
+
+ Invalid:
+  fprintf(stderr, "Invalid or truncated PAM header of frame #%d.\n",
+          reader->frame_count);
+  return STREAM_ERROR;
+}
+
+static StreamStatus ReadPAMFrame(StreamReader* const reader,
+                                 WebPPicture* const pic) {
+  const StreamStatus status = ReadPAMHeader(reader);
+  size_t header_size;
+  uint64_t pixel_bytes;
+
+  if (status != STREAM_FRAME_OK) return status;
+  header_size = ReadPNMHeader(reader->buffer, reader->buffer_size,
+                              &pixel_bytes);
+  if (header_size != reader->buffer_size ||
+      pixel_bytes != (size_t)pixel_bytes) {
+    fprintf(stderr, "Error parsing PNM header.\n");
+    return STREAM_ERROR;
+  }
+
+  if (!AppendToBuffer(reader, NULL, (size_t)pixel_bytes) ||
+      !ReadBytes(reader->file, reader->buffer + header_size,
+                 (size_t)pixel_bytes)) {
+    fprintf(stderr, "Truncated PAM frame #%d.\n", reader->frame_count);
+    return STREAM_ERROR;
+  }
+  return ReadPNM(reader->buffer, reader->buffer_size, pic, 1, NULL)
+             ? STREAM_FRAME_OK : STREAM_ERROR;
+}
+
+// -----------------------------------------------------------------------------
+
+StreamReader* StreamReaderNew(const char* const file_name,
+                              double default_fps) {
+  const int from_stdin = (file_name == NULL) || !WSTRCMP(file_name, "-");
+  char line[MAX_LINE_SIZE + 1];
+  int c;
+  StreamReader* const reader = (StreamReader*)calloc(1, sizeof(*reader));
+  if (reader == NULL) return NULL;
+
+  if (from_stdin) {
+    reader->file = ImgIoUtilSetBinaryMode(stdin);
+  } else {
+    reader->file = WFOPEN(file_name, "rb");
+    reader->close_file = 1;
+  }
+  if (reader->file == NULL) {
+    WFPRINTF(stderr, "cannot open input file '%s'\n",
+             (const W_CHAR*)file_name);
+    goto Error;
+  }
+
+  // PAM streams have no global header, leave the first frame in the stream.
+  c = getc(reader->file);
+  if (c == 'P' && ungetc(c, reader->file) == c) {
+    reader->format = STREAM_PAM;
+    if (!(default_fps > 0.)) {
+      fprintf(stderr, "Invalid frame rate %f.\n", default_fps);
+      goto Error;
+    }
+    reader->fps_num = (int)(default_fps * 1000. + .5);
+    reader->fps_den = 1000;
+  } else if (c == kY4MSignature[0] && ungetc(c, reader->file) == c &&
+             ReadLine(reader->file, line) > 0 &&
+             !strncmp(line, kY4MSignature, strlen(kY4MSignature))) {
+    reader->format = STREAM_Y4M;
+    if (!ReadY4MHeader(reader, line)) goto Error;
+  } else {
+    fprintf(stderr, "Unsupported stream format.\n");
+    goto Error;
+  }
+  return reader;
+
+ Error:
+  StreamReaderDelete(reader);
+  return NULL;
+}
+
+void StreamReaderDelete(StreamReader* const reader) {
+  if (reader == NULL) return;
+  if (reader->close_file && reader->file != NULL) fclose(reader->file);
+  free(reader->buffer);
+  free(reader);
+}
+
+int StreamReaderIsYUV(const StreamReader* const reader) {
+  return (reader != NULL) && (reader->format == STREAM_Y4M);
+}
+
+StreamStatus StreamReaderReadFrame(StreamReader* const reader,
+                                   WebPPicture* const pic,
+                                   int* const timestamp_ms) {
+  StreamStatus status;
+  if (reader == NULL || pic == NULL || timestamp_ms == NULL) {
+    return STREAM_ERROR;
+  }
+  status = (reader->format == STREAM_Y4M) ? ReadY4MFrame(reader, pic)
+                                          : ReadPAMFrame(reader, pic);
+  if (status != STREAM_FRAME_OK) return status;
+
+  ++reader->frame_count;
+  *timestamp_ms = (int)(((int64_t)reader->frame_count * 1000 *
+                             reader->fps_den + reader->fps_num / 2) /
+                        reader->fps_num);
+  return STREAM_FRAME_OK;
+}
+
+// -----------------------------------------------------------------------------
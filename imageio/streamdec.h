@@ -0,0 +1,56 @@
+// Copyright 2020 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Sequential frame reader for Y4M and PAM streams (e.g. the output of a video
+// decoder piped to stdin).
+
+#ifndef WEBP_IMAGEIO_STREAMDEC_H_
+#define WEBP_IMAGEIO_STREAMDEC_H_
+
+#include "webp/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct WebPPicture;
+
+typedef struct StreamReader StreamReader;
+
+typedef enum {
+  STREAM_FRAME_OK = 0,  // A frame was read.
+  STREAM_END,           // No more frames.
+  STREAM_ERROR          // Malformed or truncated stream, or memory error.
+} StreamStatus;
+
+// Opens the Y4M or PAM stream 'file_name' ("-" or NULL for stdin) and parses
+// its header. Y4M streams carry their frame rate, 'default_fps' is used for
+// PAM streams. Returns NULL on error.
+StreamReader* StreamReaderNew(const char* const file_name, double default_fps);
+
+// Closes the stream and releases 'reader'.
+void StreamReaderDelete(StreamReader* const reader);
+
+// Returns true if the frames are made of YUV samples (Y4M), in which case
+// reading them into a YUV picture (pic->use_argb == 0) avoids any colorspace
+// conversion.
+int StreamReaderIsYUV(const StreamReader* const reader);
+
+// Reads the next frame into 'pic'. The output is RGB or YUV depending on
+// pic->use_argb value. '*timestamp_ms' is set to the ending timestamp of the
+// frame, derived from the frame rate.
+StreamStatus StreamReaderReadFrame(StreamReader* const reader,
+                                   struct WebPPicture* const pic,
+                                   int* const timestamp_ms);
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif  // WEBP_IMAGEIO_STREAMDEC_H_
@@ -13,19 +13,53 @@
 // limitations under the License.
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
+#include "google/protobuf/text_format.h"
+#include "google/protobuf/util/json_util.h"
+#include "../imageio/animdec.h"
+#include "../imageio/streamdec.h"
 #include "thumbnailer.h"
+#include "thumbnailer_service.h"
 #include "utils/thumbnailer_utils.h"
 
 ABSL_FLAG(std::string, o, "out.webp", "Output file name.");
+ABSL_FLAG(bool, stream, false,
+          "Read the frames from a Y4M or PAM stream ('-' for stdin) instead of "
+          "a frame list.");
+ABSL_FLAG(double, fps, 25., "Frame rate of PAM streams.");
+ABSL_FLAG(bool, anim, false,
+          "Read the frames from an animated WebP or GIF file instead of a "
+          "frame list.");
+ABSL_FLAG(bool, batch, false,
+          "Run the jobs of a ThumbnailerBatch text proto instead of a single "
+          "frame list.");
+ABSL_FLAG(uint32_t, jobs, 0,
+          "Number of batch jobs or service connections handled in parallel "
+          "(0 = one per hardware thread).");
+ABSL_FLAG(std::string, serve, "",
+          "Serve ThumbnailerRequest messages on this Unix domain socket "
+          "instead of processing inputs.");
+ABSL_FLAG(uint32_t, batch_memory_mb, 0,
+          "Approximate limit of the memory used by the frames of the batch "
+          "jobs running in parallel, in MiB (0 = unlimited).");
 
 // Thumbnailer algorithm options.
+ABSL_FLAG(std::vector<std::string>, budget_ladder, {},
+          "Comma-separated list of byte budgets. One animation is generated "
+          "per budget, named after -o with the budget as suffix.");
 ABSL_FLAG(uint32_t, soft_max_size, 153600,
           "Desired (soft) maximum size limit in bytes.");
 ABSL_FLAG(uint32_t, hard_max_size, 153600,
@@ -33,6 +67,21 @@ ABSL_FLAG(uint32_t, hard_max_size, 153600,
           "'soft_max_size', it will be set to 'soft_max_size'.");
 ABSL_FLAG(float, slope_dpsnr, 1.0,
           "Maximum PSNR change used in slope optimization.");
+ABSL_FLAG(uint32_t, decimation_quality, 50,
+          "Quality (0..100) that temporal decimation drops frames to reach.");
+ABSL_FLAG(bool, warm_start, false,
+          "Start the quality search from a range predicted from the content "
+          "complexity of the frames.");
+ABSL_FLAG(float, cluster_psnr, 0,
+          "Share the rate-distortion probes of consecutive frames whose "
+          "signatures are within this PSNR (in dB) of each other (0 = off).");
+ABSL_FLAG(uint32_t, target_width, 0,
+          "Downscale input frames to at most this width (0 = unconstrained).");
+ABSL_FLAG(uint32_t, target_height, 0,
+          "Downscale input frames to at most this height (0 = unconstrained).");
+ABSL_FLAG(bool, jpeg_yuv, false,
+          "Decode JPEG frames to YUV, skipping the colorspace conversions for "
+          "4:2:0 JPEGs.");
 
 // WebP encoding options.
 ABSL_FLAG(uint32_t, loop_count, 0,
@@ -44,26 +93,432 @@ ABSL_FLAG(bool, allow_mixed, false, "Use mixed lossy/lossless compression.");
 
 // Binary options.
 ABSL_FLAG(bool, verbose, false, "Print various encoding statistics.");
+ABSL_FLAG(std::string, stats_output, "",
+          "Write the ThumbnailerStats of the generation to this file ('-' for "
+          "stdout).");
+ABSL_FLAG(std::string, stats_format, "text",
+          "Format of -stats_output: 'text' (text proto) or 'json'.");
+ABSL_FLAG(uint64_t, max_memory_bytes, 0,
+          "Limit of the estimated memory held by each generation (0 = "
+          "unlimited). Caches are dropped to stay under it.");
+ABSL_FLAG(std::string, trace_output, "",
+          "Write the encoder activity to this file as Chrome trace-event JSON "
+          "(requires building with --define thumbnailer_trace=1).");
+ABSL_FLAG(uint32_t, decode_threads, 1,
+          "Number of threads used to decode the input frames (0 = one per "
+          "hardware thread).");
+ABSL_FLAG(std::string, frame_cache, "",
+          "Directory of a cache of decoded input frames, memory-mapped by "
+          "later runs instead of decoding the inputs again.");
+ABSL_FLAG(std::string, frame_store, "resident",
+          "Where the added frames are kept: 'resident', 'compressed' (in "
+          "memory) or 'spilled' (to a temporary file in -spill_dir).");
+ABSL_FLAG(std::string, spill_dir, "/tmp",
+          "Directory of the temporary file of -frame_store=spilled.");
+ABSL_FLAG(uint32_t, max_decoded_frames, 4,
+          "Number of compressed or spilled frames kept decompressed.");
 
 // Thumbnailer algorithms.
 ABSL_FLAG(std::string, algorithm, "equal_quality",
           "Method used to generate animation.");
 
-// Returns false on invalid configurations.
-bool ThumbnailerValidateOption(
-    const thumbnailer::ThumbnailerOption& thumbnailer_option) {
-  if (thumbnailer_option.min_lossy_quality() > 100) return false;
-  if (thumbnailer_option.webp_method() > 6) return false;
-  if (thumbnailer_option.slope_dpsnr() < 0) return false;
-  if (thumbnailer_option.slope_dpsnr() > 99) return false;
+// Decodes 'filenames' into pictures appended to 'pics', using up to
+// 'num_threads' threads, or maps them from the -frame_cache. Returns the index
+// of the first file (in list order) that failed to decode, or -1 if all of
+// them were decoded successfully.
+int ReadPictures(const std::vector<std::string>& filenames,
+                 const libwebp::ReadPictureOption& read_option,
+                 std::vector<EnclosedWebPPicture>* const pics,
+                 int num_threads) {
+  const int num_files = filenames.size();
+  std::vector<char> decoded(num_files, 0);
+  for (int i = 0; i < num_files; ++i) {
+    pics->emplace_back(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pics->back().get());
+  }
+
+  // Each worker takes the next undecoded file. Files are claimed in list
+  // order, so the results do not depend on the scheduling.
+  std::atomic<int> next_file(0);
+  const std::string frame_cache = absl::GetFlag(FLAGS_frame_cache);
+  const int first_file = pics->size() - num_files;
+  auto worker = [&]() {
+    for (int i = next_file++; i < num_files; i = next_file++) {
+      decoded[i] = libwebp::ReadCachedPicture(
+          filenames[i].c_str(), frame_cache, &(*pics)[first_file + i],
+          read_option);
+    }
+  };
+  num_threads = std::max(1, std::min(num_threads, num_files));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads) thread.join();
+
+  for (int i = 0; i < num_files; ++i) {
+    if (!decoded[i]) return i;
+  }
+  return -1;
+}
+
+// Reads all frames of the Y4M or PAM stream 'stream_name' into 'pics', and
+// their ending timestamps into 'timestamps'. Returns false on error.
+bool ReadStream(const char* const stream_name, double fps,
+                const libwebp::ReadPictureOption& read_option,
+                std::vector<EnclosedWebPPicture>* const pics,
+                std::vector<int>* const timestamps) {
+  std::unique_ptr<StreamReader, void (*)(StreamReader*)> reader(
+      StreamReaderNew(stream_name, fps), StreamReaderDelete);
+  if (reader == nullptr) return false;
+
+  while (true) {
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    // Y4M frames are kept as YUV, which the lossy encoder takes as is.
+    pic->use_argb = !StreamReaderIsYUV(reader.get());
+    int timestamp_ms;
+    const StreamStatus status =
+        StreamReaderReadFrame(reader.get(), pic.get(), &timestamp_ms);
+    if (status == STREAM_END) return true;
+    if (status != STREAM_FRAME_OK) return false;
+    if (!libwebp::FitPicture(pic.get(), read_option)) return false;
+    pics->push_back(std::move(pic));
+    timestamps->push_back(timestamp_ms);
+  }
+}
+
+// Reads all frames of the animated WebP or GIF file 'filename' into 'pics',
+// and their ending timestamps into 'timestamps'. Returns false on error.
+bool ReadAnimation(const char* const filename,
+                   const libwebp::ReadPictureOption& read_option,
+                   std::vector<EnclosedWebPPicture>* const pics,
+                   std::vector<int>* const timestamps) {
+  const uint8_t* data = NULL;
+  size_t data_size = 0;
+  int is_mapped = 0;
+  if (!ImgIoUtilMapFile(filename, &data, &data_size, &is_mapped)) return false;
+
+  bool ok = true;
+  {
+    std::unique_ptr<AnimReader, void (*)(AnimReader*)> reader(
+        AnimReaderNew(data, data_size), AnimReaderDelete);
+    ok = (reader != nullptr);
+    while (ok) {
+      EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+      WebPPictureInit(pic.get());
+      int timestamp_ms;
+      const AnimStatus status =
+          AnimReaderReadFrame(reader.get(), pic.get(), &timestamp_ms);
+      if (status == ANIM_END) break;
+      ok = (status == ANIM_FRAME_OK) &&
+           libwebp::FitPicture(pic.get(), read_option);
+      if (ok) {
+        pics->push_back(std::move(pic));
+        timestamps->push_back(timestamp_ms);
+      }
+    }
+  }
+  ImgIoUtilUnmapFile(data, data_size, is_mapped);
+  return ok;
+}
+
+// Returns the name of the animation generated for 'byte_budget' in a budget
+// ladder, e.g. "out_51200.webp" for "out.webp".
+std::string GetLadderFileName(const std::string& output, size_t byte_budget) {
+  const size_t dot = output.find_last_of('.');
+  const size_t slash = output.find_last_of("/\\");
+  const size_t split = (dot != std::string::npos &&
+                        (slash == std::string::npos || dot > slash))
+                           ? dot
+                           : output.size();
+  return output.substr(0, split) + "_" + std::to_string(byte_budget) +
+         output.substr(split);
+}
+
+// Reads the 'filename timestamp' lines of 'frame_list'. Returns false if the
+// file cannot be opened.
+bool ReadFrameList(const std::string& frame_list,
+                   std::vector<std::string>* const filenames,
+                   std::vector<int>* const timestamps) {
+  std::ifstream input_list(frame_list);
+  if (!input_list) return false;
+  std::string filename;
+  int timestamp_ms;
+  while (input_list >> filename >> timestamp_ms) {
+    filenames->push_back(filename);
+    timestamps->push_back(timestamp_ms);
+  }
   return true;
 }
 
+// Hands the samples of 'pics' over to 'thumbnailer'. Returns false on error.
+bool AddFrames(std::vector<EnclosedWebPPicture>* const pics,
+               const std::vector<int>& timestamps,
+               const std::vector<std::string>& filenames,
+               libwebp::Thumbnailer* const thumbnailer) {
+  for (std::size_t i = 0; i < pics->size(); ++i) {
+    libwebp::Thumbnailer::Status status;
+    if ((*pics)[i].get_deleter() == libwebp::UnmapPicture) {
+      // Memory-mapped raw frames are not copied, and are unmapped once the
+      // thumbnailer releases them.
+      WebPPicture* const pic = (*pics)[i].release();
+      const auto release = [pic]() { libwebp::UnmapPicture(pic); };
+      status = pic->use_argb
+                   ? thumbnailer->AddFrameARGB(pic->argb, pic->width,
+                                               pic->height, pic->argb_stride,
+                                               timestamps[i], release)
+                   : thumbnailer->AddFrameYUV(
+                         pic->y, pic->u, pic->v, pic->a, pic->width,
+                         pic->height, pic->y_stride, pic->uv_stride,
+                         pic->a_stride, timestamps[i], release);
+      if (status != libwebp::Thumbnailer::Status::kOk) release();
+    } else {
+      // The thumbnailer takes ownership of the decoded samples.
+      status = thumbnailer->AddFrame(std::move(*(*pics)[i]), timestamps[i]);
+    }
+    if (status != libwebp::Thumbnailer::Status::kOk) {
+      std::cerr << "Error adding frame "
+                << (filenames.empty() ? "#" + std::to_string(i) : filenames[i])
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the trace events recorded since StartTracing() to -trace_output.
+void WriteTrace() {
+  const std::string trace_output = absl::GetFlag(FLAGS_trace_output);
+  if (trace_output.empty()) return;
+  if (!libwebp::StopTracing(trace_output)) {
+    std::cerr << "Failed to write trace to " << trace_output << std::endl;
+  }
+}
+
+// Writes 'stats' to 'stats_output' ('-' for stdout) in the -stats_format
+// format. Returns false on error.
+bool WriteStats(const thumbnailer::ThumbnailerStats& stats,
+                const std::string& stats_output) {
+  std::string text;
+  if (absl::GetFlag(FLAGS_stats_format) == "json") {
+    google::protobuf::util::JsonPrintOptions options;
+    options.add_whitespace = true;
+    if (!google::protobuf::util::MessageToJsonString(stats, &text, options)
+             .ok()) {
+      return false;
+    }
+  } else if (!google::protobuf::TextFormat::PrintToString(stats, &text)) {
+    return false;
+  }
+  if (stats_output == "-") {
+    std::cout << text;
+    return true;
+  }
+  return ImgIoUtilWriteFile(stats_output.c_str(),
+                            reinterpret_cast<const uint8_t*>(text.data()),
+                            text.size());
+}
+
+// Generates the animation(s) of 'thumbnailer' and writes them to 'output', or
+// to the files derived from 'output' for a non-empty 'budget_ladder'. The
+// statistics are written to 'stats_output', unless it is empty. Returns false
+// on error.
+bool GenerateThumbnail(libwebp::Thumbnailer* const thumbnailer,
+                       libwebp::Thumbnailer::Method method,
+                       const std::vector<size_t>& budget_ladder,
+                       const std::string& output,
+                       const std::string& stats_output) {
+  thumbnailer::ThumbnailerStats stats;
+  thumbnailer::ThumbnailerStats* const stats_ptr =
+      stats_output.empty() ? nullptr : &stats;
+  libwebp::Thumbnailer::Status status;
+
+  if (!budget_ladder.empty()) {
+    // Generate all variants in one pass, sharing the encoding statistics.
+    std::vector<WebPData> ladder;
+    status = thumbnailer->GenerateAnimation(budget_ladder, &ladder, method,
+                                            stats_ptr);
+    for (std::size_t i = 0; i < ladder.size(); ++i) {
+      const std::string ladder_output =
+          GetLadderFileName(output, budget_ladder[i]);
+      ImgIoUtilWriteFile(ladder_output.c_str(), ladder[i].bytes,
+                         ladder[i].size);
+      WebPDataClear(&ladder[i]);
+    }
+    if (status != libwebp::Thumbnailer::Status::kOk) {
+      std::cerr << "Error generating thumbnail for budget "
+                << budget_ladder[ladder.size()] << "." << std::endl;
+    }
+  } else {
+    // Generate the animation.
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    status = thumbnailer->GenerateAnimation(&webp_data, method, stats_ptr);
+
+    // Write animation to file.
+    if (status == libwebp::Thumbnailer::Status::kOk) {
+      ImgIoUtilWriteFile(output.c_str(), webp_data.bytes, webp_data.size);
+    } else {
+      std::cerr << "Error generating thumbnail." << std::endl;
+    }
+    WebPDataClear(&webp_data);
+  }
+
+  // The statistics are also useful when the generation fails.
+  if (stats_ptr != nullptr && !WriteStats(stats, stats_output)) {
+    std::cerr << "Failed to write stats to " << stats_output << std::endl;
+    return false;
+  }
+  return (status == libwebp::Thumbnailer::Status::kOk);
+}
+
+// Bounds the memory used by the frames of the batch jobs running in parallel.
+class MemoryLimiter {
+ public:
+  explicit MemoryLimiter(uint64_t limit) : limit_(limit) {}
+
+  // Waits until 'bytes' more fit in the limit. A job bigger than the limit
+  // runs alone.
+  void Acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    available_.wait(lock, [&]() {
+      return limit_ == 0 || used_ == 0 || used_ + bytes <= limit_;
+    });
+    used_ += bytes;
+  }
+
+  void Release(uint64_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      used_ -= bytes;
+    }
+    available_.notify_all();
+  }
+
+ private:
+  const uint64_t limit_;
+  uint64_t used_ = 0;
+  std::mutex mutex_;
+  std::condition_variable available_;
+};
+
+// Runs a batch job. Unset fields of the job options take their value from
+// 'default_option'. Returns false on error.
+bool RunJob(const thumbnailer::ThumbnailerJob& job,
+            const thumbnailer::ThumbnailerOption& default_option,
+            const std::string& default_algorithm,
+            const std::vector<size_t>& budget_ladder, int decode_threads,
+            MemoryLimiter* const memory_limiter) {
+  thumbnailer::ThumbnailerOption option = default_option;
+  option.MergeFrom(job.option());
+  option.set_hard_max_size(
+      std::max(option.hard_max_size(), option.soft_max_size()));
+  libwebp::Thumbnailer::Method method;
+  if (!job.has_output() || !libwebp::Thumbnailer::ValidateOption(option) ||
+      !libwebp::Thumbnailer::ParseMethod(
+          job.has_algorithm() ? job.algorithm() : default_algorithm,
+          &method)) {
+    std::cerr << "Invalid job for " << job.frame_list() << std::endl;
+    return false;
+  }
+
+  std::vector<std::string> filenames;
+  std::vector<int> timestamps;
+  if (!ReadFrameList(job.frame_list(), &filenames, &timestamps) ||
+      filenames.empty()) {
+    std::cerr << "No input frame(s) in " << job.frame_list() << std::endl;
+    return false;
+  }
+
+  libwebp::ReadPictureOption read_option;
+  read_option.target_width = option.target_width();
+  read_option.target_height = option.target_height();
+  read_option.allow_yuv = absl::GetFlag(FLAGS_jpeg_yuv);
+
+  // The first frame gives the footprint of the job, assuming the thumbnailer
+  // holds about two more frames than the input, unless the job is limited to
+  // less.
+  std::vector<EnclosedWebPPicture> pics;
+  if (ReadPictures({filenames[0]}, read_option, &pics, 1) != -1) {
+    std::cerr << "Failed to read image " << filenames[0] << std::endl;
+    return false;
+  }
+  const uint64_t frame_size =
+      uint64_t(pics[0]->width) * pics[0]->height * sizeof(uint32_t);
+  uint64_t job_size = frame_size * (filenames.size() + 2);
+  if (option.max_memory_bytes() > 0) {
+    job_size = std::min<uint64_t>(job_size, option.max_memory_bytes());
+  }
+  memory_limiter->Acquire(job_size);
+
+  bool ok = true;
+  {
+    const std::vector<std::string> other_filenames(filenames.begin() + 1,
+                                                   filenames.end());
+    const int failed_ind =
+        ReadPictures(other_filenames, read_option, &pics, decode_threads);
+    if (failed_ind != -1) {
+      std::cerr << "Failed to read image " << other_filenames[failed_ind]
+                << std::endl;
+      ok = false;
+    }
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    ok = ok && AddFrames(&pics, timestamps, filenames, &thumbnailer);
+    pics.clear();
+    ok = ok && GenerateThumbnail(&thumbnailer, method, budget_ladder,
+                                 job.output(), job.stats_output());
+  }
+  memory_limiter->Release(job_size);
+  return ok;
+}
+
+// Runs the jobs of the ThumbnailerBatch text proto 'manifest' on 'num_threads'
+// threads. Returns the number of failed jobs, or -1 if the manifest cannot be
+// read.
+int RunBatch(const std::string& manifest,
+             const thumbnailer::ThumbnailerOption& default_option,
+             const std::string& default_algorithm,
+             const std::vector<size_t>& budget_ladder, int num_threads,
+             int decode_threads, uint64_t memory_limit) {
+  std::ifstream input(manifest);
+  std::stringstream manifest_text;
+  manifest_text << input.rdbuf();
+  thumbnailer::ThumbnailerBatch batch;
+  if (!input || !google::protobuf::TextFormat::ParseFromString(
+                    manifest_text.str(), &batch)) {
+    return -1;
+  }
+
+  // Each worker takes the next job once its current one is done, so that
+  // workers are never idle while jobs are pending, whatever their length.
+  MemoryLimiter memory_limiter(memory_limit);
+  std::atomic<int> next_job(0);
+  std::atomic<int> num_failed_jobs(0);
+  auto worker = [&]() {
+    for (int i = next_job++; i < batch.job_size(); i = next_job++) {
+      if (!RunJob(batch.job(i), default_option, default_algorithm,
+                  budget_ladder, decode_threads, &memory_limiter)) {
+        ++num_failed_jobs;
+      }
+    }
+  };
+  num_threads = std::max(1, std::min(num_threads, batch.job_size()));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads) thread.join();
+  return num_failed_jobs;
+}
+
 int main(int argc, char* argv[]) {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
 
   absl::SetProgramUsageMessage(
-      "Usage: thumbnailer [options] frame_list.txt -o=output.webp\n\nBy "
+      "Usage: thumbnailer [options] frame_list.txt -o=output.webp\n"
+      "       thumbnailer [options] -stream input.y4m -o=output.webp\n"
+      "       thumbnailer [options] -anim input.gif -o=output.webp\n"
+      "       thumbnailer [options] -batch jobs.textproto\n"
+      "       thumbnailer [options] -serve=/tmp/thumbnailer.sock\n\nBy "
       "default, use lossy encoding and impose the same quality to all frames.");
   std::vector<char*> positional_args = absl::ParseCommandLine(argc, argv);
 
@@ -81,14 +536,61 @@ int main(int argc, char* argv[]) {
   thumbnailer_option.set_webp_method(absl::GetFlag(FLAGS_m));
   thumbnailer_option.set_slope_dpsnr(
       std::abs(absl::GetFlag(FLAGS_slope_dpsnr)));
+  thumbnailer_option.set_target_width(absl::GetFlag(FLAGS_target_width));
+  thumbnailer_option.set_target_height(absl::GetFlag(FLAGS_target_height));
+  thumbnailer_option.set_decimation_quality(
+      absl::GetFlag(FLAGS_decimation_quality));
+  thumbnailer_option.set_warm_start(absl::GetFlag(FLAGS_warm_start));
+  thumbnailer_option.set_cluster_psnr(absl::GetFlag(FLAGS_cluster_psnr));
+  thumbnailer_option.set_max_memory_bytes(
+      absl::GetFlag(FLAGS_max_memory_bytes));
+  std::string frame_store = absl::GetFlag(FLAGS_frame_store);
+  std::transform(frame_store.begin(), frame_store.end(), frame_store.begin(),
+                 ::toupper);
+  thumbnailer::ThumbnailerOption::FrameStore frame_store_value;
+  if (!thumbnailer::ThumbnailerOption::FrameStore_Parse(frame_store,
+                                                        &frame_store_value)) {
+    std::cerr << "Unknown -frame_store " << absl::GetFlag(FLAGS_frame_store)
+              << std::endl;
+    return 1;
+  }
+  thumbnailer_option.set_frame_store(frame_store_value);
+  thumbnailer_option.set_spill_directory(absl::GetFlag(FLAGS_spill_dir));
+  thumbnailer_option.set_max_decoded_frames(
+      absl::GetFlag(FLAGS_max_decoded_frames));
 
-  if (!ThumbnailerValidateOption(thumbnailer_option)) {
+  if (!libwebp::Thumbnailer::ValidateOption(thumbnailer_option)) {
     std::cerr << "Invalid thumbnailer configuration." << std::endl;
     return 1;
   }
 
-  // Initialize thumbnailer.
-  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(thumbnailer_option);
+  std::vector<size_t> budget_ladder;
+  for (const std::string& budget : absl::GetFlag(FLAGS_budget_ladder)) {
+    char* end;
+    const unsigned long value = std::strtoul(budget.c_str(), &end, 10);
+    if (budget.empty() || *end != '\0' || value == 0) {
+      std::cerr << "Invalid budget in -budget_ladder: " << budget << std::endl;
+      return 1;
+    }
+    budget_ladder.push_back(value);
+  }
+
+  int num_threads = absl::GetFlag(FLAGS_jobs);
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (!absl::GetFlag(FLAGS_serve).empty()) {
+    // The flags are the defaults of all requests.
+    libwebp::ThumbnailerService service(thumbnailer_option, num_threads);
+    const bool ok = service.Serve(absl::GetFlag(FLAGS_serve));
+    if (!ok) {
+      std::cerr << "Failed to listen on " << absl::GetFlag(FLAGS_serve)
+                << std::endl;
+    }
+    google::protobuf::ShutdownProtobufLibrary();
+    return ok ? 0 : 1;
+  }
 
   // Process list of images and timestamps.
   if (positional_args.size() != 2) {  // including argv[0]
@@ -96,72 +598,91 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  std::vector<EnclosedWebPPicture> pics;
-  std::ifstream input_list(positional_args.back());
-  std::string filename;
-  int timestamp_ms;
+  int decode_threads = absl::GetFlag(FLAGS_decode_threads);
+  if (decode_threads == 0) {
+    decode_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
 
-  while (input_list >> filename >> timestamp_ms) {
-    pics.emplace_back(new WebPPicture, libwebp::WebPPictureDelete);
-    WebPPicture* current_frame = pics.back().get();
-    WebPPictureInit(current_frame);
-    if (!libwebp::ReadPicture(filename.c_str(), current_frame)) {
-      std::cerr << "Failed to read image " << filename << std::endl;
-      return 1;
-    }
-    if (thumbnailer.AddFrame(*current_frame, timestamp_ms) !=
-        libwebp::Thumbnailer::Status::kOk) {
-      std::cerr << "Error adding frame " << filename << std::endl;
-      return 1;
+  if (!absl::GetFlag(FLAGS_trace_output).empty()) {
+#ifndef THUMBNAILER_ENABLE_TRACE
+    std::cerr << "Warning: trace events are not compiled in, -trace_output "
+                 "will be empty."
+              << std::endl;
+#endif
+    libwebp::StartTracing();
+  }
+
+  if (absl::GetFlag(FLAGS_batch)) {
+    // The flags are the defaults of all jobs.
+    const int num_failed_jobs = RunBatch(
+        positional_args.back(), thumbnailer_option,
+        absl::GetFlag(FLAGS_algorithm), budget_ladder, num_threads,
+        decode_threads, uint64_t(absl::GetFlag(FLAGS_batch_memory_mb)) << 20);
+    if (num_failed_jobs < 0) {
+      std::cerr << "Failed to read batch " << positional_args.back()
+                << std::endl;
+    } else if (num_failed_jobs > 0) {
+      std::cerr << num_failed_jobs << " job(s) failed." << std::endl;
     }
+    WriteTrace();
+    google::protobuf::ShutdownProtobufLibrary();
+    return (num_failed_jobs == 0) ? 0 : 1;
   }
 
-  if (pics.empty()) {
-    std::cerr << "No input frame(s) for generating animation." << std::endl;
+  libwebp::Thumbnailer::Method method;
+  if (!libwebp::Thumbnailer::ParseMethod(absl::GetFlag(FLAGS_algorithm),
+                                         &method)) {
+    std::cerr << "Unknown -algorithm " << absl::GetFlag(FLAGS_algorithm)
+              << std::endl;
     return 1;
   }
 
-  // Generate the animation.
-  WebPData webp_data;
-  WebPDataInit(&webp_data);
-
-  libwebp::Thumbnailer::Method method =
-      libwebp::Thumbnailer::Method::kEqualQuality;
-
-  std::string method_flag = absl::GetFlag(FLAGS_algorithm);
-  if (method_flag == "equal_psnr") {
-    // Generate animation so that all frames have the same PSNR.
-    method = libwebp::Thumbnailer::Method::kEqualPSNR;
-  } else if (method_flag == "equal_quality") {
-    // Generate animation so that all frames have the same quality.
-    method = libwebp::Thumbnailer::Method::kEqualQuality;
-  } else if (method_flag == "near_ll_diff") {
-    // Generate animation allowing near-lossless method. The pre-processing
-    // value for each near-lossless frames can be different.
-    method = libwebp::Thumbnailer::Method::kNearllDiff;
-  } else if (method_flag == "near_ll_equal") {
-    // Generate animation allowing near-lossless method. Use the same
-    // pre-processing value for all near-lossless frames.
-    method = libwebp::Thumbnailer::Method::kNearllEqual;
-  } else if (method_flag == "slope_optim") {
-    // Generate animation with slope optimization.
-    method = libwebp::Thumbnailer::Method::kSlopeOptim;
+  // Initialize thumbnailer.
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(thumbnailer_option);
+
+  libwebp::ReadPictureOption read_option;
+  read_option.target_width = thumbnailer_option.target_width();
+  read_option.target_height = thumbnailer_option.target_height();
+  read_option.allow_yuv = absl::GetFlag(FLAGS_jpeg_yuv);
+
+  std::vector<std::string> filenames;
+  std::vector<int> timestamps;
+  std::vector<EnclosedWebPPicture> pics;
+  if (absl::GetFlag(FLAGS_anim)) {
+    if (!ReadAnimation(positional_args.back(), read_option, &pics,
+                       &timestamps)) {
+      std::cerr << "Failed to read animation " << positional_args.back()
+                << std::endl;
+      return 1;
+    }
+  } else if (absl::GetFlag(FLAGS_stream)) {
+    if (!ReadStream(positional_args.back(), absl::GetFlag(FLAGS_fps),
+                    read_option, &pics, &timestamps)) {
+      std::cerr << "Failed to read stream " << positional_args.back()
+                << std::endl;
+      return 1;
+    }
   } else {
-    std::cerr << "Unknown -algorithm " << method << std::endl;
-    return 1;
+    ReadFrameList(positional_args.back(), &filenames, &timestamps);
+    const int failed_ind =
+        ReadPictures(filenames, read_option, &pics, decode_threads);
+    if (failed_ind != -1) {
+      std::cerr << "Failed to read image " << filenames[failed_ind]
+                << std::endl;
+      return 1;
+    }
   }
 
-  libwebp::Thumbnailer::Status status =
-      thumbnailer.GenerateAnimation(&webp_data, method);
+  if (!AddFrames(&pics, timestamps, filenames, &thumbnailer)) return 1;
 
-  // Write animation to file.
-  const std::string output = absl::GetFlag(FLAGS_o);
-  if (status == libwebp::Thumbnailer::Status::kOk) {
-    ImgIoUtilWriteFile(output.c_str(), webp_data.bytes, webp_data.size);
-  } else {
-    std::cerr << "Error generating thumbnail." << std::endl;
+  if (pics.empty()) {
+    std::cerr << "No input frame(s) for generating animation." << std::endl;
+    return 1;
   }
-  WebPDataClear(&webp_data);
+
+  GenerateThumbnail(&thumbnailer, method, budget_ladder,
+                    absl::GetFlag(FLAGS_o), absl::GetFlag(FLAGS_stats_output));
+  WriteTrace();
 
   google::protobuf::ShutdownProtobufLibrary();
   return 0;
@@ -14,6 +14,8 @@
 
 #include "thumbnailer.h"
 
+#include <unistd.h>
+
 #define CONVERT_WEBP_MUX_STATUS(webp_mux_error)     \
   do {                                              \
     const WebPMuxError error = (webp_mux_error);    \
@@ -26,10 +28,14 @@ Thumbnailer::Thumbnailer() {
   WebPAnimEncoderOptionsInit(&anim_config_);
   loop_count_ = 0;
   byte_budget_ = 153600;
+  hard_byte_budget_ = 153600;
   minimum_lossy_quality_ = 0;
   verbose_ = false;
   webp_method_ = 4;
   slope_dPSNR_ = 1.0;
+  decimation_quality_ = 50;
+  warm_start_ = false;
+  cluster_psnr_ = 0;
 }
 
 Thumbnailer::Thumbnailer(
@@ -38,16 +44,56 @@ Thumbnailer::Thumbnailer(
   WebPAnimEncoderOptionsInit(&anim_config_);
   loop_count_ = thumbnailer_option.loop_count();
   byte_budget_ = thumbnailer_option.soft_max_size();
+  hard_byte_budget_ = std::max(thumbnailer_option.hard_max_size(),
+                               thumbnailer_option.soft_max_size());
   minimum_lossy_quality_ = thumbnailer_option.min_lossy_quality();
   anim_config_.allow_mixed = thumbnailer_option.allow_mixed();
   webp_method_ = thumbnailer_option.webp_method();
   slope_dPSNR_ = thumbnailer_option.slope_dpsnr();
+  decimation_quality_ = thumbnailer_option.decimation_quality();
+  warm_start_ = thumbnailer_option.warm_start();
+  cluster_psnr_ = thumbnailer_option.cluster_psnr();
+  max_memory_bytes_ = thumbnailer_option.max_memory_bytes();
+  frame_store_ = thumbnailer_option.frame_store();
+  spill_directory_ = thumbnailer_option.spill_directory();
+  max_decoded_frames_ = thumbnailer_option.max_decoded_frames();
 
   // All frames are key frames.
   anim_config_.kmax = 1;
 }
 
-Thumbnailer::~Thumbnailer() { WebPAnimEncoderDelete(enc_); }
+Thumbnailer::~Thumbnailer() {
+  WebPAnimEncoderDelete(enc_);
+  if (spill_fd_ != -1) close(spill_fd_);
+}
+
+bool Thumbnailer::ParseMethod(const std::string& method_name,
+                              Method* const method) {
+  static const std::map<std::string, Method> kMethodNames = {
+      {"equal_quality", kEqualQuality},
+      {"equal_psnr", kEqualPSNR},
+      {"near_ll_diff", kNearllDiff},
+      {"near_ll_equal", kNearllEqual},
+      {"slope_optim", kSlopeOptim},
+      {"temporal_decimation", kTemporalDecimation}};
+  const auto it = kMethodNames.find(method_name);
+  if (it == kMethodNames.end()) return false;
+  *method = it->second;
+  return true;
+}
+
+bool Thumbnailer::ValidateOption(
+    const thumbnailer::ThumbnailerOption& thumbnailer_option) {
+  if (thumbnailer_option.min_lossy_quality() > 100) return false;
+  if (thumbnailer_option.webp_method() > 6) return false;
+  if (thumbnailer_option.slope_dpsnr() < 0) return false;
+  if (thumbnailer_option.slope_dpsnr() > 99) return false;
+  if (thumbnailer_option.target_width() > WEBP_MAX_DIMENSION) return false;
+  if (thumbnailer_option.target_height() > WEBP_MAX_DIMENSION) return false;
+  if (thumbnailer_option.decimation_quality() > 100) return false;
+  if (thumbnailer_option.cluster_psnr() < 0) return false;
+  return true;
+}
 
 Thumbnailer::Status Thumbnailer::AddFrame(const WebPPicture& pic,
                                           int timestamp_ms) {
@@ -61,24 +107,176 @@ Thumbnailer::Status Thumbnailer::AddFrame(const WebPPicture& pic,
   new_config.show_compressed = 1;
   new_config.method = webp_method_;
   frames_.emplace_back(pic, timestamp_ms, new_config);
+  assembly_cache_.clear();
+  frames_clustered_ = false;
+  if (frame_store_ != thumbnailer::ThumbnailerOption::RESIDENT) {
+    const Status status = StoreFrame(&frames_.back());
+    if (status != kOk) frames_.pop_back();
+    return status;
+  }
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::AddFrame(WebPPicture&& pic,
+                                          int timestamp_ms) {
+  CHECK_THUMBNAILER_STATUS(AddFrame(pic, timestamp_ms));
+  if (frames_.back().stored != nullptr) {
+    WebPPictureFree(&pic);  // The frame store has its own copy.
+  } else {
+    frames_.back().owner.reset(new WebPPicture(pic),
+                               [](WebPPicture* const pic) {
+                                 WebPPictureFree(pic);
+                                 delete pic;
+                               });
+  }
+  if (!WebPPictureInit(&pic)) assert(false);
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::AddFrameARGB(const uint32_t* argb, int width,
+                                              int height, int stride,
+                                              int timestamp_ms,
+                                              ReleaseCallback release) {
+  if (argb == nullptr || width <= 0 || height <= 0 || stride < width) {
+    return kImageFormatError;
+  }
+  WebPPicture pic;
+  if (!WebPPictureInit(&pic)) assert(false);
+  pic.use_argb = 1;
+  pic.width = width;
+  pic.height = height;
+  // The samples are only read: all encodings work on copies.
+  pic.argb = const_cast<uint32_t*>(argb);
+  pic.argb_stride = stride;
+  CHECK_THUMBNAILER_STATUS(AddFrame(pic, timestamp_ms));
+  SetReleaseCallback(std::move(release));
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::AddFrameYUV(
+    const uint8_t* y, const uint8_t* u, const uint8_t* v, const uint8_t* a,
+    int width, int height, int y_stride, int uv_stride, int a_stride,
+    int timestamp_ms, ReleaseCallback release) {
+  if (y == nullptr || u == nullptr || v == nullptr || width <= 0 ||
+      height <= 0 || y_stride < width || uv_stride < (width + 1) / 2 ||
+      (a != nullptr && a_stride < width)) {
+    return kImageFormatError;
+  }
+  WebPPicture pic;
+  if (!WebPPictureInit(&pic)) assert(false);
+  pic.use_argb = 0;
+  pic.colorspace = (a != nullptr) ? WEBP_YUV420A : WEBP_YUV420;
+  pic.width = width;
+  pic.height = height;
+  // The samples are only read: all encodings work on copies.
+  pic.y = const_cast<uint8_t*>(y);
+  pic.u = const_cast<uint8_t*>(u);
+  pic.v = const_cast<uint8_t*>(v);
+  pic.a = const_cast<uint8_t*>(a);
+  pic.y_stride = y_stride;
+  pic.uv_stride = uv_stride;
+  pic.a_stride = (a != nullptr) ? a_stride : 0;
+  CHECK_THUMBNAILER_STATUS(AddFrame(pic, timestamp_ms));
+  SetReleaseCallback(std::move(release));
   return kOk;
 }
 
+void Thumbnailer::SetReleaseCallback(ReleaseCallback release) {
+  if (release == nullptr) return;
+  if (frames_.back().stored != nullptr) {
+    release();  // The frame store has its own copy.
+    return;
+  }
+  // The deleter of an empty shared_ptr is still called with the last copy.
+  frames_.back().owner.reset(static_cast<void*>(nullptr),
+                             [release](void*) { release(); });
+}
+
+Thumbnailer::Status Thumbnailer::GetARGBPicture(
+    FrameData* const frame, const WebPPicture** const argb_pic) {
+  const WebPPicture* pic;
+  CHECK_THUMBNAILER_STATUS(LoadPicture(frame, &pic));
+  if (pic->use_argb) {
+    *argb_pic = pic;
+    return kOk;
+  }
+  // The ARGB version of a stored frame is dropped along with its samples.
+  std::shared_ptr<WebPPicture>& frame_argb_pic =
+      (frame->stored != nullptr) ? frame->stored->argb_pic : frame->argb_pic;
+  if (frame_argb_pic == nullptr) {
+    std::shared_ptr<WebPPicture> new_pic(new WebPPicture,
+                                         [](WebPPicture* const pic) {
+                                           WebPPictureFree(pic);
+                                           delete pic;
+                                         });
+    // A view shares the YUV planes of 'pic', so that only the ARGB plane is
+    // allocated (and owned) by 'new_pic'.
+    if (!WebPPictureInit(new_pic.get()) ||
+        !WebPPictureView(pic, 0, 0, pic->width, pic->height, new_pic.get()) ||
+        !WebPPictureYUVAToARGB(new_pic.get())) {
+      return kMemoryError;
+    }
+    frame_argb_pic = std::move(new_pic);
+    picture_bytes_ += GetPictureBytes(*frame_argb_pic);
+    last_argb_pic_ = frame_argb_pic.get();
+    CHECK_THUMBNAILER_STATUS(ReserveMemory(0));
+  }
+  *argb_pic = last_argb_pic_ = frame_argb_pic.get();
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::GetEncodingPicture(
+    FrameData* const frame, const WebPPicture** const pic) {
+  // Lossy frames are encoded from their original samples, possibly YUV.
+  if (frame->config.lossless) return GetARGBPicture(frame, pic);
+  return LoadPicture(frame, pic);
+}
+
 Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
                                                  size_t* const pic_size,
                                                  float* const pic_psnr) {
   const int quality = int(frames_[ind].config.quality);
-  if (!frames_[ind].config.lossless && frames_[ind].lossy_size[quality] != -1) {
-    *pic_size = frames_[ind].lossy_size[quality];
-    *pic_psnr = frames_[ind].lossy_psnr[quality];
-    return kOk;
+  FrameData::LossyStats* const lossy_stats = frames_[ind].lossy_stats.get();
+  if (!frames_[ind].config.lossless) {
+    stats_.set_rd_cache_lookups(stats_.rd_cache_lookups() + 1);
+    if (lossy_stats->size[quality] != -1) {
+      stats_.set_rd_cache_hits(stats_.rd_cache_hits() + 1);
+      *pic_size = lossy_stats->size[quality];
+      *pic_psnr = lossy_stats->psnr[quality];
+      return kOk;
+    }
   }
+  CHECK_THUMBNAILER_STATUS(CheckCancelled());
+  ReportProbe();
+  THUMBNAILER_TRACE_EVENT(trace_event, "encode");
+  THUMBNAILER_TRACE_ARG(trace_event, "frame", double(ind));
+  THUMBNAILER_TRACE_ARG(trace_event, "lossless",
+                        frames_[ind].config.lossless != 0);
+  THUMBNAILER_TRACE_ARG(trace_event, "quality", frames_[ind].config.quality);
+  THUMBNAILER_TRACE_ARG(trace_event, "near_lossless",
+                        double(frames_[ind].config.near_lossless));
+
+  // Lossy encoding starts from the original samples (possibly YUV), which
+  // are also the reference of the distortion. WebPPictureDistortion() measures
+  // it on ARGB samples, converted on the fly.
+  const WebPPicture* src_pic;
+  CHECK_THUMBNAILER_STATUS(GetEncodingPicture(&frames_[ind], &src_pic));
+
+  // Near-lossless bitstreams are decoded to a second picture, and both YUV
+  // pictures of a lossy encoding are converted by WebPPictureDistortion().
+  const bool near_lossless = frames_[ind].config.lossless &&
+                             frames_[ind].config.near_lossless != 100;
+  const uint64_t conversion_bytes =
+      GetEncodingBytes(*src_pic) - GetPictureBytes(*src_pic);
+  CHECK_THUMBNAILER_STATUS(
+      ReserveMemory(GetPictureBytes(*src_pic) * (near_lossless ? 2 : 1) +
+                    2 * conversion_bytes));
 
   WebPPicture encoded_pic;
   WebPMemoryWriter memory_writer;
   WebPMemoryWriterInit(&memory_writer);
 
-  if (!WebPPictureCopy(&frames_[ind].pic, &encoded_pic)) {
+  if (!WebPPictureCopy(src_pic, &encoded_pic)) {
     WebPPictureFree(&encoded_pic);
     return kStatsError;
   }
@@ -98,6 +296,14 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
     WebPPictureFree(&encoded_pic);
     return kStatsError;
   }
+  if (!frames_[ind].config.lossless) {
+    stats_.set_lossy_encodes(stats_.lossy_encodes() + 1);
+  } else if (near_lossless) {
+    stats_.set_near_lossless_encodes(stats_.near_lossless_encodes() + 1);
+  } else {
+    stats_.set_lossless_encodes(stats_.lossless_encodes() + 1);
+  }
+  THUMBNAILER_TRACE_ARG(trace_event, "size", double(stats.coded_size));
 
   if (frames_[ind].config.lossless) {
     if (frames_[ind].config.near_lossless == 100) {
@@ -131,7 +337,7 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
   *pic_size = encoded_pic.stats->coded_size;
 
   float distortion_result[5];
-  if (!WebPPictureDistortion(&frames_[ind].pic, &encoded_pic, 0,
+  if (!WebPPictureDistortion(src_pic, &encoded_pic, 0,
                              distortion_result)) {
     WebPPictureFree(&encoded_pic);
     WebPMemoryWriterClear(&memory_writer);
@@ -141,8 +347,8 @@ Thumbnailer::Status Thumbnailer::GetPictureStats(int ind,
   }
 
   if (!frames_[ind].config.lossless) {
-    frames_[ind].lossy_size[quality] = *pic_size;
-    frames_[ind].lossy_psnr[quality] = *pic_psnr;
+    lossy_stats->size[quality] = *pic_size;
+    lossy_stats->psnr[quality] = *pic_psnr;
   }
 
   WebPPictureFree(&encoded_pic);
@@ -179,8 +385,98 @@ Thumbnailer::Status Thumbnailer::SetLoopCount(WebPData* const webp_data) {
   return kOk;
 }
 
-Thumbnailer::Status Thumbnailer::GenerateAnimation(WebPData* const webp_data,
-                                                   Method method) {
+Thumbnailer::Status Thumbnailer::GenerateAnimation(
+    WebPData* const webp_data, Method method,
+    thumbnailer::ThumbnailerStats* const stats) {
+  cancelled_ = false;
+  progress_.num_probes = 0;
+  Status status = StartStats();
+  if (status == kOk) {
+    PhaseTimer timer(this, "generate_animation");
+    status = GenerateAnimationWithFallback(webp_data, method);
+  }
+  // Cancelling after the last probe still discards the result.
+  if (status == kOk && (status = CheckCancelled()) != kOk) {
+    WebPDataClear(webp_data);
+  }
+  FinishStats((status == kOk) ? webp_data->size : 0, stats);
+  return status;
+}
+
+Thumbnailer::Status Thumbnailer::GenerateAnimation(
+    const std::vector<size_t>& byte_budgets,
+    std::vector<WebPData>* const webp_data_list, Method method,
+    thumbnailer::ThumbnailerStats* const stats) {
+  cancelled_ = false;
+  progress_.num_probes = 0;
+  Status status = StartStats();
+  if (status == kOk) {
+    PhaseTimer timer(this, "generate_animation");
+    status = GenerateAnimationLadder(byte_budgets, webp_data_list, method);
+  }
+  if (status == kOk) status = CheckCancelled();
+  FinishStats(webp_data_list->empty() ? 0 : webp_data_list->back().size,
+              stats);
+  return status;
+}
+
+std::future<Thumbnailer::Status> Thumbnailer::GenerateAnimationAsync(
+    WebPData* const webp_data, Method method,
+    thumbnailer::ThumbnailerStats* const stats) {
+  return std::async(std::launch::async, [this, webp_data, method, stats]() {
+    return GenerateAnimation(webp_data, method, stats);
+  });
+}
+
+void Thumbnailer::Cancel() { cancelled_ = true; }
+
+void Thumbnailer::SetProgressCallback(ProgressCallback progress_callback) {
+  progress_callback_ = std::move(progress_callback);
+}
+
+Thumbnailer::Status Thumbnailer::CheckCancelled() const {
+  return cancelled_ ? kCancelled : kOk;
+}
+
+void Thumbnailer::ReportProbe(size_t size) {
+  ++progress_.num_probes;
+  if (size <= byte_budget_) {
+    progress_.best_size = std::max(progress_.best_size, size);
+  }
+  if (progress_callback_ != nullptr) progress_callback_(progress_);
+}
+
+Thumbnailer::Status Thumbnailer::GenerateAnimationWithFallback(
+    WebPData* const webp_data, Method method) {
+  CHECK_THUMBNAILER_STATUS(ClusterFrames());
+  if (hard_byte_budget_ <= byte_budget_) {
+    return GenerateAnimationWithMethod(webp_data, method);
+  }
+
+  // Keep the initial frame settings for the second tier. The snapshot shares
+  // the lossy statistics of the frames, and the assembly cache is kept, so the
+  // second tier reuses the probes and bitstreams of the first one.
+  const std::vector<FrameData> original_frames = frames_;
+  const Status status = GenerateAnimationWithMethod(webp_data, method);
+  if (status != kByteBudgetError) return status;
+
+  if (verbose_) {
+    std::cout << "Soft budget not reached, trying the hard budget."
+              << std::endl;
+  }
+  frames_ = original_frames;
+  const size_t soft_byte_budget = byte_budget_;
+  byte_budget_ = hard_byte_budget_;
+  const Status hard_status = GenerateAnimationWithMethod(webp_data, method);
+  byte_budget_ = soft_byte_budget;
+  return hard_status;
+}
+
+Thumbnailer::Status Thumbnailer::GenerateAnimationWithMethod(
+    WebPData* const webp_data, Method method) {
+  progress_.method = method;
+  progress_.byte_budget = byte_budget_;
+  progress_.best_size = 0;
   if (method == kEqualQuality) {
     return GenerateAnimationEqualQuality(webp_data);
   } else if (method == kEqualPSNR) {
@@ -193,14 +489,79 @@ Thumbnailer::Status Thumbnailer::GenerateAnimation(WebPData* const webp_data,
   } else if (method == kNearllEqual) {
     CHECK_THUMBNAILER_STATUS(GenerateAnimationEqualQuality(webp_data));
     return NearLosslessEqual(webp_data);
+  } else if (method == kTemporalDecimation) {
+    return GenerateAnimationTemporalDecimation(webp_data);
   } else {
     std::cerr << "Invalid method." << std::endl;
     return kGenericError;
   }
 }
 
+Thumbnailer::Status Thumbnailer::GenerateAnimationLadder(
+    const std::vector<size_t>& byte_budgets,
+    std::vector<WebPData>* const webp_data_list, Method method) {
+  CHECK_THUMBNAILER_STATUS(ClusterFrames());
+
+  // Each budget starts from the same frame settings. The snapshot shares the
+  // lossy statistics of the frames, so probes are not repeated across budgets.
+  const std::vector<FrameData> original_frames = frames_;
+  const size_t original_byte_budget = byte_budget_;
+
+  Status status = kOk;
+  for (const size_t byte_budget : byte_budgets) {
+    frames_ = original_frames;
+    byte_budget_ = byte_budget;
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    status = GenerateAnimationWithMethod(&webp_data, method);
+    if (status != kOk) {
+      WebPDataClear(&webp_data);
+      break;
+    }
+    webp_data_list->push_back(webp_data);
+  }
+  byte_budget_ = original_byte_budget;
+  return status;
+}
+
 Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
     WebPData* const webp_data) {
+  CHECK_THUMBNAILER_STATUS(CheckCancelled());
+
+  // Reuse the animation if the same settings were already assembled. The
+  // qualities are always integral.
+  std::vector<int> key;
+  key.reserve(4 * frames_.size());
+  for (const FrameData& frame : frames_) {
+    key.insert(key.end(), {frame.timestamp_ms, frame.config.lossless,
+                           int(frame.config.quality),
+                           frame.config.near_lossless});
+  }
+  const auto cached = assembly_cache_.find(key);
+  if (cached != assembly_cache_.end()) {
+    stats_.set_assembly_cache_hits(stats_.assembly_cache_hits() + 1);
+    const WebPData cached_data = {cached->second.data(),
+                                  cached->second.size()};
+    return WebPDataCopy(&cached_data, webp_data) ? kOk : kMemoryError;
+  }
+
+  CHECK_THUMBNAILER_STATUS(AssembleAnimation(webp_data));
+  ReportProbe(webp_data->size);
+  if (cache_assemblies_ && assembly_cache_.size() < kMaxAssemblyCacheSize) {
+    assembly_cache_.emplace(
+        std::move(key),
+        std::vector<uint8_t>(webp_data->bytes,
+                             webp_data->bytes + webp_data->size));
+    bitstream_bytes_ += webp_data->size;
+    CHECK_THUMBNAILER_STATUS(ReserveMemory(0));
+  }
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::AssembleAnimation(WebPData* const webp_data) {
+  stats_.set_assemblies(stats_.assemblies() + 1);
+  THUMBNAILER_TRACE_EVENT(trace_event, "assemble");
+  THUMBNAILER_TRACE_ARG(trace_event, "frames", double(frames_.size()));
   // Delete the previous WebPAnimEncoder object and initialize a new one.
   WebPAnimEncoderDelete(enc_);
   enc_ = WebPAnimEncoderNew(frames_[0].pic.width, frames_[0].pic.height,
@@ -208,14 +569,19 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
   if (enc_ == nullptr) return kMemoryError;
 
   // Fill the animation.
+  const uint64_t encoder_bytes = GetEncoderBytes();
   int prev_timestamp = 0;
-  for (const FrameData& frame : frames_) {
+  for (FrameData& frame : frames_) {
     // Copy the 'frame.pic' to a new WebPPicture object and remain the original
     // 'frame.pic' for later comparison.
+    const WebPPicture* pic;
+    CHECK_THUMBNAILER_STATUS(GetEncodingPicture(&frame, &pic));
     WebPPicture new_pic;
+    CHECK_THUMBNAILER_STATUS(
+        ReserveMemory(GetEncodingBytes(*pic), encoder_bytes));
 
     // WebPAnimEncoderAdd uses starting timestamps instead of ending timestamps.
-    if (!WebPPictureCopy(&frame.pic, &new_pic) ||
+    if (!WebPPictureCopy(pic, &new_pic) ||
         !WebPAnimEncoderAdd(enc_, &new_pic, prev_timestamp, &frame.config)) {
       WebPPictureFree(&new_pic);
       return kMemoryError;
@@ -232,6 +598,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
   if (!WebPAnimEncoderAssemble(enc_, webp_data)) {
     return kMemoryError;
   }
+  THUMBNAILER_TRACE_ARG(trace_event, "size", double(webp_data->size));
 
   if (loop_count_ == 0) return kOk;
   return SetLoopCount(webp_data);
@@ -239,6 +606,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationConfigured(
 
 Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
     WebPData* const webp_data) {
+  PhaseTimer timer(this, "equal_quality");
   // Sort frames.
   std::sort(frames_.begin(), frames_.end(),
             [](const FrameData& a, const FrameData& b) -> bool {
@@ -264,30 +632,49 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
   }
   min_quality = std::max(min_quality, minimum_lossy_quality_);
 
-  int max_quality = 100;
   int final_quality = -1;
   WebPData new_webp_data;
   WebPDataInit(&new_webp_data);
 
-  while (min_quality <= max_quality) {
-    int mid_quality = (min_quality + max_quality) / 2;
-    for (FrameData& frame : frames_) {
-      if (!frame.near_lossless) {
-        frame.config.quality = std::max(frame.final_quality, mid_quality);
+  // Binary search in [low_quality, high_quality].
+  auto search = [&](int low_quality, int high_quality) -> Status {
+    while (low_quality <= high_quality) {
+      int mid_quality = (low_quality + high_quality) / 2;
+      for (FrameData& frame : frames_) {
+        if (!frame.near_lossless) {
+          frame.config.quality = std::max(frame.final_quality, mid_quality);
+        }
       }
-    }
 
-    CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
+      CHECK_THUMBNAILER_STATUS(GenerateAnimationConfigured(&new_webp_data));
 
-    if (new_webp_data.size <= byte_budget_) {
-      final_quality = mid_quality;
-      WebPDataClear(webp_data);
-      *webp_data = new_webp_data;
-      min_quality = mid_quality + 1;
-    } else {
-      max_quality = mid_quality - 1;
-      WebPDataClear(&new_webp_data);
+      if (new_webp_data.size <= byte_budget_) {
+        final_quality = mid_quality;
+        WebPDataClear(webp_data);
+        *webp_data = new_webp_data;
+        low_quality = mid_quality + 1;
+      } else {
+        high_quality = mid_quality - 1;
+        WebPDataClear(&new_webp_data);
+      }
+    }
+    return kOk;
+  };
+
+  if (warm_start_ && !slope_optim_done) {
+    // The predicted range is only a hint: the search continues outside of it
+    // if the answer is not strictly inside.
+    int low_quality, high_quality;
+    CHECK_THUMBNAILER_STATUS(
+        PredictQualityRange(min_quality, &low_quality, &high_quality));
+    CHECK_THUMBNAILER_STATUS(search(low_quality, high_quality));
+    if (final_quality == -1) {
+      CHECK_THUMBNAILER_STATUS(search(min_quality, low_quality - 1));
+    } else if (final_quality == high_quality) {
+      CHECK_THUMBNAILER_STATUS(search(high_quality + 1, 100));
     }
+  } else {
+    CHECK_THUMBNAILER_STATUS(search(min_quality, 100));
   }
 
   for (std::size_t i = 0; i < frames_.size(); ++i) {
@@ -307,6 +694,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualQuality(
 
 Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
     WebPData* const webp_data) {
+  PhaseTimer timer(this, "equal_psnr");
   CHECK_THUMBNAILER_STATUS(GenerateAnimationEqualQuality(webp_data));
 
   int high_psnr = -1;
@@ -325,6 +713,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
   }
 
   for (int target_psnr = high_psnr; target_psnr >= low_psnr; --target_psnr) {
+    CHECK_THUMBNAILER_STATUS(CheckCancelled());
     bool all_frames_iterated = true;
 
     WebPAnimEncoderDelete(enc_);
@@ -375,8 +764,12 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
 
       frame.config.quality = frame_final_quality;
 
+      const WebPPicture* pic;
+      CHECK_THUMBNAILER_STATUS(GetEncodingPicture(&frame, &pic));
       WebPPicture new_pic;
-      if (!WebPPictureCopy(&frame.pic, &new_pic) ||
+      CHECK_THUMBNAILER_STATUS(
+          ReserveMemory(GetEncodingBytes(*pic), GetEncoderBytes()));
+      if (!WebPPictureCopy(pic, &new_pic) ||
           !WebPAnimEncoderAdd(enc_, &new_pic, prev_timestamp, &frame.config)) {
         WebPPictureFree(&new_pic);
         return kMemoryError;
@@ -394,9 +787,14 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationEqualPSNR(
     if (all_frames_iterated) {
       WebPData new_webp_data;
       WebPDataInit(&new_webp_data);
+      stats_.set_assemblies(stats_.assemblies() + 1);
+      THUMBNAILER_TRACE_EVENT(trace_event, "assemble");
+      THUMBNAILER_TRACE_ARG(trace_event, "frames", double(frames_.size()));
       if (!WebPAnimEncoderAssemble(enc_, &new_webp_data)) {
         return kMemoryError;
       }
+      THUMBNAILER_TRACE_ARG(trace_event, "size", double(new_webp_data.size));
+      ReportProbe(new_webp_data.size);
       if (new_webp_data.size <= byte_budget_) {
         final_psnr = target_psnr;
         WebPDataClear(webp_data);
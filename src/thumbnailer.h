@@ -21,8 +21,15 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -30,6 +37,7 @@
 #include "../imageio/imageio_util.h"
 #include "../imageio/webpdec.h"
 #include "src/thumbnailer.pb.h"
+#include "thumbnailer_trace.h"
 #include "webp/encode.h"
 #include "webp/mux.h"
 
@@ -59,7 +67,8 @@ class Thumbnailer {
       kWebPMuxError,  // In case of error related to WebPMux object.
       kSlopeOptimError,  // In case of error while using slope optimization to
                          // generate animation.
-      kGenericError      // For other errors.
+      kGenericError,     // For other errors.
+      kCancelled         // If the generation was cancelled with Cancel().
   };
 
   enum Method {
@@ -67,20 +76,110 @@ class Thumbnailer {
     kEqualPSNR,
     kNearllEqual,
     kNearllDiff,
-    kSlopeOptim
+    kSlopeOptim,
+    kTemporalDecimation
   };
   static constexpr Method kMethodList[] = {
-      kEqualQuality, kEqualPSNR, kNearllEqual, kNearllDiff, kSlopeOptim};
+      kEqualQuality, kEqualPSNR,  kNearllEqual,
+      kNearllDiff,   kSlopeOptim, kTemporalDecimation};
+
+  // Sets '*method' from its name ("equal_quality", "equal_psnr",
+  // "near_ll_diff", "near_ll_equal", "slope_optim" or "temporal_decimation").
+  // Returns false if the name is unknown.
+  static bool ParseMethod(const std::string& method_name,
+                          Method* const method);
+
+  // Returns false on invalid configurations.
+  static bool ValidateOption(
+      const thumbnailer::ThumbnailerOption& thumbnailer_option);
+
+  // Progress of a generation, reported at each probe.
+  struct Progress {
+    Method method = kEqualQuality;  // Method being run.
+    size_t byte_budget = 0;         // Byte budget being targeted.
+    int num_probes = 0;    // Number of frame encodings and animation
+                           // assemblies so far.
+    size_t best_size = 0;  // Size of the biggest animation found to fit the
+                           // byte budget, or 0 if none yet.
+  };
+  // Called from the thread running the generation.
+  typedef std::function<void(const Progress&)> ProgressCallback;
+
+  // Called once the samples passed to AddFrameARGB() or AddFrameYUV() are not
+  // used anymore, at the latest when the Thumbnailer is destroyed.
+  typedef std::function<void()> ReleaseCallback;
 
   // Adds a frame with a timestamp (in millisecond). The 'pic' argument must
   // outlive the last GenerateAnimation() call.
   Status AddFrame(const WebPPicture& pic, int timestamp_ms);
 
-  // Generates the animation using the specified method.
-  Status GenerateAnimation(WebPData* const webp_data,
-                           Method method = kEqualQuality);
+  // Adds a frame and takes ownership of the samples of 'pic', which is then
+  // reset to an empty picture. On failure, 'pic' is left untouched.
+  Status AddFrame(WebPPicture&& pic, int timestamp_ms);
+
+  // Adds a frame wrapping the external ARGB samples 'argb' without copying
+  // them. The samples are native-endian 0xAARRGGBB words (i.e. BGRA bytes on
+  // little-endian hosts), and 'stride' is in pixels. They are never modified
+  // and must stay valid until 'release' (if any) is called. On failure,
+  // 'release' is not called.
+  Status AddFrameARGB(const uint32_t* argb, int width, int height, int stride,
+                      int timestamp_ms, ReleaseCallback release = nullptr);
+
+  // Same as AddFrameARGB() for YUV 4:2:0 planes. 'a' is the optional alpha
+  // plane (NULL if opaque), with its own 'a_stride'.
+  Status AddFrameYUV(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                     const uint8_t* a, int width, int height, int y_stride,
+                     int uv_stride, int a_stride, int timestamp_ms,
+                     ReleaseCallback release = nullptr);
+
+  // Generates the animation using the specified method. If it does not fit
+  // the soft byte budget, the hard byte budget is tried next. If 'stats' is
+  // not NULL, it is filled with statistics of the generation.
+  Status GenerateAnimation(
+      WebPData* const webp_data, Method method = kEqualQuality,
+      thumbnailer::ThumbnailerStats* const stats = nullptr);
+
+  // Generates one animation per byte budget using the specified method, and
+  // appends them to 'webp_data_list'. There is no hard budget fallback. The
+  // encoding statistics of frames are shared across budgets. On failure, the
+  // animations generated for the previous budgets are kept in
+  // 'webp_data_list'.
+  Status GenerateAnimation(
+      const std::vector<size_t>& byte_budgets,
+      std::vector<WebPData>* const webp_data_list,
+      Method method = kEqualQuality,
+      thumbnailer::ThumbnailerStats* const stats = nullptr);
+
+  // Runs GenerateAnimation() on another thread. The Thumbnailer and
+  // 'webp_data' must not be used until the returned future is ready.
+  std::future<Status> GenerateAnimationAsync(
+      WebPData* const webp_data, Method method = kEqualQuality,
+      thumbnailer::ThumbnailerStats* const stats = nullptr);
+
+  // Makes the running generation stop at its next probe, or at its end, and
+  // return kCancelled. Has no effect if no generation is running, as each
+  // generation starts uncancelled. Can be called from any thread, including
+  // from the progress callback.
+  void Cancel();
+
+  // Sets the callback reporting the progress of generations (none if NULL).
+  void SetProgressCallback(ProgressCallback progress_callback);
 
  private:
+  // Exposes the internals below to the tests and benchmarks.
+  friend class ThumbnailerTestPeer;
+
+  // Samples of a frame kept by the frame store, and its decompressed pictures
+  // while it is in 'decoded_frames_'.
+  struct StoredFrame {
+    std::vector<uint8_t> data;  // Compressed samples, unless spilled.
+    uint64_t spill_offset = 0;  // Location of the compressed samples in the
+    size_t spill_size = 0;      // spill file, if spilled.
+    size_t raw_size = 0;        // Size of the decompressed samples.
+    std::shared_ptr<WebPPicture> pic;
+    std::shared_ptr<WebPPicture> argb_pic;  // ARGB version of a YUV 'pic'.
+  };
+
   struct FrameData {
     WebPPicture pic;
     int timestamp_ms = 0;  // Ending timestamp in milliseconds.
@@ -92,9 +191,28 @@ class Thumbnailer {
 
     // Vectors storing the computed size and psnr of a frame for each lossy
     // quality factor (in range [0, 100]). This is to speed up duplicate
-    // GetPictureStats calls.
-    std::vector<int> lossy_size = std::vector<int>(101, -1);
-    std::vector<float> lossy_psnr = std::vector<float>(101, -1);
+    // GetPictureStats calls. They are shared by the copies of the frame, and
+    // by the frames of a cluster (see ClusterFrames()).
+    struct LossyStats {
+      std::vector<int> size = std::vector<int>(101, -1);
+      std::vector<float> psnr = std::vector<float>(101, -1);
+    };
+    std::shared_ptr<LossyStats> lossy_stats = std::make_shared<LossyStats>();
+
+    // Keeps the samples of 'pic' alive if they are owned by the Thumbnailer,
+    // as long as any copy of the frame exists.
+    std::shared_ptr<void> owner;
+
+    // Result of AnalyzeComplexity(), or -1 if not computed yet.
+    float complexity = -1;
+
+    // ARGB version of a YUV 'pic', created on first use by lossless and
+    // near-lossless encodings. Lossy encodings read the YUV samples directly.
+    std::shared_ptr<WebPPicture> argb_pic;
+
+    // If not null, the samples of 'pic' were moved to the frame store and its
+    // sample pointers are null. See LoadPicture().
+    std::shared_ptr<StoredFrame> stored;
 
     FrameData(const WebPPicture& pic, int timestamp_ms,
               const WebPConfig& config)
@@ -102,13 +220,138 @@ class Thumbnailer {
   };
   std::vector<FrameData> frames_;
   WebPAnimEncoder* enc_ = NULL;
+
+  // Animations generated by GenerateAnimationConfigured(), keyed by the
+  // (timestamp, lossless, quality, near_lossless) tuples of all frames. It
+  // only keeps the first kMaxAssemblyCacheSize animations, which are the
+  // first probes of the searches and thus the ones most likely to recur.
+  static constexpr size_t kMaxAssemblyCacheSize = 32;
+  std::map<std::vector<int>, std::vector<uint8_t>> assembly_cache_;
+
   WebPAnimEncoderOptions anim_config_;
   int loop_count_;
   size_t byte_budget_;
+  size_t hard_byte_budget_;
   int minimum_lossy_quality_;
   bool verbose_;
   int webp_method_;
   float slope_dPSNR_;
+  int decimation_quality_;
+  bool warm_start_;
+  float cluster_psnr_;
+  bool frames_clustered_ = false;
+
+  std::atomic<bool> cancelled_{false};
+  ProgressCallback progress_callback_;
+  Progress progress_;
+
+  // Statistics of the current generation, and size of the pictures and of
+  // the cached animations it holds.
+  thumbnailer::ThumbnailerStats stats_;
+  uint64_t picture_bytes_ = 0;
+  uint64_t bitstream_bytes_ = 0;
+
+  // Picture last returned by GetARGBPicture(), which DropCaches() keeps.
+  const WebPPicture* last_argb_pic_ = nullptr;
+
+  // Limit of the memory held by a generation (none if 0). Animations are not
+  // cached anymore once the caches were dropped to respect it.
+  uint64_t max_memory_bytes_ = 0;
+  bool cache_assemblies_ = true;
+
+  // The animation encoder holds about this many canvases besides the added
+  // frames.
+  static constexpr int kEncoderCanvases = 4;
+
+  // Frame store (see ThumbnailerOption.frame_store), with the stored frames
+  // that are decompressed, most recently used first.
+  thumbnailer::ThumbnailerOption::FrameStore frame_store_ =
+      thumbnailer::ThumbnailerOption::RESIDENT;
+  std::string spill_directory_;
+  int spill_fd_ = -1;
+  uint64_t spill_file_size_ = 0;
+  size_t max_decoded_frames_ = 4;
+  std::list<std::shared_ptr<StoredFrame>> decoded_frames_;
+
+  // Adds the wall and CPU times spent in its scope to the 'name' phase of
+  // 'stats_', and records it as a trace event if enabled.
+  class PhaseTimer {
+   public:
+    PhaseTimer(Thumbnailer* const thumbnailer, const char* const name);
+    ~PhaseTimer();
+
+   private:
+    thumbnailer::ThumbnailerStats::Phase* phase_;
+#ifdef THUMBNAILER_ENABLE_TRACE
+    TraceEvent trace_event_;
+#endif
+    std::chrono::steady_clock::time_point wall_start_;
+    double cpu_start_ms_;
+  };
+
+  // Resets 'stats_' before a generation. Returns kMemoryError if the frames
+  // alone exceed 'max_memory_bytes_'.
+  Status StartStats();
+
+  // Completes 'stats_' with the settings of the frames and copies it to
+  // 'stats' (if not NULL).
+  void FinishStats(size_t animation_size,
+                   thumbnailer::ThumbnailerStats* const stats);
+
+  // Accounts for 'extra_picture_bytes' of pictures and 'extra_bytes' of other
+  // buffers held temporarily on top of 'picture_bytes_' and
+  // 'bitstream_bytes_'. Drops the caches if the total exceeds
+  // 'max_memory_bytes_', and returns kMemoryError if it still does.
+  Status ReserveMemory(uint64_t extra_picture_bytes, uint64_t extra_bytes = 0);
+
+  // Empties the assembly cache, which is not filled anymore until the next
+  // generation, and frees the pictures that can be rebuilt: the ARGB versions
+  // of YUV frames and the decompressed stored frames. The pictures in use
+  // (see LoadPicture() and GetARGBPicture()) are kept.
+  void DropCaches();
+
+  // Frees '*argb_pic' if no copy of its frame shares it, and resets it.
+  void ReleaseARGBPicture(std::shared_ptr<WebPPicture>* const argb_pic);
+
+  // Frees the least recently used decompressed stored frames until at most
+  // 'max_decoded_frames' (but no less than two) remain.
+  void EvictDecodedFrames(size_t max_decoded_frames);
+
+  // Returns the size of the samples of 'pic'.
+  static uint64_t GetPictureBytes(const WebPPicture& pic);
+
+  // Returns the size of a copy of 'pic' once converted to ARGB by
+  // WebPPictureDistortion() or the animation encoder, if it is YUV.
+  static uint64_t GetEncodingBytes(const WebPPicture& pic);
+
+  // Returns the estimated size of the state of the animation encoder.
+  uint64_t GetEncoderBytes() const;
+
+  // Makes the last added frame call 'release' once it is not used anymore.
+  void SetReleaseCallback(ReleaseCallback release);
+
+  // Moves the samples of 'frame' to the frame store, compressed.
+  Status StoreFrame(FrameData* const frame);
+
+  // Points '*pic' to the samples of 'frame', decompressing them from the frame
+  // store if needed. The two most recently loaded frames stay valid.
+  Status LoadPicture(FrameData* const frame, const WebPPicture** const pic);
+
+  // Points '*argb_pic' to the ARGB samples of 'frame', converting its YUV
+  // samples the first time if needed. The last returned picture stays valid.
+  Status GetARGBPicture(FrameData* const frame,
+                        const WebPPicture** const argb_pic);
+
+  // Points '*pic' to the samples 'frame' is encoded from: the original ones
+  // (possibly YUV) if it is lossy, ARGB ones otherwise. Only lossless and
+  // near-lossless encodings need a lasting ARGB version of YUV frames.
+  Status GetEncodingPicture(FrameData* const frame,
+                            const WebPPicture** const pic);
+
+  // Stores the luma and alpha of the samples of the row 'y' of 'pic', which
+  // may be ARGB or YUV, into 'luma' and 'alpha' ('pic.width' values each).
+  static void GetLumaAlphaRow(const WebPPicture& pic, int y, int* const luma,
+                              int* const alpha);
 
   // Computes the size (in bytes) and PSNR of the 'ind'-th frame. The resulting
   // size and PSNR will be stored in '*pic_size' and '*pic_psnr' respectively.
@@ -117,9 +360,30 @@ class Thumbnailer {
 
   Status SetLoopCount(WebPData* const webp_data);
 
+  // Implementations of the public GenerateAnimation() functions.
+  Status GenerateAnimationWithFallback(WebPData* const webp_data,
+                                       Method method);
+  Status GenerateAnimationLadder(const std::vector<size_t>& byte_budgets,
+                                 std::vector<WebPData>* const webp_data_list,
+                                 Method method);
+
+  // Returns kCancelled if Cancel() was called, kOk otherwise.
+  Status CheckCancelled() const;
+
+  // Counts a probe and reports the progress. 'size' is the size of the
+  // animation assembled by the probe, if any.
+  void ReportProbe(size_t size = 0);
+
+  // Generates the animation with the specified method for the current byte
+  // budget.
+  Status GenerateAnimationWithMethod(WebPData* const webp_data, Method method);
+
   // Generates the animation with given config for each frame.
   Status GenerateAnimationConfigured(WebPData* const webp_data);
 
+  // Encodes and assembles the animation for GenerateAnimationConfigured().
+  Status AssembleAnimation(WebPData* const webp_data);
+
   // Finds the best quality for lossy compression that makes the animation fit
   // right below the given byte budget and generates the animation. The 'config'
   // of near-losslessly-encoded frames will not be modified. The 'webp_data'
@@ -173,6 +437,47 @@ class Thumbnailer {
   // animation.
   Status LossyEncodeNoSlopeOptim(WebPData* const webp_data);
 
+  // Drops the frames that are the most similar to their predecessor (which
+  // then lasts until the end of the dropped frame) until the animation fits
+  // the byte budget with the same quality of at least 'decimation_quality_'
+  // for all frames. At most half of the frames are dropped. The frames of the
+  // thumbnailer are left unchanged, except for their final settings.
+  Status GenerateAnimationTemporalDecimation(WebPData* const webp_data);
+
+  // Implements GenerateAnimationTemporalDecimation() on 'frames_', sorted by
+  // timestamp, by erasing the dropped frames. 'kept' holds the original index
+  // of each frame of 'frames_' and is updated alike. Both end up matching the
+  // returned animation, even if a later search did not fit the byte budget.
+  Status DropSimilarFrames(WebPData* const webp_data,
+                           std::vector<int>* const kept);
+
+  // Computes the PSNR between the 'ind1'-th and 'ind2'-th frames.
+  Status GetFrameSimilarity(int ind1, int ind2, float* const psnr);
+
+  // Computes a cheap estimate of how costly 'frame' is to encode, from the
+  // gradients, the Hadamard activity and the alpha coverage of a subsample of
+  // its 4x4 blocks. The result is stored in 'frame->complexity'.
+  Status AnalyzeComplexity(FrameData* const frame);
+
+  // Predicts the range of qualities (within [min_quality, 100]) in which
+  // GenerateAnimationEqualQuality() is likely to find its answer. The frame of
+  // median complexity is encoded at a few qualities to fit a log-linear
+  // size model, which is scaled to the other frames by their complexity.
+  Status PredictQualityRange(int min_quality, int* const low_quality,
+                             int* const high_quality);
+
+  // Groups consecutive frames whose signatures are within 'cluster_psnr_' of
+  // the first frame of their cluster. The frames of a cluster share their
+  // lossy statistics, so that the size and PSNR probed for one frame stand for
+  // the whole cluster. Only the final animation is encoded from every frame.
+  // Does nothing if 'cluster_psnr_' is not positive or if it already ran since
+  // the last added frame. Otherwise the statistics of all frames start over.
+  Status ClusterFrames();
+
+  // Computes a downsampled luma and alpha signature of 'frame'.
+  Status ComputeSignature(FrameData* const frame,
+                          std::vector<uint8_t>* const signature);
+
   // Returns animation size (in bytes).
   size_t GetAnimationSize(WebPData* const webp_data);
 };
@@ -0,0 +1,111 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+namespace {
+
+// The signature of a frame is a 16x16 grid of average luma and alpha values.
+constexpr int kSignatureSize = 16;
+
+// Returns the PSNR between two signatures.
+float GetSignaturePSNR(const std::vector<uint8_t>& sig1,
+                       const std::vector<uint8_t>& sig2) {
+  int64_t sse = 0;
+  for (std::size_t i = 0; i < sig1.size(); ++i) {
+    const int diff = sig1[i] - sig2[i];
+    sse += diff * diff;
+  }
+  if (sse == 0) return 99.f;
+  return 10.f * std::log10(255.f * 255.f * sig1.size() / sse);
+}
+
+}  // namespace
+
+Thumbnailer::Status Thumbnailer::ComputeSignature(
+    FrameData* const frame, std::vector<uint8_t>* const signature) {
+  const WebPPicture* pic;
+  CHECK_THUMBNAILER_STATUS(LoadPicture(frame, &pic));
+
+  constexpr int kNumCells = kSignatureSize * kSignatureSize;
+  std::vector<uint32_t> luma_sum(kNumCells, 0);
+  std::vector<uint32_t> alpha_sum(kNumCells, 0);
+  std::vector<uint32_t> count(kNumCells, 0);
+  std::vector<int> luma(pic->width), alpha(pic->width);
+  for (int y = 0; y < pic->height; ++y) {
+    const int cell_y = y * kSignatureSize / pic->height;
+    GetLumaAlphaRow(*pic, y, luma.data(), alpha.data());
+    for (int x = 0; x < pic->width; ++x) {
+      const int cell =
+          cell_y * kSignatureSize + x * kSignatureSize / pic->width;
+      luma_sum[cell] += luma[x];
+      alpha_sum[cell] += alpha[x];
+      ++count[cell];
+    }
+  }
+
+  signature->assign(2 * kNumCells, 0);
+  for (int i = 0; i < kNumCells; ++i) {
+    if (count[i] == 0) continue;  // Frames smaller than the grid.
+    (*signature)[2 * i + 0] = luma_sum[i] / count[i];
+    (*signature)[2 * i + 1] = alpha_sum[i] / count[i];
+  }
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::ClusterFrames() {
+  if (cluster_psnr_ <= 0 || frames_clustered_ || frames_.empty()) return kOk;
+  PhaseTimer timer(this, "clustering");
+
+  std::sort(frames_.begin(), frames_.end(),
+            [](const FrameData& a, const FrameData& b) -> bool {
+              return a.timestamp_ms < b.timestamp_ms;
+            });
+  // Frames added since the last clustering may split former clusters, whose
+  // frames must not keep sharing the statistics of their former
+  // representative.
+  for (FrameData& frame : frames_) {
+    frame.lossy_stats = std::make_shared<FrameData::LossyStats>();
+  }
+
+  // Each frame is compared to the first frame of the current cluster rather
+  // than to its predecessor, so that slow changes do not accumulate.
+  std::vector<uint8_t> representative_signature;
+  std::vector<uint8_t> signature;
+  int representative_ind = 0;
+  int num_clusters = 1;
+  CHECK_THUMBNAILER_STATUS(
+      ComputeSignature(&frames_[0], &representative_signature));
+  for (std::size_t i = 1; i < frames_.size(); ++i) {
+    CHECK_THUMBNAILER_STATUS(ComputeSignature(&frames_[i], &signature));
+    if (GetSignaturePSNR(representative_signature, signature) >=
+        cluster_psnr_) {
+      frames_[i].lossy_stats = frames_[representative_ind].lossy_stats;
+    } else {
+      representative_ind = i;
+      representative_signature.swap(signature);
+      ++num_clusters;
+    }
+  }
+
+  frames_clustered_ = true;
+  if (verbose_) {
+    std::cout << "Frame clusters: " << num_clusters << std::endl;
+  }
+  return kOk;
+}
+
+}  // namespace libwebp
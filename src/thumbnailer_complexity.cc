@@ -0,0 +1,198 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+namespace {
+
+// Only one 4x4 block out of each 8x8 area is analyzed.
+constexpr int kBlockSize = 4;
+constexpr int kBlockStep = 8;
+
+// Qualities at which the representative frame is encoded.
+constexpr int kCalibrationQualities[] = {25, 50, 75};
+
+// Half-width of the predicted quality range.
+constexpr int kWarmStartMargin = 5;
+
+// Returns the sum of the absolute AC coefficients of the 4x4 Walsh-Hadamard
+// transform of 'block', normalized to the scale of the samples.
+int GetHadamardActivity(const int block[16]) {
+  int tmp[16];
+  for (int i = 0; i < 4; ++i) {
+    const int* const in = block + 4 * i;
+    const int a0 = in[0] + in[2];
+    const int a1 = in[1] + in[3];
+    const int a2 = in[1] - in[3];
+    const int a3 = in[0] - in[2];
+    tmp[4 * i + 0] = a0 + a1;
+    tmp[4 * i + 1] = a3 + a2;
+    tmp[4 * i + 2] = a3 - a2;
+    tmp[4 * i + 3] = a0 - a1;
+  }
+  int sum = 0;
+  int dc = 0;
+  for (int i = 0; i < 4; ++i) {
+    const int a0 = tmp[0 + i] + tmp[8 + i];
+    const int a1 = tmp[4 + i] + tmp[12 + i];
+    const int a2 = tmp[4 + i] - tmp[12 + i];
+    const int a3 = tmp[0 + i] - tmp[8 + i];
+    if (i == 0) dc = std::abs(a0 + a1);
+    sum += std::abs(a0 + a1) + std::abs(a3 + a2) + std::abs(a3 - a2) +
+           std::abs(a0 - a1);
+  }
+  return (sum - dc) >> 2;
+}
+
+}  // namespace
+
+void Thumbnailer::GetLumaAlphaRow(const WebPPicture& pic, int y,
+                                  int* const luma, int* const alpha) {
+  // The format is checked once per row, so that each loop is vectorized.
+  if (pic.use_argb) {
+    const uint32_t* const argb = pic.argb + y * pic.argb_stride;
+    for (int x = 0; x < pic.width; ++x) {
+      luma[x] = (77 * ((argb[x] >> 16) & 0xff) +
+                 150 * ((argb[x] >> 8) & 0xff) + 29 * (argb[x] & 0xff)) >> 8;
+    }
+    for (int x = 0; x < pic.width; ++x) alpha[x] = argb[x] >> 24;
+    return;
+  }
+  // Expands the limited range of the Y samples.
+  const uint8_t* const y_row = pic.y + y * pic.y_stride;
+  for (int x = 0; x < pic.width; ++x) {
+    luma[x] = std::min(std::max((y_row[x] - 16) * 255 / 219, 0), 255);
+  }
+  if (pic.a != nullptr) {
+    const uint8_t* const a_row = pic.a + y * pic.a_stride;
+    std::copy(a_row, a_row + pic.width, alpha);
+  } else {
+    std::fill(alpha, alpha + pic.width, 0xff);
+  }
+}
+
+Thumbnailer::Status Thumbnailer::AnalyzeComplexity(FrameData* const frame) {
+  const WebPPicture* pic;
+  CHECK_THUMBNAILER_STATUS(LoadPicture(frame, &pic));
+
+  int64_t gradient = 0;
+  int64_t activity = 0;
+  int num_blocks = 0;
+  int num_visible_pixels = 0;
+  int block[kBlockSize * kBlockSize];
+  // Luma and alpha of the rows of the current blocks.
+  std::vector<int> luma(kBlockSize * pic->width);
+  std::vector<int> alpha(kBlockSize * pic->width);
+  for (int y = 0; y + kBlockSize <= pic->height; y += kBlockStep) {
+    for (int j = 0; j < kBlockSize; ++j) {
+      GetLumaAlphaRow(*pic, y + j, &luma[j * pic->width],
+                      &alpha[j * pic->width]);
+    }
+    for (int x = 0; x + kBlockSize <= pic->width; x += kBlockStep) {
+      for (int j = 0; j < kBlockSize; ++j) {
+        for (int i = 0; i < kBlockSize; ++i) {
+          block[j * kBlockSize + i] = luma[j * pic->width + x + i];
+          num_visible_pixels += alpha[j * pic->width + x + i] != 0;
+        }
+      }
+      for (int j = 0; j < kBlockSize; ++j) {
+        for (int i = 0; i + 1 < kBlockSize; ++i) {
+          gradient += std::abs(block[j * kBlockSize + i + 1] -
+                               block[j * kBlockSize + i]);
+          gradient += std::abs(block[(i + 1) * kBlockSize + j] -
+                               block[i * kBlockSize + j]);
+        }
+      }
+      activity += GetHadamardActivity(block);
+      ++num_blocks;
+    }
+  }
+  if (num_blocks == 0) {
+    frame->complexity = 0;
+    return kOk;
+  }
+
+  // Transparent areas are almost free to encode.
+  const int num_pixels = num_blocks * kBlockSize * kBlockSize;
+  const float alpha_coverage = float(num_visible_pixels) / num_pixels;
+  frame->complexity = float(gradient + activity) / num_pixels * alpha_coverage;
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::PredictQualityRange(
+    int min_quality, int* const low_quality, int* const high_quality) {
+  PhaseTimer timer(this, "warm_start");
+  *low_quality = min_quality;
+  *high_quality = 100;
+
+  for (FrameData& frame : frames_) {
+    if (frame.complexity < 0) {
+      CHECK_THUMBNAILER_STATUS(AnalyzeComplexity(&frame));
+    }
+  }
+  std::vector<int> order(frames_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::nth_element(order.begin(), order.begin() + order.size() / 2,
+                   order.end(), [this](int a, int b) {
+                     return frames_[a].complexity < frames_[b].complexity;
+                   });
+  const int ref_ind = order[order.size() / 2];
+  FrameData& ref_frame = frames_[ref_ind];
+
+  // Least-squares fit of log(size) = intercept + slope * quality. These
+  // probes are cached with the other lossy statistics of the frame.
+  const float original_quality = ref_frame.config.quality;
+  double sum_q = 0., sum_l = 0., sum_qq = 0., sum_ql = 0.;
+  for (const int quality : kCalibrationQualities) {
+    ref_frame.config.quality = quality;
+    size_t size;
+    float psnr;
+    CHECK_THUMBNAILER_STATUS(GetPictureStats(ref_ind, &size, &psnr));
+    const double log_size = std::log(std::max(size_t(1), size));
+    sum_q += quality;
+    sum_l += log_size;
+    sum_qq += quality * quality;
+    sum_ql += quality * log_size;
+  }
+  ref_frame.config.quality = original_quality;
+  const int n = std::size(kCalibrationQualities);
+  const double slope =
+      (n * sum_ql - sum_q * sum_l) / (n * sum_qq - sum_q * sum_q);
+  const double intercept = (sum_l - slope * sum_q) / n;
+  if (!(slope > 0.)) return kOk;  // Degenerate fit, no prediction.
+
+  // The size of each frame is assumed to scale with its complexity.
+  double size_ratio = 0.;
+  for (const FrameData& frame : frames_) {
+    size_ratio += (frame.complexity + 1.) / (ref_frame.complexity + 1.);
+  }
+  const double quality =
+      (std::log(byte_budget_ / size_ratio) - intercept) / slope;
+  const int predicted_quality = std::max(
+      min_quality, std::min(100, int(std::lround(quality))));
+  *low_quality = std::max(min_quality, predicted_quality - kWarmStartMargin);
+  *high_quality = std::min(100, predicted_quality + kWarmStartMargin);
+  if (verbose_) {
+    std::cout << "Predicted quality: " << predicted_quality << std::endl;
+  }
+  return kOk;
+}
+
+}  // namespace libwebp
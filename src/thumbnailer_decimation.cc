@@ -0,0 +1,155 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <numeric>
+
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+Thumbnailer::Status Thumbnailer::GenerateAnimationTemporalDecimation(
+    WebPData* const webp_data) {
+  PhaseTimer timer(this, "temporal_decimation");
+  // The frames are only dropped from the generated animation: the search runs
+  // on a copy of the frames sorted by timestamp, and all of them are restored
+  // for the next generations.
+  const std::vector<FrameData> original_frames = frames_;
+  std::vector<int> kept(frames_.size());
+  std::iota(kept.begin(), kept.end(), 0);
+  std::stable_sort(kept.begin(), kept.end(), [&](int a, int b) {
+    return original_frames[a].timestamp_ms < original_frames[b].timestamp_ms;
+  });
+  frames_.clear();
+  for (const int ind : kept) frames_.push_back(original_frames[ind]);
+
+  const Status status = DropSimilarFrames(webp_data, &kept);
+
+  // The kept frames keep their final settings, but not their longer duration.
+  std::vector<FrameData> decimated_frames = std::move(frames_);
+  frames_ = original_frames;
+  for (FrameData& frame : frames_) frame.encoded_size = 0;
+  for (std::size_t i = 0; i < decimated_frames.size(); ++i) {
+    FrameData& frame = frames_[kept[i]];
+    const int timestamp_ms = frame.timestamp_ms;
+    frame = decimated_frames[i];
+    frame.timestamp_ms = timestamp_ms;
+  }
+  stats_.set_dropped_frames(frames_.size() - decimated_frames.size());
+  return status;
+}
+
+Thumbnailer::Status Thumbnailer::DropSimilarFrames(
+    WebPData* const webp_data, std::vector<int>* const kept) {
+  // 'similarity[i]' is the PSNR between the 'i'-th frame and its predecessor.
+  // The first frame is never dropped.
+  std::vector<float> similarity(frames_.size(), 0.);
+  for (std::size_t i = 1; i < frames_.size(); ++i) {
+    CHECK_THUMBNAILER_STATUS(GetFrameSimilarity(i - 1, i, &similarity[i]));
+  }
+
+  const int num_frames = frames_.size();
+  const int max_dropped_frames = num_frames / 2;
+  int num_dropped_frames = 0;
+  bool fits_budget = false;
+  WebPData new_webp_data;
+  WebPDataInit(&new_webp_data);
+  Status status;
+  // Frames (with their final settings) of the animation in 'webp_data'.
+  std::vector<FrameData> fitting_frames;
+  std::vector<int> fitting_kept;
+  const auto release_argb_pictures = [this](std::vector<FrameData>* frames) {
+    for (FrameData& frame : *frames) ReleaseARGBPicture(&frame.argb_pic);
+  };
+
+  while (true) {
+    // Start a new binary search on the remaining frames.
+    for (FrameData& frame : frames_) frame.final_quality = -1;
+    status = GenerateAnimationEqualQuality(&new_webp_data);
+    if (status == kOk) {
+      fits_budget = true;
+      WebPDataClear(webp_data);
+      *webp_data = new_webp_data;
+      WebPDataInit(&new_webp_data);
+      release_argb_pictures(&fitting_frames);
+      fitting_frames = frames_;
+      fitting_kept = *kept;
+    } else if (status != kByteBudgetError) {
+      return status;
+    }
+
+    if ((status == kOk && frames_[0].final_quality >= decimation_quality_) ||
+        num_dropped_frames == max_dropped_frames) {
+      break;
+    }
+
+    // Drop about a tenth of the remaining frames before the next search.
+    const int batch_size =
+        std::max(1, std::min(max_dropped_frames - num_dropped_frames,
+                             int(frames_.size()) / 10));
+    for (int i = 0; i < batch_size; ++i) {
+      const int ind =
+          std::max_element(similarity.begin() + 1, similarity.end()) -
+          similarity.begin();
+      frames_[ind - 1].timestamp_ms = frames_[ind].timestamp_ms;
+      // The input frames keep their pictures, but not an ARGB version made
+      // for this search.
+      ReleaseARGBPicture(&frames_[ind].argb_pic);
+      frames_.erase(frames_.begin() + ind);
+      kept->erase(kept->begin() + ind);
+      similarity.erase(similarity.begin() + ind);
+      if (ind < int(frames_.size())) {
+        CHECK_THUMBNAILER_STATUS(
+            GetFrameSimilarity(ind - 1, ind, &similarity[ind]));
+      }
+      ++num_dropped_frames;
+    }
+  }
+
+  // The last search may have failed after dropping more frames: return the
+  // frames of the animation that fits.
+  if (fits_budget && status != kOk) {
+    release_argb_pictures(&frames_);
+    frames_ = std::move(fitting_frames);
+    *kept = std::move(fitting_kept);
+    num_dropped_frames = num_frames - frames_.size();
+  } else {
+    release_argb_pictures(&fitting_frames);
+  }
+  if (verbose_) {
+    std::cout << "Dropped frames: " << num_dropped_frames << std::endl;
+  }
+  return fits_budget ? kOk : kByteBudgetError;
+}
+
+Thumbnailer::Status Thumbnailer::GetFrameSimilarity(int ind1, int ind2,
+                                                    float* const psnr) {
+  const WebPPicture* pic1;
+  const WebPPicture* pic2;
+  CHECK_THUMBNAILER_STATUS(LoadPicture(&frames_[ind1], &pic1));
+  CHECK_THUMBNAILER_STATUS(LoadPicture(&frames_[ind2], &pic2));
+  CHECK_THUMBNAILER_STATUS(ReserveMemory(
+      GetEncodingBytes(*pic1) - GetPictureBytes(*pic1) +
+      GetEncodingBytes(*pic2) - GetPictureBytes(*pic2)));
+
+  // The distortion is accumulated by the SIMD implementations of libwebp,
+  // which convert YUV samples to ARGB on the fly.
+  float distortion_result[5];
+  if (!WebPPictureDistortion(pic1, pic2, 0, distortion_result)) {
+    return kStatsError;
+  }
+  *psnr = distortion_result[4];  // PSNR-all.
+  return kOk;
+}
+
+}  // namespace libwebp
@@ -0,0 +1,198 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "thumbnailer.h"
+#include "zstd.h"
+
+namespace libwebp {
+
+namespace {
+
+// Frames are compressed once and decompressed many times: favor speed.
+constexpr int kCompressionLevel = 1;
+
+// The frame store always keeps the two frames compared by
+// GetFrameSimilarity() or encoded by GetPictureStats() decompressed.
+constexpr size_t kMinDecodedFrames = 2;
+
+struct Plane {
+  uint8_t* samples;
+  int row_size;  // In bytes.
+  int num_rows;
+  int stride;  // In bytes.
+};
+
+// Returns the sample planes of 'pic', in serialization order.
+std::vector<Plane> GetPlanes(const WebPPicture& pic) {
+  if (pic.use_argb) {
+    return {{reinterpret_cast<uint8_t*>(pic.argb),
+             pic.width * int(sizeof(uint32_t)), pic.height,
+             pic.argb_stride * int(sizeof(uint32_t))}};
+  }
+  const int uv_width = (pic.width + 1) / 2;
+  const int uv_height = (pic.height + 1) / 2;
+  std::vector<Plane> planes = {{pic.y, pic.width, pic.height, pic.y_stride},
+                               {pic.u, uv_width, uv_height, pic.uv_stride},
+                               {pic.v, uv_width, uv_height, pic.uv_stride}};
+  if (pic.a != nullptr) {
+    planes.push_back({pic.a, pic.width, pic.height, pic.a_stride});
+  }
+  return planes;
+}
+
+}  // namespace
+
+Thumbnailer::Status Thumbnailer::StoreFrame(FrameData* const frame) {
+  std::vector<uint8_t> raw;
+  for (const Plane& plane : GetPlanes(frame->pic)) {
+    for (int y = 0; y < plane.num_rows; ++y) {
+      const uint8_t* const row = plane.samples + y * plane.stride;
+      raw.insert(raw.end(), row, row + plane.row_size);
+    }
+  }
+
+  auto stored = std::make_shared<StoredFrame>();
+  stored->raw_size = raw.size();
+  stored->data.resize(ZSTD_compressBound(raw.size()));
+  const size_t size =
+      ZSTD_compress(stored->data.data(), stored->data.size(), raw.data(),
+                    raw.size(), kCompressionLevel);
+  if (ZSTD_isError(size)) return kGenericError;
+  stored->data.resize(size);
+
+  if (frame_store_ == thumbnailer::ThumbnailerOption::SPILLED) {
+    if (spill_fd_ == -1) {
+      std::string path = spill_directory_ + "/thumbnailer_XXXXXX";
+      spill_fd_ = mkstemp(&path[0]);
+      if (spill_fd_ == -1) {
+        if (verbose_) {
+          std::cerr << "Cannot create a spill file in " << spill_directory_
+                    << std::endl;
+        }
+        return kGenericError;
+      }
+      unlink(path.c_str());  // The space is reclaimed once closed.
+    }
+    for (size_t written = 0; written < size;) {
+      const ssize_t result =
+          pwrite(spill_fd_, stored->data.data() + written, size - written,
+                 spill_file_size_ + written);
+      if (result <= 0) return kGenericError;
+      written += result;
+    }
+    stored->spill_offset = spill_file_size_;
+    stored->spill_size = size;
+    spill_file_size_ += size;
+    std::vector<uint8_t>().swap(stored->data);
+  } else {
+    stored->data.shrink_to_fit();
+  }
+
+  // Only the dimensions and the format of 'frame->pic' remain.
+  frame->pic.y = frame->pic.u = frame->pic.v = frame->pic.a = nullptr;
+  frame->pic.argb = nullptr;
+  frame->pic.memory_ = frame->pic.memory_argb_ = nullptr;
+  frame->stored = std::move(stored);
+  return kOk;
+}
+
+Thumbnailer::Status Thumbnailer::LoadPicture(FrameData* const frame,
+                                             const WebPPicture** const pic) {
+  StoredFrame* const stored = frame->stored.get();
+  if (stored == nullptr) {
+    *pic = &frame->pic;
+    return kOk;
+  }
+  if (stored->pic != nullptr) {
+    for (auto it = decoded_frames_.begin(); it != decoded_frames_.end(); ++it) {
+      if (it->get() == stored) {
+        decoded_frames_.splice(decoded_frames_.begin(), decoded_frames_, it);
+        break;
+      }
+    }
+    *pic = stored->pic.get();
+    return kOk;
+  }
+
+  // Spilled frames are mapped from the page that contains their start.
+  const uint8_t* compressed = stored->data.data();
+  size_t compressed_size = stored->data.size();
+  void* mapping = MAP_FAILED;
+  size_t mapping_size = 0;
+  if (stored->spill_size > 0) {
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t start = stored->spill_offset / page_size * page_size;
+    mapping_size = stored->spill_offset + stored->spill_size - start;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, spill_fd_,
+                   start);
+    if (mapping == MAP_FAILED) return kGenericError;
+    compressed =
+        static_cast<const uint8_t*>(mapping) + (stored->spill_offset - start);
+    compressed_size = stored->spill_size;
+  }
+  std::vector<uint8_t> raw(stored->raw_size);
+  const size_t raw_size =
+      ZSTD_decompress(raw.data(), raw.size(), compressed, compressed_size);
+  if (mapping != MAP_FAILED) munmap(mapping, mapping_size);
+  if (ZSTD_isError(raw_size) || raw_size != raw.size()) return kGenericError;
+
+  std::shared_ptr<WebPPicture> new_pic(new WebPPicture,
+                                       [](WebPPicture* const pic) {
+                                         WebPPictureFree(pic);
+                                         delete pic;
+                                       });
+  if (!WebPPictureInit(new_pic.get())) return kMemoryError;
+  new_pic->use_argb = frame->pic.use_argb;
+  new_pic->colorspace = frame->pic.colorspace;
+  new_pic->width = frame->pic.width;
+  new_pic->height = frame->pic.height;
+  if (!WebPPictureAlloc(new_pic.get())) return kMemoryError;
+  const uint8_t* src = raw.data();
+  for (const Plane& plane : GetPlanes(*new_pic)) {
+    for (int y = 0; y < plane.num_rows; ++y) {
+      std::memcpy(plane.samples + y * plane.stride, src, plane.row_size);
+      src += plane.row_size;
+    }
+  }
+
+  stored->pic = std::move(new_pic);
+  picture_bytes_ += GetPictureBytes(*stored->pic);
+  decoded_frames_.push_front(frame->stored);
+  EvictDecodedFrames(max_decoded_frames_);
+  stats_.set_frame_loads(stats_.frame_loads() + 1);
+  *pic = stored->pic.get();
+  return ReserveMemory(0);
+}
+
+void Thumbnailer::EvictDecodedFrames(size_t max_decoded_frames) {
+  while (decoded_frames_.size() >
+         std::max(kMinDecodedFrames, max_decoded_frames)) {
+    StoredFrame* const evicted = decoded_frames_.back().get();
+    picture_bytes_ -= GetPictureBytes(*evicted->pic);
+    if (evicted->argb_pic != nullptr) {
+      picture_bytes_ -= GetPictureBytes(*evicted->argb_pic);
+    }
+    evicted->argb_pic.reset();
+    evicted->pic.reset();
+    decoded_frames_.pop_back();
+  }
+}
+
+}  // namespace libwebp
@@ -22,6 +22,7 @@ namespace libwebp {
 static const int kPreprocessingList[6] = {0, 20, 40, 60, 80, 100};
 
 Thumbnailer::Status Thumbnailer::NearLosslessDiff(WebPData* const webp_data) {
+  PhaseTimer timer(this, "near_lossless");
   size_t anim_size = GetAnimationSize(webp_data);
 
   int curr_ind = 0;
@@ -104,6 +105,7 @@ Thumbnailer::Status Thumbnailer::NearLosslessDiff(WebPData* const webp_data) {
 }
 
 Thumbnailer::Status Thumbnailer::NearLosslessEqual(WebPData* const webp_data) {
+  PhaseTimer timer(this, "near_lossless");
   const int num_frames = frames_.size();
 
   // Encode frames following the ascending order of frame sizes.
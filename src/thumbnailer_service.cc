@@ -0,0 +1,271 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer_service.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+
+namespace libwebp {
+
+namespace {
+
+// Upper bound of the size of a message, to reject corrupted size prefixes.
+constexpr uint32_t kMaxMessageSize = 1u << 30;
+
+bool SendAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool ReceiveAll(int fd, uint8_t* data, size_t size) {
+  while (size > 0) {
+    const ssize_t read = recv(fd, data, size, 0);
+    if (read < 0 && errno == EINTR) continue;
+    if (read <= 0) return false;
+    data += read;
+    size -= read;
+  }
+  return true;
+}
+
+// Returns true if the peer of the socket 'fd' closed the connection. Pending
+// input (e.g. a pipelined request) means that the peer is still there.
+bool HasHungUp(int fd) {
+  char c;
+  const ssize_t read = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (read < 0) {
+    return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+  }
+  return read == 0;
+}
+
+int GetElapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+bool WriteDelimitedMessage(int fd,
+                           const google::protobuf::MessageLite& message) {
+  const std::string data = message.SerializeAsString();
+  if (data.size() > kMaxMessageSize) return false;
+  const uint32_t size = data.size();
+  const uint8_t size_bytes[4] = {uint8_t(size), uint8_t(size >> 8),
+                                 uint8_t(size >> 16), uint8_t(size >> 24)};
+  return SendAll(fd, size_bytes, sizeof(size_bytes)) &&
+         SendAll(fd, reinterpret_cast<const uint8_t*>(data.data()),
+                 data.size());
+}
+
+bool ReadDelimitedMessage(int fd,
+                          google::protobuf::MessageLite* const message) {
+  uint8_t size_bytes[4];
+  if (!ReceiveAll(fd, size_bytes, sizeof(size_bytes))) return false;
+  const uint32_t size = size_bytes[0] | (size_bytes[1] << 8) |
+                        (size_bytes[2] << 16) | (uint32_t(size_bytes[3]) << 24);
+  if (size > kMaxMessageSize) return false;
+  std::string data(size, '\0');
+  return ReceiveAll(fd, reinterpret_cast<uint8_t*>(&data[0]), size) &&
+         message->ParseFromString(data);
+}
+
+ThumbnailerService::ThumbnailerService(
+    const thumbnailer::ThumbnailerOption& default_option, int num_threads)
+    : default_option_(default_option),
+      num_threads_(std::max(1, num_threads)) {}
+
+bool ThumbnailerService::Serve(const std::string& socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) return false;
+  strcpy(address.sun_path, socket_path.c_str());
+
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) return false;
+  unlink(socket_path.c_str());
+  if (bind(listen_fd, reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    close(listen_fd);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) {
+      close(listen_fd);
+      unlink(socket_path.c_str());
+      return true;
+    }
+    listen_fd_ = listen_fd;
+  }
+
+  for (int i = 0; i < num_threads_; ++i) {
+    threads_.emplace_back(&ThumbnailerService::Work, this);
+  }
+  while (true) {
+    const int client_fd = accept(listen_fd, nullptr, nullptr);
+    if (client_fd < 0) {
+      if (errno == EINTR) continue;
+      break;  // Stop() shut the socket down.
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_fds_.push_back(client_fd);
+    }
+    pending_.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    listen_fd_ = -1;
+  }
+  pending_.notify_all();
+  for (std::thread& thread : threads_) thread.join();
+  threads_.clear();
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  return true;
+}
+
+void ThumbnailerService::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = true;
+  // Makes accept() fail in Serve().
+  if (listen_fd_ >= 0) shutdown(listen_fd_, SHUT_RDWR);
+}
+
+void ThumbnailerService::Work() {
+  while (true) {
+    int client_fd;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      pending_.wait(lock,
+                    [this]() { return stopping_ || !pending_fds_.empty(); });
+      if (pending_fds_.empty()) return;
+      client_fd = pending_fds_.front();
+      pending_fds_.pop_front();
+    }
+    HandleConnection(client_fd);
+    close(client_fd);
+  }
+}
+
+void ThumbnailerService::HandleConnection(int client_fd) {
+  thumbnailer::ThumbnailerRequest request;
+  thumbnailer::ThumbnailerResponse response;
+  while (ReadDelimitedMessage(client_fd, &request)) {
+    HandleRequest(request, &response, client_fd);
+    if (!WriteDelimitedMessage(client_fd, response)) break;
+  }
+}
+
+void ThumbnailerService::HandleRequest(
+    const thumbnailer::ThumbnailerRequest& request,
+    thumbnailer::ThumbnailerResponse* const response, int client_fd) {
+  const auto start = std::chrono::steady_clock::now();
+  response->Clear();
+
+  thumbnailer::ThumbnailerOption option = default_option_;
+  option.MergeFrom(request.option());
+  option.set_hard_max_size(
+      std::max(option.hard_max_size(), option.soft_max_size()));
+  Thumbnailer::Method method;
+  if (!Thumbnailer::ValidateOption(option) ||
+      !Thumbnailer::ParseMethod(request.algorithm(), &method)) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("Invalid thumbnailer configuration.");
+    return;
+  }
+  if (request.frame_size() == 0) {
+    response->set_status(Thumbnailer::kGenericError);
+    response->set_error("No input frame(s) for generating animation.");
+    return;
+  }
+
+  ReadPictureOption read_option;
+  read_option.target_width = option.target_width();
+  read_option.target_height = option.target_height();
+  Thumbnailer thumbnailer = Thumbnailer(option);
+  if (!AddFrames(request, read_option, &thumbnailer, response)) return;
+  response->set_decoding_ms(GetElapsedMs(start));
+
+  // Abandon the generation as soon as the client is gone.
+  thumbnailer.SetProgressCallback(
+      [&](const Thumbnailer::Progress& progress) {
+        response->set_num_probes(progress.num_probes);
+        if (client_fd != -1 && HasHungUp(client_fd)) thumbnailer.Cancel();
+      });
+  const auto generation_start = std::chrono::steady_clock::now();
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  const Thumbnailer::Status status = thumbnailer.GenerateAnimation(
+      &webp_data, method, response->mutable_stats());
+  response->set_generation_ms(GetElapsedMs(generation_start));
+  response->set_status(status);
+  if (status == Thumbnailer::kOk) {
+    response->set_webp(webp_data.bytes, webp_data.size);
+  } else {
+    response->set_error("Error generating thumbnail.");
+  }
+  WebPDataClear(&webp_data);
+}
+
+bool ThumbnailerService::AddFrames(
+    const thumbnailer::ThumbnailerRequest& request,
+    const ReadPictureOption& read_option, Thumbnailer* const thumbnailer,
+    thumbnailer::ThumbnailerResponse* const response) {
+  for (int i = 0; i < request.frame_size(); ++i) {
+    const thumbnailer::ThumbnailerRequest::Frame& frame = request.frame(i);
+    WebPPicture pic;
+    if (!WebPPictureInit(&pic)) assert(false);
+    const bool ok =
+        frame.has_data()
+            ? ReadPicture(
+                  reinterpret_cast<const uint8_t*>(frame.data().data()),
+                  frame.data().size(), &pic, read_option)
+            : ReadPicture(frame.path().c_str(), &pic, read_option);
+    if (!ok) {
+      WebPPictureFree(&pic);
+      response->set_status(Thumbnailer::kImageFormatError);
+      response->set_error("Failed to read frame #" + std::to_string(i));
+      return false;
+    }
+    // The thumbnailer takes ownership of the decoded samples.
+    const Thumbnailer::Status status =
+        thumbnailer->AddFrame(std::move(pic), frame.timestamp_ms());
+    if (status != Thumbnailer::kOk) {
+      WebPPictureFree(&pic);
+      response->set_status(status);
+      response->set_error("Error adding frame #" + std::to_string(i));
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace libwebp
@@ -0,0 +1,97 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THUMBNAILER_SERVICE_H_
+#define THUMBNAILER_SRC_THUMBNAILER_SERVICE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "src/thumbnailer.pb.h"
+#include "thumbnailer.h"
+#include "utils/thumbnailer_utils.h"
+
+namespace libwebp {
+
+// Writes 'message' to the socket 'fd', preceded by its size as a 4-byte
+// little-endian integer. Returns false on error.
+bool WriteDelimitedMessage(int fd,
+                           const google::protobuf::MessageLite& message);
+
+// Reads a message written by WriteDelimitedMessage() from the socket 'fd'.
+// Returns false on error or at the end of the stream.
+bool ReadDelimitedMessage(int fd,
+                          google::protobuf::MessageLite* const message);
+
+// Serves ThumbnailerRequest messages over a Unix domain socket, each
+// connection sending any number of requests and receiving one
+// ThumbnailerResponse per request. Connections are handled by a fixed pool of
+// threads, which are kept for the lifetime of the service.
+class ThumbnailerService {
+ public:
+  // Unset fields of the request options take their value from
+  // 'default_option'.
+  ThumbnailerService(const thumbnailer::ThumbnailerOption& default_option,
+                     int num_threads);
+
+  // Listens on 'socket_path' (replacing any existing socket file) and serves
+  // connections until Stop() is called, which may happen before. Returns false
+  // if the socket cannot be set up. Can only be called once.
+  bool Serve(const std::string& socket_path);
+
+  // Makes Serve() stop accepting connections. Serve() returns once the
+  // connections already accepted are closed by their clients. Can be called
+  // from any thread.
+  void Stop();
+
+  // Handles a single request. If 'client_fd' is not -1, the generation is
+  // cancelled when the client hangs up.
+  void HandleRequest(const thumbnailer::ThumbnailerRequest& request,
+                     thumbnailer::ThumbnailerResponse* const response,
+                     int client_fd = -1);
+
+ private:
+  // Serves the requests of 'client_fd' until it is closed.
+  void HandleConnection(int client_fd);
+
+  // Runs in each thread of the pool.
+  void Work();
+
+  // Decodes the frames of 'request' and adds them to 'thumbnailer'. Returns
+  // false and sets 'response' on error.
+  bool AddFrames(const thumbnailer::ThumbnailerRequest& request,
+                 const ReadPictureOption& read_option,
+                 Thumbnailer* const thumbnailer,
+                 thumbnailer::ThumbnailerResponse* const response);
+
+  const thumbnailer::ThumbnailerOption default_option_;
+  const int num_threads_;
+  std::vector<std::thread> threads_;
+
+  // Accepted connections, waiting for a thread.
+  std::deque<int> pending_fds_;
+  std::mutex mutex_;
+  std::condition_variable pending_;
+  bool stopping_ = false;
+  int listen_fd_ = -1;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THUMBNAILER_SERVICE_H_
@@ -42,6 +42,7 @@ Thumbnailer::Status Thumbnailer::GenerateAnimationSlopeOptim(
 }
 
 Thumbnailer::Status Thumbnailer::FindMedianSlope(float* const median_slope) {
+  PhaseTimer timer(this, "slope_median");
   std::vector<float> slopes;
 
   int curr_ind = 0;
@@ -109,6 +110,7 @@ Thumbnailer::Status Thumbnailer::ComputeSlope(int ind, int low_quality,
 
 Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
     WebPData* const webp_data) {
+  PhaseTimer timer(this, "slope_search");
   // Sort frames.
   std::sort(frames_.begin(), frames_.end(),
             [](const FrameData& a, const FrameData& b) -> bool {
@@ -184,6 +186,7 @@ Thumbnailer::Status Thumbnailer::LossyEncodeSlopeOptim(
 
 Thumbnailer::Status Thumbnailer::LossyEncodeNoSlopeOptim(
     WebPData* const webp_data) {
+  PhaseTimer timer(this, "lossy_refine");
   size_t anim_size = GetAnimationSize(webp_data);
 
   // If the 'anim_size' exceeds the 'byte_budget', keep the webp_data generated
@@ -0,0 +1,186 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <time.h>
+
+#include "thumbnailer.h"
+
+namespace libwebp {
+
+namespace {
+
+// Returns the CPU time of the calling thread in milliseconds.
+double GetThreadCPUTimeMs() {
+  timespec time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) return 0.;
+  return time.tv_sec * 1000. + time.tv_nsec / 1000000.;
+}
+
+}  // namespace
+
+Thumbnailer::PhaseTimer::PhaseTimer(Thumbnailer* const thumbnailer,
+                                    const char* const name)
+    : phase_(nullptr),
+#ifdef THUMBNAILER_ENABLE_TRACE
+      trace_event_(name, "PhaseTimer"),
+#endif
+      wall_start_(std::chrono::steady_clock::now()),
+      cpu_start_ms_(GetThreadCPUTimeMs()) {
+  // There are only a few phases.
+  for (thumbnailer::ThumbnailerStats::Phase& phase :
+       *thumbnailer->stats_.mutable_phase()) {
+    if (phase.name() == name) phase_ = &phase;
+  }
+  if (phase_ == nullptr) {
+    phase_ = thumbnailer->stats_.add_phase();
+    phase_->set_name(name);
+  }
+  phase_->set_count(phase_->count() + 1);
+}
+
+Thumbnailer::PhaseTimer::~PhaseTimer() {
+  const std::chrono::duration<double, std::milli> wall_time =
+      std::chrono::steady_clock::now() - wall_start_;
+  phase_->set_wall_ms(phase_->wall_ms() + wall_time.count());
+  phase_->set_cpu_ms(phase_->cpu_ms() + GetThreadCPUTimeMs() - cpu_start_ms_);
+}
+
+uint64_t Thumbnailer::GetPictureBytes(const WebPPicture& pic) {
+  const uint64_t num_pixels = uint64_t(pic.width) * pic.height;
+  if (pic.use_argb) return num_pixels * sizeof(uint32_t);
+  const uint64_t uv_size =
+      uint64_t((pic.width + 1) / 2) * ((pic.height + 1) / 2);
+  return num_pixels + 2 * uv_size + (pic.a != nullptr ? num_pixels : 0);
+}
+
+uint64_t Thumbnailer::GetEncodingBytes(const WebPPicture& pic) {
+  const uint64_t argb_bytes =
+      uint64_t(pic.width) * pic.height * sizeof(uint32_t);
+  return GetPictureBytes(pic) + (pic.use_argb ? 0 : argb_bytes);
+}
+
+uint64_t Thumbnailer::GetEncoderBytes() const {
+  if (frames_.empty()) return 0;
+  return kEncoderCanvases * uint64_t(frames_[0].pic.width) *
+         frames_[0].pic.height * sizeof(uint32_t);
+}
+
+Thumbnailer::Status Thumbnailer::StartStats() {
+  stats_.Clear();
+  // Snapshots of the frames share their pictures, which are counted once.
+  picture_bytes_ = 0;
+  for (const FrameData& frame : frames_) {
+    if (frame.stored != nullptr) {
+      // Spilled frames are only counted once decompressed.
+      picture_bytes_ += frame.stored->data.size();
+      stats_.set_stored_frame_bytes(stats_.stored_frame_bytes() +
+                                    frame.stored->data.size() +
+                                    frame.stored->spill_size);
+      continue;
+    }
+    picture_bytes_ += GetPictureBytes(frame.pic);
+    if (frame.argb_pic != nullptr) {
+      picture_bytes_ += GetPictureBytes(*frame.argb_pic);
+    }
+  }
+  for (const std::shared_ptr<StoredFrame>& stored : decoded_frames_) {
+    picture_bytes_ += GetPictureBytes(*stored->pic);
+    if (stored->argb_pic != nullptr) {
+      picture_bytes_ += GetPictureBytes(*stored->argb_pic);
+    }
+  }
+  // The assembly cache is kept across generations.
+  bitstream_bytes_ = 0;
+  for (const auto& cached : assembly_cache_) {
+    bitstream_bytes_ += cached.second.size();
+  }
+  cache_assemblies_ = true;
+  return ReserveMemory(0);
+}
+
+void Thumbnailer::FinishStats(size_t animation_size,
+                              thumbnailer::ThumbnailerStats* const stats) {
+  if (stats == nullptr) return;
+  for (const FrameData& frame : frames_) {
+    thumbnailer::ThumbnailerStats::Frame* const frame_stats =
+        stats_.add_frame();
+    frame_stats->set_timestamp_ms(frame.timestamp_ms);
+    frame_stats->set_lossless(frame.config.lossless);
+    if (frame.config.lossless) {
+      frame_stats->set_near_lossless(frame.config.near_lossless);
+    } else {
+      frame_stats->set_quality(frame.config.quality);
+    }
+    frame_stats->set_encoded_size(frame.encoded_size);
+    frame_stats->set_psnr(frame.final_psnr);
+  }
+  stats_.set_animation_size(animation_size);
+  stats->Swap(&stats_);
+}
+
+Thumbnailer::Status Thumbnailer::ReserveMemory(uint64_t extra_picture_bytes,
+                                               uint64_t extra_bytes) {
+  if (max_memory_bytes_ > 0 &&
+      picture_bytes_ + extra_picture_bytes + bitstream_bytes_ + extra_bytes >
+          max_memory_bytes_) {
+    DropCaches();
+  }
+  // Measured once the caches were dropped, which frees the pictures that can
+  // be rebuilt too.
+  const uint64_t pictures = picture_bytes_ + extra_picture_bytes;
+  const uint64_t total = pictures + bitstream_bytes_ + extra_bytes;
+  stats_.set_peak_picture_bytes(
+      std::max<uint64_t>(stats_.peak_picture_bytes(), pictures));
+  stats_.set_peak_bitstream_bytes(
+      std::max<uint64_t>(stats_.peak_bitstream_bytes(), bitstream_bytes_));
+  stats_.set_peak_memory_bytes(
+      std::max<uint64_t>(stats_.peak_memory_bytes(), total));
+  if (max_memory_bytes_ > 0 && total > max_memory_bytes_) {
+    if (verbose_) {
+      std::cerr << "Memory limit exceeded: " << total << " > "
+                << max_memory_bytes_ << " bytes." << std::endl;
+    }
+    return kMemoryError;
+  }
+  return kOk;
+}
+
+void Thumbnailer::DropCaches() {
+  assembly_cache_.clear();
+  bitstream_bytes_ = 0;
+  cache_assemblies_ = false;
+
+  EvictDecodedFrames(0);
+  for (const std::shared_ptr<StoredFrame>& stored : decoded_frames_) {
+    if (stored->argb_pic.get() != last_argb_pic_) {
+      ReleaseARGBPicture(&stored->argb_pic);
+    }
+  }
+  for (FrameData& frame : frames_) {
+    if (frame.argb_pic.get() != last_argb_pic_) {
+      ReleaseARGBPicture(&frame.argb_pic);
+    }
+  }
+  stats_.set_cache_drops(stats_.cache_drops() + 1);
+}
+
+void Thumbnailer::ReleaseARGBPicture(
+    std::shared_ptr<WebPPicture>* const argb_pic) {
+  // Shared pictures are still held (and counted) by the other copies.
+  if (*argb_pic == nullptr || argb_pic->use_count() > 1) return;
+  picture_bytes_ -= GetPictureBytes(**argb_pic);
+  argb_pic->reset();
+}
+
+}  // namespace libwebp
@@ -0,0 +1,114 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thumbnailer_trace.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace libwebp {
+
+namespace {
+
+struct RecordedEvent {
+  const char* name;
+  const char* function;
+  int64_t start_us;  // Relative to the start of the trace.
+  int64_t duration_us;
+  int thread_id;
+  std::string args;
+};
+
+std::atomic<bool> tracing(false);
+std::mutex trace_mutex;
+std::chrono::steady_clock::time_point trace_start;
+std::vector<RecordedEvent> trace_events;
+
+// Returns a small number identifying the calling thread.
+int GetThreadId() {
+  static std::atomic<int> num_threads(0);
+  thread_local const int thread_id = ++num_threads;
+  return thread_id;
+}
+
+}  // namespace
+
+void StartTracing() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events.clear();
+  trace_start = std::chrono::steady_clock::now();
+  tracing = true;
+}
+
+bool StopTracing(const std::string& path) {
+  std::vector<RecordedEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    tracing = false;
+    events.swap(trace_events);
+  }
+
+  std::ostringstream json;
+  json << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (std::size_t i = 0; i < events.size(); ++i) {
+    const RecordedEvent& event = events[i];
+    json << (i > 0 ? ",\n" : "\n") << "{\"name\":\"" << event.name
+         << "\",\"cat\":\"thumbnailer\",\"ph\":\"X\",\"ts\":"
+         << event.start_us << ",\"dur\":" << event.duration_us
+         << ",\"pid\":1,\"tid\":" << event.thread_id
+         << ",\"args\":{\"function\":\"" << event.function << "\""
+         << event.args << "}}";
+  }
+  json << "\n]}\n";
+
+  std::ofstream output(path);
+  output << json.str();
+  return bool(output);
+}
+
+TraceEvent::TraceEvent(const char* const name, const char* const function)
+    : name_(name), function_(function), enabled_(tracing) {
+  if (enabled_) start_ = std::chrono::steady_clock::now();
+}
+
+TraceEvent::~TraceEvent() {
+  if (!enabled_) return;
+  const auto end = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  if (!tracing) return;
+  const auto to_us = [](std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+        .count();
+  };
+  trace_events.push_back({name_, function_, to_us(start_ - trace_start),
+                          to_us(end - start_), GetThreadId(),
+                          std::move(args_)});
+}
+
+void TraceEvent::AddArg(const char* const key, double value) {
+  if (!enabled_) return;
+  std::ostringstream arg;
+  arg << ",\"" << key << "\":" << value;
+  args_ += arg.str();
+}
+
+void TraceEvent::AddArg(const char* const key, bool value) {
+  if (!enabled_) return;
+  args_ += std::string(",\"") + key + "\":" + (value ? "true" : "false");
+}
+
+}  // namespace libwebp
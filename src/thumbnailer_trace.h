@@ -0,0 +1,67 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_SRC_THUMBNAILER_TRACE_H_
+#define THUMBNAILER_SRC_THUMBNAILER_TRACE_H_
+
+#include <chrono>
+#include <string>
+
+// Trace events are only compiled in if THUMBNAILER_ENABLE_TRACE is defined
+// (e.g. with 'bazel build --define thumbnailer_trace=1'). Otherwise the
+// macros below expand to nothing and their arguments are not evaluated.
+#ifdef THUMBNAILER_ENABLE_TRACE
+// Declares a trace event 'var' named 'name', covering the rest of the scope.
+#define THUMBNAILER_TRACE_EVENT(var, name) \
+  ::libwebp::TraceEvent var(name, __func__)
+// Attaches 'key': 'value' (a number or a boolean) to the trace event 'var'.
+#define THUMBNAILER_TRACE_ARG(var, key, value) var.AddArg(key, value)
+#else
+#define THUMBNAILER_TRACE_EVENT(var, name)
+#define THUMBNAILER_TRACE_ARG(var, key, value)
+#endif
+
+namespace libwebp {
+
+// Starts recording the trace events of all threads, discarding any previous
+// ones. Recording costs a clock read and a short lock per event.
+void StartTracing();
+
+// Stops recording and writes the events to 'path' in the Chrome trace-event
+// JSON format, which Perfetto and chrome://tracing can open. Returns false on
+// error.
+bool StopTracing(const std::string& path);
+
+// Trace event lasting from its construction to its destruction. Does nothing
+// if tracing was not started.
+class TraceEvent {
+ public:
+  // 'name' and 'function' must be string literals.
+  TraceEvent(const char* const name, const char* const function);
+  ~TraceEvent();
+
+  void AddArg(const char* const key, double value);
+  void AddArg(const char* const key, bool value);
+
+ private:
+  const char* const name_;
+  const char* const function_;
+  const bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+  std::string args_;  // Comma-separated JSON members.
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_SRC_THUMBNAILER_TRACE_H_
@@ -24,9 +24,12 @@ int main(int argc, char* argv[]) {
   }
   libwebp::UtilsOption option;
   std::string list_filename;
+  std::string frame_cache;
   for (int c = 1; c < argc; ++c) {
     if (!strcmp(argv[c], "-short")) {
       option.short_output = true;
+    } else if (!strcmp(argv[c], "-frame_cache") && c + 1 < argc) {
+      frame_cache = argv[++c];
     } else {
       list_filename = argv[c];
     }
@@ -41,9 +44,9 @@ int main(int argc, char* argv[]) {
     frames.push_back(
         {EnclosedWebPPicture(new WebPPicture, libwebp::WebPPictureDelete),
          timestamp});
-    WebPPicture* pic = frames.back().pic.get();
-    WebPPictureInit(pic);
-    if (!libwebp::ReadPicture(frame_filename.c_str(), pic)) {
+    WebPPictureInit(frames.back().pic.get());
+    if (!libwebp::ReadCachedPicture(frame_filename.c_str(), frame_cache,
+                                    &frames.back().pic)) {
       std::cerr << "Failed to read image " << frame_filename << std::endl;
       return 1;
     }
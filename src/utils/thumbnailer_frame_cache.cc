@@ -0,0 +1,255 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <string>
+
+#include "thumbnailer_utils.h"
+
+namespace libwebp {
+
+namespace {
+
+// A raw frame file is a header followed by the planes of the picture, each
+// starting at a multiple of kPlaneAlignment bytes. The samples are stored in
+// native byte order, without padding between rows.
+constexpr size_t kPlaneAlignment = 64;
+constexpr char kMagic[8] = {'W', 'E', 'B', 'P', 'R', 'A', 'W', '1'};
+
+struct RawFrameHeader {
+  char magic[8];
+  uint64_t key;
+  int32_t width;
+  int32_t height;
+  int32_t use_argb;
+  int32_t has_alpha;
+};
+static_assert(sizeof(RawFrameHeader) <= kPlaneAlignment,
+              "The first plane must follow the header.");
+
+size_t Align(size_t size) {
+  return (size + kPlaneAlignment - 1) / kPlaneAlignment * kPlaneAlignment;
+}
+
+// Offsets (in bytes, from the start of the file) of the planes of a raw frame
+// with the properties of 'header', and the total file size.
+struct RawFrameLayout {
+  size_t argb = 0;
+  size_t y = 0, u = 0, v = 0, a = 0;
+  size_t file_size = 0;
+
+  explicit RawFrameLayout(const RawFrameHeader& header) {
+    const size_t num_pixels = size_t(header.width) * header.height;
+    size_t offset = kPlaneAlignment;
+    if (header.use_argb) {
+      argb = offset;
+      offset = Align(offset + num_pixels * sizeof(uint32_t));
+    } else {
+      const size_t uv_size =
+          size_t((header.width + 1) / 2) * ((header.height + 1) / 2);
+      y = offset;
+      u = offset = Align(offset + num_pixels);
+      v = offset = Align(offset + uv_size);
+      offset = Align(offset + uv_size);
+      if (header.has_alpha) {
+        a = offset;
+        offset = Align(offset + num_pixels);
+      }
+    }
+    file_size = offset;
+  }
+};
+
+RawFrameHeader GetHeader(const WebPPicture& pic, uint64_t key) {
+  RawFrameHeader header = {};
+  std::copy(kMagic, kMagic + sizeof(kMagic), header.magic);
+  header.key = key;
+  header.width = pic.width;
+  header.height = pic.height;
+  header.use_argb = pic.use_argb;
+  header.has_alpha = !pic.use_argb && pic.a != nullptr;
+  return header;
+}
+
+// FNV-1a hash of 'size' bytes at 'data', chained from 'hash'.
+uint64_t Hash(const void* const data, size_t size, uint64_t hash) {
+  const uint8_t* const bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Returns the key of the raw frame of 'filename' decoded with 'option', which
+// changes whenever the file is modified. Returns false if 'filename' cannot be
+// accessed.
+bool GetKey(const char* const filename, const ReadPictureOption& option,
+            uint64_t* const key) {
+  struct stat st;
+  if (stat(filename, &st) != 0) return false;
+  char* const real_path = realpath(filename, nullptr);
+  const std::string path = (real_path != nullptr) ? real_path : filename;
+  free(real_path);
+  const int64_t fields[] = {int64_t(st.st_size), int64_t(st.st_mtim.tv_sec),
+                            int64_t(st.st_mtim.tv_nsec), option.target_width,
+                            option.target_height, option.allow_yuv};
+  *key = Hash(path.data(), path.size(), 0xcbf29ce484222325ull);
+  *key = Hash(fields, sizeof(fields), *key);
+  return true;
+}
+
+std::string GetCachePath(const std::string& cache_directory, uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 ".raw", key);
+  return cache_directory + name;
+}
+
+// Wraps the raw frame at 'path' into '*pic' if it exists and matches 'key'.
+bool MapRawFrame(const std::string& path, uint64_t key,
+                 EnclosedWebPPicture* const pic) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  RawFrameHeader header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+      !std::equal(kMagic, kMagic + sizeof(kMagic), header.magic) ||
+      header.key != key || header.width <= 0 || header.height <= 0 ||
+      fstat(fd, &st) != 0 ||
+      size_t(st.st_size) != RawFrameLayout(header).file_size) {
+    close(fd);
+    return false;
+  }
+  // Private writable pages: stray writes never reach the file.
+  const RawFrameLayout layout(header);
+  void* const mapping = mmap(nullptr, layout.file_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  uint8_t* const base = static_cast<uint8_t*>(mapping);
+
+  EnclosedWebPPicture mapped(new WebPPicture, UnmapPicture);
+  WebPPictureInit(mapped.get());
+  mapped->width = header.width;
+  mapped->height = header.height;
+  mapped->use_argb = header.use_argb;
+  if (header.use_argb) {
+    mapped->argb = reinterpret_cast<uint32_t*>(base + layout.argb);
+    mapped->argb_stride = header.width;
+  } else {
+    mapped->colorspace = header.has_alpha ? WEBP_YUV420A : WEBP_YUV420;
+    mapped->y = base + layout.y;
+    mapped->u = base + layout.u;
+    mapped->v = base + layout.v;
+    mapped->y_stride = header.width;
+    mapped->uv_stride = (header.width + 1) / 2;
+    if (header.has_alpha) {
+      mapped->a = base + layout.a;
+      mapped->a_stride = header.width;
+    }
+  }
+  *pic = std::move(mapped);
+  return true;
+}
+
+bool WriteRows(FILE* const file, size_t offset, const uint8_t* samples,
+               size_t row_size, int num_rows, int stride) {
+  if (fseek(file, offset, SEEK_SET) != 0) return false;
+  for (int y = 0; y < num_rows; ++y, samples += stride) {
+    if (fwrite(samples, row_size, 1, file) != 1) return false;
+  }
+  return true;
+}
+
+// Writes 'pic' as the raw frame at 'path'. The file is renamed into place once
+// complete, so that concurrent runs never map a partial file.
+bool WriteRawFrame(const WebPPicture& pic, uint64_t key,
+                   const std::string& path) {
+  const RawFrameHeader header = GetHeader(pic, key);
+  const RawFrameLayout layout(header);
+  std::string tmp_path = path + ".XXXXXX";
+  const int fd = mkstemp(&tmp_path[0]);
+  if (fd == -1) return false;
+  fchmod(fd, 0644);  // The cache may be shared by several users.
+  FILE* const file = fdopen(fd, "wb");
+  if (file == nullptr) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  const int uv_width = (pic.width + 1) / 2;
+  const int uv_height = (pic.height + 1) / 2;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  if (pic.use_argb) {
+    ok = ok && WriteRows(file, layout.argb,
+                         reinterpret_cast<const uint8_t*>(pic.argb),
+                         pic.width * sizeof(uint32_t), pic.height,
+                         pic.argb_stride * sizeof(uint32_t));
+  } else {
+    ok = ok &&
+         WriteRows(file, layout.y, pic.y, pic.width, pic.height,
+                   pic.y_stride) &&
+         WriteRows(file, layout.u, pic.u, uv_width, uv_height,
+                   pic.uv_stride) &&
+         WriteRows(file, layout.v, pic.v, uv_width, uv_height,
+                   pic.uv_stride) &&
+         (!header.has_alpha ||
+          WriteRows(file, layout.a, pic.a, pic.width, pic.height,
+                    pic.a_stride));
+  }
+  // Pads the last plane up to the size expected by MapRawFrame().
+  ok = ok && fflush(file) == 0 && ftruncate(fd, layout.file_size) == 0;
+  ok = (fclose(file) == 0) && ok;
+  ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+  if (!ok) unlink(tmp_path.c_str());
+  return ok;
+}
+
+}  // namespace
+
+bool ReadCachedPicture(const char* const filename,
+                       const std::string& cache_directory,
+                       EnclosedWebPPicture* const pic,
+                       const ReadPictureOption& option) {
+  uint64_t key;
+  if (cache_directory.empty() || !GetKey(filename, option, &key)) {
+    return ReadPicture(filename, pic->get(), option);
+  }
+  const std::string path = GetCachePath(cache_directory, key);
+  if (MapRawFrame(path, key, pic)) return true;
+  if (!ReadPicture(filename, pic->get(), option)) return false;
+  // The picture is valid even if it cannot be cached.
+  if (!WriteRawFrame(**pic, key, path)) {
+    std::cerr << "Failed to write raw frame " << path << std::endl;
+  }
+  return true;
+}
+
+void UnmapPicture(WebPPicture* picture) {
+  const uint8_t* const first_plane =
+      picture->use_argb ? reinterpret_cast<const uint8_t*>(picture->argb)
+                        : picture->y;
+  if (first_plane != nullptr) {
+    const RawFrameHeader header = GetHeader(*picture, 0);
+    munmap(const_cast<uint8_t*>(first_plane) - kPlaneAlignment,
+           RawFrameLayout(header).file_size);
+  }
+  delete picture;
+}
+
+}  // namespace libwebp
@@ -17,17 +17,48 @@
 namespace libwebp {
 
 // Returns true on success and false on failure.
-bool ReadPicture(const char filename[], WebPPicture* const pic) {
+bool ReadPicture(const char filename[], WebPPicture* const pic,
+                 const ReadPictureOption& option) {
+  // The decoders read straight from the file mapping, which avoids copying
+  // the whole file into a transient buffer first.
   const uint8_t* data = NULL;
   size_t data_size = 0;
-  if (!ImgIoUtilReadFile(filename, &data, &data_size)) return false;
+  int is_mapped = 0;
+  if (!ImgIoUtilMapFile(filename, &data, &data_size, &is_mapped)) return false;
+  const bool ok = ReadPicture(data, data_size, pic, option);
+  ImgIoUtilUnmapFile(data, data_size, is_mapped);
+  return ok;
+}
 
+bool ReadPicture(const uint8_t* const data, size_t data_size,
+                 WebPPicture* const pic, const ReadPictureOption& option) {
   pic->use_argb = 1;  // force ARGB.
 
+  if (WebPGuessImageType(data, data_size) == WEBP_JPEG_FORMAT) {
+    pic->use_argb = !option.allow_yuv;
+    // Let libjpeg skip most of the work using DCT-domain scaling. The target
+    // dimensions come from the original ones, not from the DCT-scaled output.
+    int width, height;
+    return ReadJPEGScaled(data, data_size, pic, 1, NULL, option.target_width,
+                          option.target_height, &width, &height) &&
+           FitPicture(pic, width, height);
+  }
   WebPImageReader reader = WebPGuessImageReader(data, data_size);
-  bool ok = reader(data, data_size, pic, 1, NULL);
-  free((void*)data);
-  return ok;
+  return reader(data, data_size, pic, 1, NULL) && FitPicture(pic, option);
+}
+
+bool FitPicture(WebPPicture* const pic, const ReadPictureOption& option) {
+  int width, height;
+  ImgIoUtilFitDimensions(pic->width, pic->height, option.target_width,
+                         option.target_height, &width, &height);
+  return FitPicture(pic, width, height);
+}
+
+bool FitPicture(WebPPicture* const pic, int width, int height) {
+  // Resample to the exact target dimensions. WebPPictureRescale() averages
+  // the source pixels covered by each destination pixel when downscaling.
+  if (width == pic->width && height == pic->height) return true;
+  return WebPPictureRescale(pic, width, height);
 }
 
 void WebPPictureDelete(WebPPicture* picture) {
@@ -84,37 +115,71 @@ UtilsStatus AnimData2PSNR(const std::vector<Frame>& original_frames,
                           ThumbnailStatsPSNR* const stats) {
   if (stats == nullptr) return kMemoryError;
 
-  std::vector<Frame> new_frames;
-  CHECK_UTILS_STATUS(AnimData2Frames(webp_data, &new_frames));
+  // Decode the frames one at a time instead of calling AnimData2Frames, so
+  // that only the decoder's canvas is kept in memory.
+  WebPAnimDecoderOptions dec_options;
+  if (!WebPAnimDecoderOptionsInit(&dec_options)) return kGenericError;
+  // Decode straight into the in-memory layout of WebPPicture::argb, so that
+  // the canvas can be compared without being imported.
+#ifdef WORDS_BIGENDIAN
+  dec_options.color_mode = MODE_ARGB;
+#else
+  dec_options.color_mode = MODE_BGRA;
+#endif
+  std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
+      WebPAnimDecoderNew(webp_data, &dec_options), WebPAnimDecoderDelete);
+  if (dec == NULL) {
+    std::cerr << "Error parsing image." << std::endl;
+    return kMemoryError;
+  }
+
+  WebPAnimInfo anim_info;
+  if (!WebPAnimDecoderGetInfo(dec.get(), &anim_info)) {
+    std::cerr << "Error getting global info about the animation." << std::endl;
+    return kGenericError;
+  }
 
-  // We assume that new_frames.size() <= original_frames.size(). For some cases,
-  // consecutive frames of original_frames having the exact same WebPPicture are
-  // merged into one in new_frames. Otherwise, no frames are merged; new_frames
-  // and original_frames are equal in size.
+  // We assume that the number of decoded frames is at most
+  // original_frames.size(). For some cases, consecutive frames of
+  // original_frames having the exact same WebPPicture are merged into one in
+  // the animation. Otherwise, no frames are merged; both are equal in size.
   //
-  // It is unlikely to have new_frames.size() > original_frames.size() for
+  // It is unlikely to have more decoded frames than original frames for
   // thumbnails, as discussed:
   // https://github.com/googleinterns/step255-2020/pull/25#discussion_r476508818
-  if (new_frames.size() > original_frames.size()) {
+  if (anim_info.frame_count > original_frames.size()) {
     return kGenericError;
   }
 
-  std::size_t new_frame_index = 0;
+  // View over the decoder's canvas. The canvas is owned by 'dec' and is
+  // overwritten by each WebPAnimDecoderGetNext() call.
+  WebPPicture new_pic;
+  if (!WebPPictureInit(&new_pic)) return kMemoryError;
+  new_pic.use_argb = 1;
+  new_pic.width = anim_info.canvas_width;
+  new_pic.height = anim_info.canvas_height;
+  new_pic.argb_stride = anim_info.canvas_width;
+  int new_timestamp = -1;
+
   for (const Frame& original_frame : original_frames) {
-    // Check if the next frame of new_frames matches original_frame,
-    // based on their timestamps.
-    while (new_frame_index + 1 < new_frames.size() &&
-           new_frames[new_frame_index].timestamp < original_frame.timestamp) {
-      ++new_frame_index;
+    // Check if the next decoded frame matches original_frame, based on their
+    // timestamps.
+    while (new_timestamp < original_frame.timestamp &&
+           WebPAnimDecoderHasMoreFrames(dec.get())) {
+      uint8_t* frame_rgba;
+      if (!WebPAnimDecoderGetNext(dec.get(), &frame_rgba, &new_timestamp)) {
+        std::cerr << "Error decoding frame." << std::endl;
+        return kMemoryError;
+      }
+      new_pic.argb = reinterpret_cast<uint32_t*>(frame_rgba);
     }
-    const Frame& new_frame = new_frames[new_frame_index];
-    if (new_frame.timestamp < original_frame.timestamp) {
+    if (new_timestamp < original_frame.timestamp) {
       std::cerr << "Timestamp mismatched." << std::endl;
       return kGenericError;
     }
 
     float distortion_results[5];
-    if (!WebPPictureDistortion(original_frame.pic.get(), new_frame.pic.get(), 0,
+    if (!WebPPictureDistortion(original_frame.pic.get(), &new_pic, 0,
                                distortion_results)) {
       return kGenericError;
     } else {
@@ -25,6 +25,7 @@
 #include <iostream>
 #include <memory>
 #include <numeric>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -55,6 +56,17 @@ struct UtilsOption {
   bool short_output = false;
 };
 
+struct ReadPictureOption {
+  // If non-zero, pictures larger than 'target_width' x 'target_height' are
+  // downscaled to fit in these dimensions, preserving their aspect ratio. A
+  // zero dimension is unconstrained.
+  int target_width = 0;
+  int target_height = 0;
+  // If true, JPEG pictures are decoded to YUV420 instead of ARGB. The samples
+  // of 4:2:0 JPEGs are then kept as is, without any colorspace conversion.
+  bool allow_yuv = false;
+};
+
 struct Frame {
   EnclosedWebPPicture pic;
   int timestamp;  // Ending timestamp in milliseconds.
@@ -77,17 +89,46 @@ struct ThumbnailDiffPSNR {
 };
 
 // Reads file into WebPPicture. Returns true on success and false on failure.
-bool ReadPicture(const char* const filename, WebPPicture* const pic);
+// JPEG files are decoded directly at a reduced scale when 'option' asks for a
+// smaller picture; other formats are downscaled right after decoding.
+bool ReadPicture(const char* const filename, WebPPicture* const pic,
+                 const ReadPictureOption& option = ReadPictureOption());
+
+// Same as above for an encoded image in memory.
+bool ReadPicture(const uint8_t* const data, size_t data_size,
+                 WebPPicture* const pic,
+                 const ReadPictureOption& option = ReadPictureOption());
+
+// Downscales 'pic' to the target dimensions of 'option', if needed.
+bool FitPicture(WebPPicture* const pic, const ReadPictureOption& option);
+
+// Rescales 'pic' to exactly 'width' x 'height', if needed.
+bool FitPicture(WebPPicture* const pic, int width, int height);
 
 void WebPPictureDelete(WebPPicture* picture);
 
+// Same as ReadPicture() into the initialized '*pic', through a cache of raw
+// frames in 'cache_directory' (disabled if empty). Raw frames are keyed by the
+// path, size and modification time of 'filename' and by 'option'. On a hit,
+// '*pic' is replaced by a picture wrapping the memory-mapped samples of the
+// raw frame, with UnmapPicture() as deleter, instead of decoding 'filename'.
+// On a miss, the decoded picture is written to the cache for later runs.
+bool ReadCachedPicture(const char* const filename,
+                       const std::string& cache_directory,
+                       EnclosedWebPPicture* const pic,
+                       const ReadPictureOption& option = ReadPictureOption());
+
+// Releases a picture wrapping a memory-mapped raw frame.
+void UnmapPicture(WebPPicture* picture);
+
 void WebPDataDelete(WebPData* webp_data);
 
 // Converts WebPData (animation) into Frame(s).
 UtilsStatus AnimData2Frames(WebPData* const webp_data,
                             std::vector<Frame>* const pics);
 
-// Takes WebPData having original_frames as source, calls AnimData2Frames.
+// Takes WebPData having original_frames as source and decodes it frame by
+// frame, so that at most one decoded frame is held in memory at a time.
 // Records PSNR values for every WebPPicture and various PSNR stats.
 UtilsStatus AnimData2PSNR(const std::vector<Frame>& original_frames,
                           WebPData* const webp_data,
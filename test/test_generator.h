@@ -0,0 +1,469 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_TEST_TEST_GENERATOR_H_
+#define THUMBNAILER_TEST_TEST_GENERATOR_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "../src/utils/thumbnailer_utils.h"
+
+const int kDefaultWidth = 160;
+const int kDefaultHeight = 90;
+
+// Generates deterministic pictures for the tests and the benchmarks.
+class WebPTestGenerator {
+ public:
+  enum Content {
+    kSolid = 0,  // A random solid color per frame.
+    kNoise,      // Random noise, which never compresses.
+    kGradient,   // Smooth gradients whose colors drift over time.
+    kSprites,    // Sprites moving over a static background. The sprites hold
+                 // still every third frame, which duplicates the previous one.
+    kText,       // Lines of text scrolling up.
+    kPan,        // Camera panning over a textured scene.
+    kTexture,    // Static photographic-like texture with film grain.
+    kNumContents
+  };
+
+  // Initializing.
+  WebPTestGenerator()
+      : pic_count_(10),
+        width_(kDefaultWidth),
+        height_(kDefaultHeight),
+        transparency_(0xff),
+        content_(kNoise) {}
+
+  WebPTestGenerator(int pic_count, uint8_t transparency, bool randomized)
+      : pic_count_(pic_count),
+        width_(kDefaultWidth),
+        height_(kDefaultHeight),
+        transparency_(transparency),
+        content_(randomized ? kNoise : kSolid) {}
+
+  WebPTestGenerator(int pic_count, int width, int height, uint8_t transparency,
+                    bool randomized)
+      : pic_count_(pic_count),
+        width_(width),
+        height_(height),
+        transparency_(transparency),
+        content_(randomized ? kNoise : kSolid) {}
+
+  WebPTestGenerator(int pic_count, int width, int height, uint8_t transparency,
+                    Content content)
+      : pic_count_(pic_count),
+        width_(width),
+        height_(height),
+        transparency_(transparency),
+        content_(content) {}
+
+  // Returns vector of WebPPicture(s) showing 'content_'.
+  std::vector<EnclosedWebPPicture> GeneratePics() {
+    std::vector<EnclosedWebPPicture> pics;
+    for (int i = 0; i < pic_count_; ++i) {
+      pics.emplace_back(new WebPPicture, libwebp::WebPPictureDelete);
+      EnclosedWebPPicture& pic = pics.back();
+      WebPPictureInit(pic.get());
+      pic->use_argb = 1;
+      pic->width = width_;
+      pic->height = height_;
+      WebPPictureImportRGBA(pic.get(), GenerateRGBA(i).data(), width_ * 4);
+    }
+    return pics;
+  }
+
+ private:
+  int pic_count_;
+  int width_;
+  int height_;
+  uint8_t transparency_;
+  Content content_;
+
+  // Returns RGBA values for WebPPicture.
+  std::vector<uint8_t> GenerateRGBA(int seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> rgba;
+    rgba.reserve(width_ * height_ * 4);
+
+    const uint8_t color_R = rng() & 0xff;
+    const uint8_t color_G = rng() & 0xff;
+    const uint8_t color_B = rng() & 0xff;
+
+    for (int i = 0; i < height_; ++i) {
+      for (int j = 0; j < width_; ++j) {
+        if (content_ == kSolid || content_ == kNoise) {
+          const bool randomized = (content_ == kNoise);
+          rgba.push_back(randomized ? rng() & 0xff : color_R);
+          rgba.push_back(randomized ? rng() & 0xff : color_G);
+          rgba.push_back(randomized ? rng() & 0xff : color_B);
+        } else {
+          const uint32_t rgb = GetColor(/*frame=*/seed, j, i);
+          rgba.push_back(rgb >> 16);
+          rgba.push_back(rgb >> 8);
+          rgba.push_back(rgb);
+        }
+        rgba.push_back(transparency_);
+      }
+    }
+    return rgba;
+  }
+
+  // Returns the 0xRRGGBB color of the pixel ('x', 'y') of the 'frame'-th
+  // picture of one of the synthetic contents.
+  uint32_t GetColor(int frame, int x, int y) const {
+    switch (content_) {
+      case kGradient: {
+        const float phase = frame * 0.1f;
+        return GetRGB(255.f * x / std::max(1, width_ - 1),
+                      255.f * y / std::max(1, height_ - 1),
+                      127.5f + 127.5f * std::sin(phase + 0.02f * (x + y)));
+      }
+      case kSprites: {
+        // The sprites do not move every third frame.
+        const int t = frame - frame / 3;
+        const int size = std::max(4, std::min(width_, height_) / 5);
+        const int speed = std::max(1, std::min(width_, height_) / 45);
+        for (int i = 0; i < 3; ++i) {
+          const int range_x = width_ - size, range_y = height_ - size;
+          const int sprite_x =
+              Bounce((2 * i + 1) * range_x / 3 + (3 + i) * speed * t, range_x);
+          const int sprite_y =
+              Bounce((i + 1) * range_y / 2 + (2 + 2 * i) * speed * t, range_y);
+          const int dx = 2 * (x - sprite_x) - size;
+          const int dy = 2 * (y - sprite_y) - size;
+          if (dx * dx + dy * dy <= size * size) {
+            return Hash(i, 0, 7) & 0xffffff;
+          }
+        }
+        return GetTextureColor(x, y, /*seed=*/1, /*contrast=*/0.5f);
+      }
+      case kText: {
+        // 5x7 glyphs in 6x10 cells, scrolling up by 2 pixels per frame.
+        const int scrolled_y = y + 2 * frame;
+        const int line = scrolled_y / 10;
+        const int column = x / 6;
+        const int glyph_x = x % 6;
+        const int glyph_y = scrolled_y % 10 - 1;
+        const uint32_t glyph = Hash(column, line, 3) % 48;  // Glyph or space.
+        if (glyph >= 40 || glyph_x >= 5 || glyph_y < 0 || glyph_y >= 7) {
+          return 0xf4f0e8;
+        }
+        return (Hash(glyph, glyph_y * 5 + glyph_x, 5) & 1) ? 0x202428
+                                                            : 0xf4f0e8;
+      }
+      case kPan:
+        return GetTextureColor(x + 4 * frame, y + frame, /*seed=*/2,
+                               /*contrast=*/1.f);
+      case kTexture:
+      default: {
+        const uint32_t rgb = GetTextureColor(x, y, /*seed=*/4, 1.f);
+        const int grain = int(Hash(x, y, frame + 100) % 9) - 4;
+        return GetRGB(((rgb >> 16) & 0xff) + grain, ((rgb >> 8) & 0xff) + grain,
+                      (rgb & 0xff) + grain);
+      }
+    }
+  }
+
+  static uint32_t GetRGB(float r, float g, float b) {
+    const auto clip = [](float v) {
+      return uint32_t(std::max(0.f, std::min(255.f, v + 0.5f)));
+    };
+    return (clip(r) << 16) | (clip(g) << 8) | clip(b);
+  }
+
+  // Returns the position at 'step' of a point bouncing in [0, 'range'].
+  static int Bounce(int step, int range) {
+    if (range <= 0) return 0;
+    step %= 2 * range;
+    return (step <= range) ? step : 2 * range - step;
+  }
+
+  static uint32_t Hash(int x, int y, int seed) {
+    uint32_t h = uint32_t(x) * 374761393u + uint32_t(y) * 668265263u +
+                 uint32_t(seed) * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+  }
+
+  // Returns smoothly interpolated random values in [0, 1] with features of
+  // about 'scale' pixels.
+  static float GetValueNoise(int x, int y, int scale, int seed) {
+    const int cell_x = x / scale, cell_y = y / scale;
+    float tx = float(x % scale) / scale, ty = float(y % scale) / scale;
+    tx = tx * tx * (3.f - 2.f * tx);
+    ty = ty * ty * (3.f - 2.f * ty);
+    const auto value = [&](int dx, int dy) {
+      return (Hash(cell_x + dx, cell_y + dy, seed) & 0xffff) / 65535.f;
+    };
+    const float top = value(0, 0) + (value(1, 0) - value(0, 0)) * tx;
+    const float bottom = value(0, 1) + (value(1, 1) - value(0, 1)) * tx;
+    return top + (bottom - top) * ty;
+  }
+
+  // Returns a natural-looking texture made of several octaves of noise.
+  static uint32_t GetTextureColor(int x, int y, int seed, float contrast) {
+    float luma = 0.f, amplitude = 0.5f, sum = 0.f;
+    for (const int scale : {64, 16, 4}) {
+      luma += amplitude * GetValueNoise(x, y, scale, seed + scale);
+      sum += amplitude;
+      amplitude *= 0.5f;
+    }
+    luma = 128.f + contrast * 255.f * (luma / sum - 0.5f);
+    const float tint = GetValueNoise(x, y, 128, seed) - 0.5f;
+    return GetRGB(luma * (1.f + 0.4f * tint), luma,
+                  luma * (1.f - 0.4f * tint));
+  }
+};
+
+// Returns the ARGB picture 'pic' encoded as a 4:2:0 JPEG, without its alpha.
+inline std::string EncodeJPEG(const WebPPicture& pic, int quality) {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  unsigned char* data = nullptr;
+  unsigned long data_size = 0;
+  jpeg_mem_dest(&cinfo, &data, &data_size);
+  cinfo.image_width = pic.width;
+  cinfo.image_height = pic.height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);  // Which subsamples the chroma to 4:2:0.
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  std::vector<JSAMPLE> row(pic.width * 3);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    const uint32_t* const argb =
+        pic.argb + cinfo.next_scanline * pic.argb_stride;
+    for (int x = 0; x < pic.width; ++x) {
+      row[3 * x + 0] = (argb[x] >> 16) & 0xff;
+      row[3 * x + 1] = (argb[x] >> 8) & 0xff;
+      row[3 * x + 2] = argb[x] & 0xff;
+    }
+    JSAMPROW row_pointer = row.data();
+    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  const std::string jpeg(reinterpret_cast<const char*>(data), data_size);
+  free(data);
+  return jpeg;
+}
+
+// Returns the ARGB picture 'pic' encoded as an 8-bit PNG of 'color_type'
+// (PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA or PNG_COLOR_TYPE_PALETTE),
+// or an empty string on error. Paletted pictures must have at most 256 opaque
+// colors.
+inline std::string EncodePNG(const WebPPicture& pic, int color_type) {
+  const int num_channels = (color_type == PNG_COLOR_TYPE_RGB_ALPHA) ? 4
+                           : (color_type == PNG_COLOR_TYPE_RGB)     ? 3
+                                                                    : 1;
+  std::vector<uint32_t> palette;
+  std::vector<std::vector<png_byte>> rows(pic.height);
+  for (int y = 0; y < pic.height; ++y) {
+    for (int x = 0; x < pic.width; ++x) {
+      const uint32_t argb = pic.argb[y * pic.argb_stride + x];
+      if (num_channels == 1) {
+        auto it = std::find(palette.begin(), palette.end(), argb);
+        if (it == palette.end()) {
+          if (palette.size() == 256) return "";
+          it = palette.insert(it, argb);
+        }
+        rows[y].push_back(png_byte(it - palette.begin()));
+        continue;
+      }
+      rows[y].insert(rows[y].end(), {png_byte(argb >> 16), png_byte(argb >> 8),
+                                     png_byte(argb)});
+      if (num_channels == 4) rows[y].push_back(png_byte(argb >> 24));
+    }
+  }
+
+  std::string png;
+  png_structp png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png_create_info_struct(png_ptr);
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info);
+    return "";
+  }
+  png_set_write_fn(
+      png_ptr, &png,
+      [](png_structp png_ptr, png_bytep data, png_size_t size) {
+        static_cast<std::string*>(png_get_io_ptr(png_ptr))
+            ->append(reinterpret_cast<const char*>(data), size);
+      },
+      nullptr);
+  png_set_IHDR(png_ptr, info, pic.width, pic.height, 8, color_type,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  if (num_channels == 1) {
+    std::vector<png_color> colors;
+    for (const uint32_t argb : palette) {
+      colors.push_back({png_byte(argb >> 16), png_byte(argb >> 8),
+                        png_byte(argb)});
+    }
+    png_set_PLTE(png_ptr, info, colors.data(), colors.size());
+  }
+  png_write_info(png_ptr, info);
+  for (std::vector<png_byte>& row : rows) png_write_row(png_ptr, row.data());
+  png_write_end(png_ptr, info);
+  png_destroy_write_struct(&png_ptr, &info);
+  return png;
+}
+
+// Frame of a GIF built by EncodeGIF(), made of color indices.
+struct GIFFrame {
+  int left = 0, top = 0, width = 0, height = 0;
+  std::vector<uint8_t> indices;   // 'width' x 'height', row by row.
+  std::vector<uint32_t> palette;  // Local color table if not empty.
+  int delay_cs = 10;              // In hundredths of a second.
+  int dispose = 1;                // 1: none, 2: background, 3: previous.
+  int transparent = -1;           // Transparent index, or -1.
+  bool interlaced = false;
+  size_t max_lzw_bytes = SIZE_MAX;  // Truncates the image data if smaller.
+};
+
+// Returns a GIF89a of 'width' x 'height' with the global color table
+// 'palette' (RGB of the ARGB values, at most 256 colors) and 'frames'.
+inline std::string EncodeGIF(int width, int height,
+                             const std::vector<uint32_t>& palette,
+                             const std::vector<GIFFrame>& frames) {
+  std::string gif = "GIF89a";
+  const auto put16 = [&gif](int value) {
+    gif += char(value & 0xff);
+    gif += char(value >> 8);
+  };
+  // Color tables have 2 << size_bits entries.
+  const auto put_palette = [&gif](const std::vector<uint32_t>& colors) {
+    int size_bits = 0;
+    while ((2u << size_bits) < colors.size()) ++size_bits;
+    for (int i = 0; i < (2 << size_bits); ++i) {
+      const uint32_t argb = (i < int(colors.size())) ? colors[i] : 0;
+      gif += {char(argb >> 16), char(argb >> 8), char(argb)};
+    }
+    return size_bits;
+  };
+  put16(width);
+  put16(height);
+  const size_t flags_pos = gif.size();
+  gif += {0, 0, 0};  // flags, background index, aspect ratio
+  if (!palette.empty()) gif[flags_pos] = char(0x80 | put_palette(palette));
+
+  for (const GIFFrame& frame : frames) {
+    gif += {0x21, char(0xf9), 4,
+            char((frame.dispose << 2) | (frame.transparent >= 0))};
+    put16(frame.delay_cs);
+    gif += {char(std::max(frame.transparent, 0)), 0};
+
+    gif += 0x2c;
+    put16(frame.left);
+    put16(frame.top);
+    put16(frame.width);
+    put16(frame.height);
+    const size_t desc_flags_pos = gif.size();
+    gif += char(frame.interlaced ? 0x40 : 0);
+    int size_bits = 0;
+    if (!frame.palette.empty()) {
+      size_bits = put_palette(frame.palette);
+      gif[desc_flags_pos] |= char(0x80 | size_bits);
+    } else {
+      while ((2u << size_bits) < palette.size()) ++size_bits;
+    }
+
+    // Interlaced rows are stored by pass: every 8th row from 0, every 8th
+    // from 4, every 4th from 2 and every 2nd from 1.
+    std::vector<uint8_t> indices;
+    for (const auto& pass : {std::make_pair(0, 8), std::make_pair(4, 8),
+                             std::make_pair(2, 4), std::make_pair(1, 2)}) {
+      for (int y = frame.interlaced ? pass.first : 0; y < frame.height;
+           y += frame.interlaced ? pass.second : 1) {
+        indices.insert(indices.end(),
+                       frame.indices.begin() + y * frame.width,
+                       frame.indices.begin() + (y + 1) * frame.width);
+      }
+      if (!frame.interlaced) break;
+    }
+
+    // LZW with variable-length codes, restarted when the table is full.
+    const int min_code_size = std::max(2, size_bits + 1);
+    const int clear_code = 1 << min_code_size;
+    std::string lzw;
+    uint32_t bits = 0;
+    int num_bits = 0, code_size = min_code_size + 1;
+    const auto put_code = [&](int code) {
+      bits |= uint32_t(code) << num_bits;
+      for (num_bits += code_size; num_bits >= 8; num_bits -= 8, bits >>= 8) {
+        lzw += char(bits & 0xff);
+      }
+    };
+    std::map<std::pair<int, uint8_t>, int> table;
+    int next_code = clear_code + 2;
+    int prefix = -1;
+    put_code(clear_code);
+    for (const uint8_t index : indices) {
+      if (prefix == -1) {
+        prefix = index;
+        continue;
+      }
+      const auto it = table.find({prefix, index});
+      if (it != table.end()) {
+        prefix = it->second;
+        continue;
+      }
+      put_code(prefix);
+      if (next_code < 4096) {
+        table[{prefix, index}] = next_code++;
+        // The decoder adds each code one step later, hence the '>'.
+        if (next_code > (1 << code_size) && code_size < 12) ++code_size;
+      } else {
+        put_code(clear_code);
+        table.clear();
+        next_code = clear_code + 2;
+        code_size = min_code_size + 1;
+      }
+      prefix = index;
+    }
+    if (prefix != -1) {
+      put_code(prefix);
+      if (next_code == (1 << code_size) && code_size < 12) ++code_size;
+    }
+    put_code(clear_code + 1);
+    if (num_bits > 0) lzw += char(bits & 0xff);
+    lzw.resize(std::min(lzw.size(), frame.max_lzw_bytes));
+
+    gif += char(min_code_size);
+    for (size_t pos = 0; pos < lzw.size(); pos += 255) {
+      const std::string block = lzw.substr(pos, 255);
+      gif += char(block.size());
+      gif += block;
+    }
+    gif += char(0);
+  }
+  gif += 0x3b;
+  return gif;
+}
+
+#endif  // THUMBNAILER_TEST_TEST_GENERATOR_H_
@@ -14,85 +14,34 @@
 
 #include "../src/thumbnailer.h"
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
 #include <random>
+#include <sstream>
+#include <thread>
 
+#include "../imageio/animdec.h"
+#include "../imageio/imageio_util.h"
+#include "../imageio/streamdec.h"
+#include "../src/thumbnailer_service.h"
 #include "../src/utils/thumbnailer_utils.h"
+#include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
+#include "jpeglib.h"
+#include "png.h"
+#include "test_generator.h"
+#include "thumbnailer_test_peer.h"
 
-const int kDefaultWidth = 160;
-const int kDefaultHeight = 90;
 const int kDefaultBudget = 153600;  // 150 kB
 
-class WebPTestGenerator {
- public:
-  // Initializing.
-  WebPTestGenerator()
-      : pic_count_(10),
-        width_(kDefaultWidth),
-        height_(kDefaultHeight),
-        transparency_(0xff),
-        randomized_(true) {}
-
-  WebPTestGenerator(int pic_count, uint8_t transparency, bool randomized)
-      : pic_count_(pic_count),
-        width_(kDefaultWidth),
-        height_(kDefaultHeight),
-        transparency_(transparency),
-        randomized_(randomized) {}
-
-  WebPTestGenerator(int pic_count, int width, int height, uint8_t transparency,
-                    bool randomized)
-      : pic_count_(pic_count),
-        width_(width),
-        height_(height),
-        transparency_(transparency),
-        randomized_(randomized) {}
-
-  // Returns vector of WebPPicture(s).
-  // randomized_ == true: all pictures are random noise
-  // randomized_ == false: all pictures are random solid color
-  std::vector<EnclosedWebPPicture> GeneratePics() {
-    std::vector<EnclosedWebPPicture> pics;
-    for (int i = 0; i < pic_count_; ++i) {
-      pics.emplace_back(new WebPPicture, libwebp::WebPPictureDelete);
-      EnclosedWebPPicture& pic = pics.back();
-      WebPPictureInit(pic.get());
-      pic->use_argb = 1;
-      pic->width = width_;
-      pic->height = height_;
-      WebPPictureImportRGBA(pic.get(), GenerateRGBA(i).data(), width_ * 4);
-    }
-    return pics;
-  }
-
- private:
-  int pic_count_;
-  int width_;
-  int height_;
-  uint8_t transparency_;
-  bool randomized_;
-
-  // Returns RGBA values for WebPPicture.
-  std::vector<uint8_t> GenerateRGBA(int seed) {
-    std::mt19937 rng(seed);
-    std::vector<uint8_t> rgba;
-
-    const uint8_t color_R = rng() & 0xff;
-    const uint8_t color_G = rng() & 0xff;
-    const uint8_t color_B = rng() & 0xff;
-
-    for (int i = 0; i < height_; ++i) {
-      for (int j = 0; j < width_; ++j) {
-        rgba.push_back(randomized_ ? rng() & 0xff : color_R);
-        rgba.push_back(randomized_ ? rng() & 0xff : color_G);
-        rgba.push_back(randomized_ ? rng() & 0xff : color_B);
-        rgba.push_back(transparency_);
-      }
-    }
-    return rgba;
-  }
-};
-
 class GenerateAnimationTest
     : public ::testing::TestWithParam<
           std::tuple<int, uint8_t, bool, libwebp::Thumbnailer::Method>> {};
@@ -127,6 +76,1803 @@ INSTANTIATE_TEST_CASE_P(
                        ::testing::Values(false, true),
                        ::testing::ValuesIn(libwebp::Thumbnailer::kMethodList)));
 
+// Upper bounds on the encodings and assemblies performed by each method for
+// 'n' frames, derived from the structure of its searches: a binary search
+// over the 101 lossy qualities takes at most 7 steps, one over the 6
+// near-lossless pre-processing values at most 3 steps, and one over the 31
+// refined qualities of LossyEncodeNoSlopeOptim() at most 5 steps. 'num_targets'
+// is the number of PSNR targets tried by kEqualPSNR.
+struct WorkBounds {
+  int lossy_encodes;
+  int lossless_encodes;  // Including near-lossless ones.
+  int assemblies;
+};
+
+WorkBounds GetWorkBounds(libwebp::Thumbnailer::Method method, int n,
+                         int num_targets) {
+  // Binary search on the quality then one encoding per frame at the result.
+  const WorkBounds equal_quality = {n, 0, 7};
+  switch (method) {
+    case libwebp::Thumbnailer::kEqualQuality:
+      return equal_quality;
+    case libwebp::Thumbnailer::kEqualPSNR:
+      // Qualities 0, 100 and a binary search per frame and target.
+      return {n + std::min(101, 9 * num_targets) * n, 0, 7 + num_targets};
+    case libwebp::Thumbnailer::kNearllDiff:
+    case libwebp::Thumbnailer::kNearllEqual:
+      // Pre-processing 0 then a binary search per frame, and up to two final
+      // assemblies.
+      return {n, 4 * n, 9};
+    case libwebp::Thumbnailer::kSlopeOptim:
+      // Median slope (8 per frame), slope search (7 steps of 2 per frame),
+      // near-lossless, 5 refinements (5 per frame) and a final equal quality.
+      return {(8 + 14 + 25 + 1) * n, 4 * n, 7 + 2 + 5 + 7};
+    case libwebp::Thumbnailer::kTemporalDecimation: {
+      // One equal quality search per batch of dropped frames.
+      const int num_searches = 1 + n / 2;
+      return {num_searches * n, 0, num_searches * 7};
+    }
+  }
+  return {0, 0, 0};
+}
+
+class EncodeCountTest
+    : public ::testing::TestWithParam<libwebp::Thumbnailer::Method> {};
+
+TEST_P(EncodeCountTest, StaysWithinBounds) {
+  const int pic_count = 10;
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  const auto generate = [&](libwebp::Thumbnailer::Method method,
+                            thumbnailer::ThumbnailerStats* const stats) {
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+    for (int i = 0; i < pic_count; ++i) {
+      ASSERT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+        new WebPData, libwebp::WebPDataDelete);
+    WebPDataInit(webp_data.get());
+    ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get(), method, stats),
+              libwebp::Thumbnailer::kOk);
+  };
+
+  // kEqualPSNR tries the PSNR targets between the lowest and the highest
+  // PSNR of the frames encoded by kEqualQuality.
+  thumbnailer::ThumbnailerStats equal_quality_stats;
+  generate(libwebp::Thumbnailer::kEqualQuality, &equal_quality_stats);
+  float min_psnr = 99.f, max_psnr = 0.f;
+  for (const auto& frame : equal_quality_stats.frame()) {
+    min_psnr = std::min(min_psnr, frame.psnr());
+    max_psnr = std::max(max_psnr, frame.psnr());
+  }
+  const int num_targets =
+      int(std::floor(max_psnr)) - int(std::floor(min_psnr)) + 1;
+
+  thumbnailer::ThumbnailerStats stats;
+  generate(GetParam(), &stats);
+  const WorkBounds bounds = GetWorkBounds(GetParam(), pic_count, num_targets);
+  EXPECT_LE(stats.lossy_encodes(), bounds.lossy_encodes);
+  EXPECT_LE(stats.lossless_encodes() + stats.near_lossless_encodes(),
+            bounds.lossless_encodes);
+  EXPECT_LE(stats.assemblies(), bounds.assemblies);
+  // Each quality of each frame is encoded at most once.
+  EXPECT_LE(stats.lossy_encodes(), 101 * pic_count);
+}
+
+INSTANTIATE_TEST_CASE_P(
+    ThumbnailerTest, EncodeCountTest,
+    ::testing::ValuesIn(libwebp::Thumbnailer::kMethodList));
+
+TEST(BudgetLadderTest, MatchesSingleBudgetRun) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  libwebp::Thumbnailer ladder_thumbnailer = libwebp::Thumbnailer();
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(ladder_thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+
+  const std::vector<size_t> budgets = {kDefaultBudget / 2, kDefaultBudget};
+  std::vector<WebPData> ladder;
+  ASSERT_EQ(ladder_thumbnailer.GenerateAnimation(budgets, &ladder),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(ladder.size(), budgets.size());
+  for (std::size_t i = 0; i < budgets.size(); ++i) {
+    EXPECT_LE(ladder[i].size, budgets[i]);
+    EXPECT_GT(ladder[i].size, 0);
+  }
+
+  // The last variant matches a single run with the same (default) budget.
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(webp_data->size, ladder.back().size);
+  EXPECT_EQ(memcmp(webp_data->bytes, ladder.back().bytes, webp_data->size), 0);
+
+  for (WebPData& webp_data : ladder) WebPDataClear(&webp_data);
+}
+
+TEST(HardBudgetTest, FallsBackToHardBudget) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  thumbnailer::ThumbnailerOption thumbnailer_option;
+  thumbnailer_option.set_soft_max_size(1000);  // Unreachable with noise.
+  thumbnailer_option.set_hard_max_size(kDefaultBudget);
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(thumbnailer_option);
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(webp_data->size, 1000);
+  EXPECT_LE(webp_data->size, kDefaultBudget);
+}
+
+TEST(WarmStartTest, MatchesFullSearchWithFewerProbes) {
+  const int pic_count = 10;
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kTexture)
+          .GeneratePics();
+  const auto generate = [&](bool warm_start, size_t* const size,
+                            thumbnailer::ThumbnailerStats* const stats) {
+    thumbnailer::ThumbnailerOption option;
+    option.set_soft_max_size(kDefaultBudget / 2);
+    option.set_hard_max_size(kDefaultBudget / 2);
+    option.set_warm_start(warm_start);
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    for (int i = 0; i < pic_count; ++i) {
+      ASSERT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    ASSERT_EQ(thumbnailer.GenerateAnimation(
+                  &webp_data, libwebp::Thumbnailer::kEqualQuality, stats),
+              libwebp::Thumbnailer::kOk);
+    *size = webp_data.size;
+    WebPDataClear(&webp_data);
+  };
+
+  size_t full_size, warm_size;
+  thumbnailer::ThumbnailerStats full_stats, warm_stats;
+  generate(/*warm_start=*/false, &full_size, &full_stats);
+  generate(/*warm_start=*/true, &warm_size, &warm_stats);
+  EXPECT_LE(warm_size, kDefaultBudget / 2);
+  ASSERT_EQ(warm_stats.frame_size(), pic_count);
+  ASSERT_EQ(full_stats.frame_size(), pic_count);
+  for (int i = 0; i < pic_count; ++i) {
+    EXPECT_GE(warm_stats.frame(i).quality(), full_stats.frame(i).quality());
+  }
+  // The narrower search pays for the calibration of the prediction.
+  EXPECT_LT(warm_stats.lossy_encodes(), full_stats.lossy_encodes());
+  EXPECT_LT(warm_stats.assemblies(), full_stats.assemblies());
+}
+
+TEST(ClusterTest, SharesEncodingsWithinClusters) {
+  const int pic_count = 10;
+  // Returns the number of lossy encodings needed to generate an animation of
+  // 'pics', which must fit the default budget.
+  const auto count_encodes = [](const std::vector<const WebPPicture*>& pics,
+                                 float cluster_psnr) {
+    thumbnailer::ThumbnailerOption thumbnailer_option;
+    thumbnailer_option.set_cluster_psnr(cluster_psnr);
+    libwebp::Thumbnailer thumbnailer =
+        libwebp::Thumbnailer(thumbnailer_option);
+    for (std::size_t i = 0; i < pics.size(); ++i) {
+      EXPECT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 500),
+                libwebp::Thumbnailer::kOk);
+    }
+    std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+        new WebPData, libwebp::WebPDataDelete);
+    WebPDataInit(webp_data.get());
+    thumbnailer::ThumbnailerStats stats;
+    EXPECT_EQ(thumbnailer.GenerateAnimation(
+                  webp_data.get(), libwebp::Thumbnailer::kEqualPSNR, &stats),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_LE(webp_data->size, kDefaultBudget);
+    EXPECT_GT(stats.lossy_encodes(), 0);
+    return int(stats.lossy_encodes());
+  };
+
+  // Identical frames fall in the same cluster: only its first frame is
+  // encoded.
+  const std::vector<EnclosedWebPPicture> noise =
+      WebPTestGenerator(1, 0xff, /*randomized=*/true).GeneratePics();
+  const std::vector<const WebPPicture*> identical(pic_count, noise[0].get());
+  EXPECT_EQ(count_encodes(identical, 0),
+            pic_count * count_encodes(identical, 40));
+
+  // Gray levels 20 apart are far below 40 dB from each other: each frame is
+  // its own cluster.
+  std::vector<EnclosedWebPPicture> grays =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/false).GeneratePics();
+  std::vector<const WebPPicture*> distinct;
+  for (int i = 0; i < pic_count; ++i) {
+    WebPPicture* const pic = grays[i].get();
+    const uint32_t gray = 20 + 20 * i;
+    for (int y = 0; y < pic->height; ++y) {
+      std::fill(pic->argb + y * pic->argb_stride,
+                pic->argb + y * pic->argb_stride + pic->width,
+                0xff000000u | (gray << 16) | (gray << 8) | gray);
+    }
+    distinct.push_back(pic);
+  }
+  EXPECT_EQ(count_encodes(distinct, 0), count_encodes(distinct, 40));
+}
+
+TEST(ClusterTest, SplitsClustersOfAddedFrames) {
+  const std::vector<EnclosedWebPPicture> noise =
+      WebPTestGenerator(1, 0xff, /*randomized=*/true).GeneratePics();
+  std::vector<EnclosedWebPPicture> gray =
+      WebPTestGenerator(1, 0xff, /*randomized=*/false).GeneratePics();
+  for (int y = 0; y < gray[0]->height; ++y) {
+    uint32_t* const row = gray[0]->argb + y * gray[0]->argb_stride;
+    std::fill(row, row + gray[0]->width, 0xff808080u);
+  }
+  thumbnailer::ThumbnailerOption thumbnailer_option;
+  thumbnailer_option.set_cluster_psnr(40);
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(thumbnailer_option);
+  libwebp::ThumbnailerTestPeer peer(&thumbnailer);
+  const auto generate = [&]() {
+    std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+        new WebPData, libwebp::WebPDataDelete);
+    WebPDataInit(webp_data.get());
+    EXPECT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+  };
+
+  ASSERT_EQ(thumbnailer.AddFrame(*noise[0], 100), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(thumbnailer.AddFrame(*noise[0], 300), libwebp::Thumbnailer::kOk);
+  generate();
+  EXPECT_TRUE(peer.SharesLossyStats(0, 1));
+
+  // A dissimilar frame in between starts a new cluster, and the last frame
+  // starts a third one.
+  ASSERT_EQ(thumbnailer.AddFrame(*gray[0], 200), libwebp::Thumbnailer::kOk);
+  generate();
+  EXPECT_FALSE(peer.SharesLossyStats(0, 1));
+  EXPECT_FALSE(peer.SharesLossyStats(0, 2));
+  EXPECT_FALSE(peer.SharesLossyStats(1, 2));
+}
+
+// Returns the ending timestamps of the frames of the animation 'webp_data'.
+std::vector<int> GetFrameTimestamps(const WebPData& webp_data) {
+  std::vector<int> timestamps;
+  std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
+      WebPAnimDecoderNew(&webp_data, nullptr), WebPAnimDecoderDelete);
+  if (dec == nullptr) return timestamps;
+  while (WebPAnimDecoderHasMoreFrames(dec.get())) {
+    uint8_t* rgba;
+    int timestamp;
+    if (!WebPAnimDecoderGetNext(dec.get(), &rgba, &timestamp)) break;
+    timestamps.push_back(timestamp);
+  }
+  return timestamps;
+}
+
+TEST(DecimationTest, DropsFramesButKeepsInput) {
+  const int pic_count = 10;
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  // No quality is high enough: half of the frames are dropped.
+  thumbnailer::ThumbnailerOption option;
+  option.set_soft_max_size(kDefaultBudget / 4);
+  option.set_hard_max_size(kDefaultBudget / 4);
+  option.set_decimation_quality(100);
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+  // Out of order, to check that the added frames are not reordered either.
+  for (int i = pic_count - 1; i >= 0; --i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+
+  thumbnailer::ThumbnailerStats stats;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(
+                webp_data.get(), libwebp::Thumbnailer::kTemporalDecimation,
+                &stats),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(stats.dropped_frames(), 0);
+  EXPECT_LE(stats.dropped_frames(), pic_count / 2);
+  ASSERT_EQ(stats.frame_size(), pic_count);
+  int num_dropped = 0;
+  for (int i = 0; i < pic_count; ++i) {
+    EXPECT_EQ(stats.frame(i).timestamp_ms(), (pic_count - i) * 100);
+    num_dropped += (stats.frame(i).encoded_size() == 0);
+  }
+  EXPECT_EQ(num_dropped, stats.dropped_frames());
+
+  // The kept frames last until the next kept one, and the last one ends with
+  // the clip.
+  const std::vector<int> timestamps = GetFrameTimestamps(*webp_data);
+  ASSERT_EQ(timestamps.size(), pic_count - stats.dropped_frames());
+  for (std::size_t i = 0; i < timestamps.size(); ++i) {
+    EXPECT_EQ(timestamps[i] % 100, 0);
+    if (i > 0) {
+      EXPECT_GT(timestamps[i], timestamps[i - 1]);
+    }
+  }
+  EXPECT_EQ(timestamps.back(), pic_count * 100);
+
+  // The next generation still sees every frame.
+  WebPDataClear(webp_data.get());
+  ASSERT_EQ(thumbnailer.GenerateAnimation(
+                webp_data.get(), libwebp::Thumbnailer::kEqualQuality, &stats),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(stats.frame_size(), pic_count);
+  EXPECT_EQ(stats.dropped_frames(), 0);
+  EXPECT_EQ(GetFrameTimestamps(*webp_data).size(), pic_count);
+}
+
+TEST(DecimationTest, DropsTheMostSimilarFrames) {
+  const int pic_count = 10;
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  thumbnailer::ThumbnailerOption option;
+  option.set_soft_max_size(kDefaultBudget / 4);
+  option.set_hard_max_size(kDefaultBudget / 4);
+  option.set_decimation_quality(100);
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+  // Each odd frame repeats the previous one, so it is the first to go.
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i - i % 2], (i + 1) * 100),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+  thumbnailer::ThumbnailerStats stats;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(
+                webp_data.get(), libwebp::Thumbnailer::kTemporalDecimation,
+                &stats),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(stats.dropped_frames(), 0);
+  ASSERT_EQ(stats.frame_size(), pic_count);
+  std::vector<int> kept_timestamps;
+  for (int i = 0; i < pic_count; ++i) {
+    if (stats.frame(i).encoded_size() == 0) {
+      EXPECT_EQ(i % 2, 1) << "distinct frame " << i << " was dropped";
+    } else {
+      kept_timestamps.push_back(stats.frame(i).timestamp_ms());
+    }
+  }
+  // The stats describe the frames of the returned animation, each of which
+  // lasts until the next one.
+  const std::vector<int> timestamps = GetFrameTimestamps(*webp_data);
+  ASSERT_EQ(timestamps.size(), kept_timestamps.size());
+  for (std::size_t i = 0; i + 1 < timestamps.size(); ++i) {
+    EXPECT_EQ(timestamps[i], kept_timestamps[i + 1] - 100);
+  }
+  EXPECT_EQ(timestamps.back(), pic_count * 100);
+}
+
+TEST(AddFrameTest, ReleasesExternalSamples) {
+  const int pic_count = 3;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/false).GeneratePics();
+  int num_released = 0;
+  {
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+    ASSERT_EQ(thumbnailer.AddFrameARGB(
+                  pics[0]->argb, pics[0]->width, pics[0]->height,
+                  pics[0]->argb_stride, 500, [&]() { ++num_released; }),
+              libwebp::Thumbnailer::kOk);
+    ASSERT_EQ(thumbnailer.AddFrameARGB(pics[1]->argb, pics[1]->width,
+                                       pics[1]->height, pics[1]->argb_stride,
+                                       1000, [&]() { ++num_released; }),
+              libwebp::Thumbnailer::kOk);
+    // Mismatched dimensions are rejected and the callback is not called.
+    EXPECT_EQ(thumbnailer.AddFrameARGB(pics[2]->argb, pics[2]->width / 2,
+                                       pics[2]->height, pics[2]->argb_stride,
+                                       1500, [&]() { ++num_released; }),
+              libwebp::Thumbnailer::kImageFormatError);
+    // The samples of the moved picture now belong to the thumbnailer.
+    ASSERT_EQ(thumbnailer.AddFrame(std::move(*pics[2]), 1500),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_EQ(pics[2]->argb, nullptr);
+
+    std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+        new WebPData, libwebp::WebPDataDelete);
+    WebPDataInit(webp_data.get());
+    ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_GT(webp_data->size, 0);
+    EXPECT_EQ(num_released, 0);
+  }
+  EXPECT_EQ(num_released, 2);
+}
+
+TEST(AsyncTest, ReportsProgressAndCancels) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+
+  libwebp::Thumbnailer::Progress last_progress;
+  thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        last_progress = progress;
+      });
+  ASSERT_EQ(thumbnailer.GenerateAnimationAsync(webp_data.get()).get(),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(last_progress.num_probes, 0);
+  EXPECT_EQ(last_progress.byte_budget, kDefaultBudget);
+  EXPECT_LE(last_progress.best_size, kDefaultBudget);
+  EXPECT_GT(last_progress.best_size, 0);
+  const int num_probes = last_progress.num_probes;
+
+  // Cancel from the progress callback after the first probe.
+  libwebp::Thumbnailer cancelled_thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(cancelled_thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  cancelled_thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        last_progress = progress;
+        cancelled_thumbnailer.Cancel();
+      });
+  EXPECT_EQ(cancelled_thumbnailer
+                .GenerateAnimationAsync(webp_data.get(),
+                                        libwebp::Thumbnailer::kEqualPSNR)
+                .get(),
+            libwebp::Thumbnailer::kCancelled);
+  EXPECT_EQ(last_progress.num_probes, 1);
+
+  // The next generation is not cancelled.
+  cancelled_thumbnailer.SetProgressCallback(nullptr);
+  EXPECT_EQ(cancelled_thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+
+  // Cancelling while no generation runs has no effect.
+  cancelled_thumbnailer.Cancel();
+  EXPECT_EQ(cancelled_thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+
+  // Cancelling from the callback of the last probe of the first generation
+  // is not lost, even though no probe follows.
+  libwebp::Thumbnailer late_thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(late_thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  late_thumbnailer.SetProgressCallback(
+      [&](const libwebp::Thumbnailer::Progress& progress) {
+        last_progress = progress;
+        if (progress.num_probes == num_probes) late_thumbnailer.Cancel();
+      });
+  EXPECT_EQ(late_thumbnailer.GenerateAnimationAsync(webp_data.get()).get(),
+            libwebp::Thumbnailer::kCancelled);
+  EXPECT_EQ(last_progress.num_probes, num_probes);
+}
+
+TEST(StatsTest, DescribesGeneration) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+
+  thumbnailer::ThumbnailerStats stats;
+  ASSERT_EQ(thumbnailer.GenerateAnimation(
+                webp_data.get(), libwebp::Thumbnailer::kEqualPSNR, &stats),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(stats.animation_size(), webp_data->size);
+  EXPECT_GT(stats.lossy_encodes(), 0);
+  EXPECT_EQ(stats.lossless_encodes(), 0);
+  EXPECT_GT(stats.assemblies(), 0);
+  EXPECT_GT(stats.rd_cache_hits(), 0);
+  EXPECT_LE(stats.rd_cache_hits(), stats.rd_cache_lookups());
+  EXPECT_GE(stats.peak_picture_bytes(),
+            uint64_t(pic_count) * kDefaultWidth * kDefaultHeight * 4);
+  ASSERT_EQ(stats.frame_size(), pic_count);
+  for (int i = 0; i < pic_count; ++i) {
+    EXPECT_EQ(stats.frame(i).timestamp_ms(), i * 500);
+    EXPECT_FALSE(stats.frame(i).lossless());
+  }
+  std::vector<std::string> phase_names;
+  for (const thumbnailer::ThumbnailerStats::Phase& phase : stats.phase()) {
+    phase_names.push_back(phase.name());
+    EXPECT_GT(phase.count(), 0);
+    EXPECT_GE(phase.wall_ms(), 0);
+  }
+  EXPECT_NE(std::find(phase_names.begin(), phase_names.end(), "equal_psnr"),
+            phase_names.end());
+  EXPECT_NE(std::find(phase_names.begin(), phase_names.end(), "equal_quality"),
+            phase_names.end());
+}
+
+TEST(GeneratorTest, IsDeterministic) {
+  const auto generate = [](WebPTestGenerator::Content content) {
+    return WebPTestGenerator(6, 320, 180, 0xff, content).GeneratePics();
+  };
+  const auto equal = [](const WebPPicture& a, const WebPPicture& b) {
+    for (int y = 0; y < a.height; ++y) {
+      if (memcmp(a.argb + y * a.argb_stride, b.argb + y * b.argb_stride,
+                 a.width * sizeof(uint32_t)) != 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+  for (int content = WebPTestGenerator::kGradient;
+       content < WebPTestGenerator::kNumContents; ++content) {
+    const std::vector<EnclosedWebPPicture> pics =
+        generate(WebPTestGenerator::Content(content));
+    const std::vector<EnclosedWebPPicture> pics2 =
+        generate(WebPTestGenerator::Content(content));
+    for (std::size_t i = 0; i < pics.size(); ++i) {
+      EXPECT_TRUE(equal(*pics[i], *pics2[i]));
+    }
+    EXPECT_FALSE(equal(*pics[0], *pics[1]));
+  }
+
+  // The sprites hold still every third frame.
+  const std::vector<EnclosedWebPPicture> sprites =
+      generate(WebPTestGenerator::kSprites);
+  EXPECT_TRUE(equal(*sprites[2], *sprites[3]));
+  EXPECT_FALSE(equal(*sprites[3], *sprites[4]));
+}
+
+TEST(GetPictureStatsTest, CachesLossyStats) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(1, 0xff, /*randomized=*/true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  ASSERT_EQ(thumbnailer.AddFrame(*pics[0], 500), libwebp::Thumbnailer::kOk);
+  libwebp::ThumbnailerTestPeer peer(&thumbnailer);
+  ASSERT_EQ(peer.ResetStats(), libwebp::Thumbnailer::kOk);
+
+  size_t size, cached_size;
+  float psnr, cached_psnr;
+  peer.SetConfig(/*lossless=*/false, /*quality=*/50);
+  ASSERT_EQ(peer.GetPictureStats(0, &size, &psnr), libwebp::Thumbnailer::kOk);
+  ASSERT_EQ(peer.GetPictureStats(0, &cached_size, &cached_psnr),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(cached_size, size);
+  EXPECT_EQ(cached_psnr, psnr);
+  EXPECT_EQ(peer.GetStats().lossy_encodes(), 1);
+  EXPECT_EQ(peer.GetStats().rd_cache_hits(), 1);
+
+  peer.ClearCaches();
+  ASSERT_EQ(peer.GetPictureStats(0, &cached_size, &cached_psnr),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(cached_size, size);
+  EXPECT_EQ(peer.GetStats().lossy_encodes(), 2);
+
+  peer.SetConfig(/*lossless=*/true, /*quality=*/100);
+  ASSERT_EQ(peer.GetPictureStats(0, &size, &psnr), libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(psnr, 99.f);
+  EXPECT_EQ(peer.GetStats().lossless_encodes(), 1);
+}
+
+TEST(MemoryLimitTest, DropsCachesThenFails) {
+  const int pic_count = 10;
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  const auto generate = [&](uint64_t max_memory_bytes,
+                            std::vector<uint8_t>* const webp,
+                            thumbnailer::ThumbnailerStats* const stats,
+                            uint64_t* const encoder_bytes) {
+    thumbnailer::ThumbnailerOption option;
+    option.set_max_memory_bytes(max_memory_bytes);
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    for (int i = 0; i < pic_count; ++i) {
+      EXPECT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    *encoder_bytes = libwebp::ThumbnailerTestPeer(&thumbnailer)
+                         .GetEncoderBytes();
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    const libwebp::Thumbnailer::Status status = thumbnailer.GenerateAnimation(
+        &webp_data, libwebp::Thumbnailer::kEqualQuality, stats);
+    webp->assign(webp_data.bytes, webp_data.bytes + webp_data.size);
+    WebPDataClear(&webp_data);
+    return status;
+  };
+
+  std::vector<uint8_t> webp, limited_webp;
+  thumbnailer::ThumbnailerStats stats, limited_stats;
+  uint64_t encoder_bytes;
+  ASSERT_EQ(generate(0, &webp, &stats, &encoder_bytes),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(stats.peak_bitstream_bytes(), 0);
+  EXPECT_EQ(stats.cache_drops(), 0);
+
+  // Assembling needs the pictures, a copy of a frame and the encoder, but the
+  // cached animations do not fit anymore.
+  const uint64_t max_memory_bytes = stats.peak_picture_bytes() + encoder_bytes;
+  ASSERT_LT(max_memory_bytes, stats.peak_memory_bytes());
+  ASSERT_EQ(
+      generate(max_memory_bytes, &limited_webp, &limited_stats, &encoder_bytes),
+      libwebp::Thumbnailer::kOk);
+  EXPECT_GT(limited_stats.cache_drops(), 0);
+  EXPECT_LE(limited_stats.peak_memory_bytes(), max_memory_bytes);
+  EXPECT_EQ(limited_webp, webp);
+
+  // Not even the frames fit.
+  EXPECT_EQ(generate(1, &limited_webp, &limited_stats, &encoder_bytes),
+            libwebp::Thumbnailer::kMemoryError);
+}
+
+TEST(MemoryLimitTest, DropsRebuildablePictures) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0x80,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  // Lossless encodings of YUVA frames convert them to ARGB.
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_TRUE(WebPPictureARGBToYUVA(pics[i].get(), WEBP_YUV420A));
+  }
+  const auto generate = [&](int max_decoded_frames, uint64_t max_memory_bytes,
+                            std::vector<uint8_t>* const webp,
+                            thumbnailer::ThumbnailerStats* const stats,
+                            uint64_t* const encoder_bytes) {
+    thumbnailer::ThumbnailerOption option;
+    option.set_frame_store(thumbnailer::ThumbnailerOption::COMPRESSED);
+    option.set_max_decoded_frames(max_decoded_frames);
+    option.set_max_memory_bytes(max_memory_bytes);
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    for (int i = 0; i < pic_count; ++i) {
+      EXPECT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    *encoder_bytes = libwebp::ThumbnailerTestPeer(&thumbnailer)
+                         .GetEncoderBytes();
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    const libwebp::Thumbnailer::Status status = thumbnailer.GenerateAnimation(
+        &webp_data, libwebp::Thumbnailer::kNearllDiff, stats);
+    webp->assign(webp_data.bytes, webp_data.bytes + webp_data.size);
+    WebPDataClear(&webp_data);
+    return status;
+  };
+
+  // The pictures held with only two decompressed frames.
+  std::vector<uint8_t> webp, limited_webp;
+  thumbnailer::ThumbnailerStats stats, limited_stats;
+  uint64_t encoder_bytes;
+  ASSERT_EQ(generate(2, 0, &webp, &stats, &encoder_bytes),
+            libwebp::Thumbnailer::kOk);
+  const uint64_t max_memory_bytes = stats.peak_picture_bytes() + encoder_bytes;
+
+  // Keeping all frames decompressed does not fit, unless they are dropped.
+  ASSERT_EQ(generate(pic_count, 0, &webp, &stats, &encoder_bytes),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_GT(stats.peak_picture_bytes(), max_memory_bytes);
+  ASSERT_EQ(generate(pic_count, max_memory_bytes, &limited_webp,
+                     &limited_stats, &encoder_bytes),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_GT(limited_stats.cache_drops(), 0);
+  EXPECT_LE(limited_stats.peak_memory_bytes(), max_memory_bytes);
+  EXPECT_EQ(limited_webp, webp);
+}
+
+TEST(FrameStoreTest, EncodesLosslessYUVFramesAsARGB) {
+  const int pic_count = 3;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth + 1, kDefaultHeight + 1, 0x80,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_TRUE(WebPPictureARGBToYUVA(pics[i].get(), WEBP_YUV420A));
+  }
+  for (const auto store : {thumbnailer::ThumbnailerOption::RESIDENT,
+                           thumbnailer::ThumbnailerOption::COMPRESSED}) {
+    thumbnailer::ThumbnailerOption option;
+    option.set_frame_store(store);
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    for (int i = 0; i < pic_count; ++i) {
+      ASSERT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    libwebp::ThumbnailerTestPeer peer(&thumbnailer);
+    for (int i = 0; i < pic_count; ++i) {
+      WebPPicture expected;
+      ASSERT_TRUE(WebPPictureInit(&expected));
+      ASSERT_TRUE(WebPPictureCopy(pics[i].get(), &expected));
+      ASSERT_TRUE(WebPPictureYUVAToARGB(&expected));
+
+      const WebPPicture* pic;
+      peer.SetConfig(/*lossless=*/false, /*quality=*/70);
+      ASSERT_EQ(peer.GetEncodingPicture(i, &pic), libwebp::Thumbnailer::kOk);
+      EXPECT_FALSE(pic->use_argb);
+
+      peer.SetConfig(/*lossless=*/true, /*quality=*/70);
+      ASSERT_EQ(peer.GetEncodingPicture(i, &pic), libwebp::Thumbnailer::kOk);
+      ASSERT_TRUE(pic->use_argb);
+      ASSERT_EQ(pic->width, expected.width);
+      ASSERT_EQ(pic->height, expected.height);
+      for (int y = 0; y < pic->height; ++y) {
+        ASSERT_TRUE(std::equal(pic->argb + y * pic->argb_stride,
+                               pic->argb + y * pic->argb_stride + pic->width,
+                               expected.argb + y * expected.argb_stride));
+      }
+      WebPPictureFree(&expected);
+    }
+  }
+}
+
+TEST(FrameStoreTest, MatchesResidentFrames) {
+  const int pic_count = 12;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0x80,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  // Both ARGB and YUVA frames are stored.
+  for (int i = 1; i < pic_count; i += 2) {
+    ASSERT_TRUE(WebPPictureARGBToYUVA(pics[i].get(), WEBP_YUV420A));
+  }
+  const auto generate = [&](thumbnailer::ThumbnailerOption::FrameStore store,
+                            std::vector<uint8_t>* const webp,
+                            thumbnailer::ThumbnailerStats* const stats) {
+    thumbnailer::ThumbnailerOption option;
+    option.set_frame_store(store);
+    option.set_max_decoded_frames(2);
+    libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer(option);
+    for (int i = 0; i < pic_count; ++i) {
+      EXPECT_EQ(thumbnailer.AddFrame(*pics[i], (i + 1) * 100),
+                libwebp::Thumbnailer::kOk);
+    }
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    const libwebp::Thumbnailer::Status status = thumbnailer.GenerateAnimation(
+        &webp_data, libwebp::Thumbnailer::kNearllDiff, stats);
+    webp->assign(webp_data.bytes, webp_data.bytes + webp_data.size);
+    WebPDataClear(&webp_data);
+    return status;
+  };
+
+  std::vector<uint8_t> webp;
+  thumbnailer::ThumbnailerStats stats;
+  ASSERT_EQ(generate(thumbnailer::ThumbnailerOption::RESIDENT, &webp, &stats),
+            libwebp::Thumbnailer::kOk);
+  EXPECT_EQ(stats.frame_loads(), 0);
+
+  for (const auto store : {thumbnailer::ThumbnailerOption::COMPRESSED,
+                           thumbnailer::ThumbnailerOption::SPILLED}) {
+    std::vector<uint8_t> stored_webp;
+    thumbnailer::ThumbnailerStats stored_stats;
+    ASSERT_EQ(generate(store, &stored_webp, &stored_stats),
+              libwebp::Thumbnailer::kOk);
+    EXPECT_EQ(stored_webp, webp);
+    EXPECT_GT(stored_stats.stored_frame_bytes(), 0);
+    // Only two frames are decompressed at a time.
+    EXPECT_GT(stored_stats.frame_loads(), pic_count);
+    EXPECT_LT(stored_stats.peak_picture_bytes(), stats.peak_picture_bytes());
+  }
+}
+
+TEST(TraceTest, WritesChromeTraceEvents) {
+  const int pic_count = 5;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(thumbnailer.AddFrame(*pics[i], i * 500),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+
+  const std::string trace_path = ::testing::TempDir() + "/trace.json";
+  libwebp::StartTracing();
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get(),
+                                          libwebp::Thumbnailer::kEqualQuality),
+            libwebp::Thumbnailer::kOk);
+  ASSERT_TRUE(libwebp::StopTracing(trace_path));
+
+  std::ifstream trace_file(trace_path);
+  std::stringstream trace;
+  trace << trace_file.rdbuf();
+  EXPECT_EQ(trace.str().find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["),
+            0u);
+#ifdef THUMBNAILER_ENABLE_TRACE
+  EXPECT_NE(trace.str().find("\"name\":\"encode\""), std::string::npos);
+  EXPECT_NE(trace.str().find("\"name\":\"assemble\""), std::string::npos);
+  EXPECT_NE(trace.str().find("\"name\":\"equal_quality\""),
+            std::string::npos);
+#else
+  EXPECT_EQ(trace.str().find("\"name\""), std::string::npos);
+#endif
+}
+
+// Decodes 'jpeg' to RGB samples with libjpeg's default settings.
+std::vector<uint8_t> DecodeJPEGToRGB(const std::string& jpeg, int* const width,
+                                     int* const height) {
+  jpeg_decompress_struct dinfo;
+  jpeg_error_mgr jerr;
+  dinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, reinterpret_cast<const unsigned char*>(jpeg.data()),
+               jpeg.size());
+  jpeg_read_header(&dinfo, TRUE);
+  dinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&dinfo);
+  *width = dinfo.output_width;
+  *height = dinfo.output_height;
+  std::vector<uint8_t> rgb(size_t(*width) * *height * 3);
+  while (dinfo.output_scanline < dinfo.output_height) {
+    JSAMPROW row = &rgb[size_t(dinfo.output_scanline) * *width * 3];
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  return rgb;
+}
+
+TEST(ReadPictureTest, DecodesToARGBLikeImport) {
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(1, kDefaultWidth + 1, kDefaultHeight + 1, 0x80,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  const WebPPicture& src = *pics[0];
+  // Returns the RGB(A) samples of 'pic'.
+  const auto get_samples = [](const WebPPicture& pic, bool with_alpha) {
+    std::vector<uint8_t> samples;
+    for (int y = 0; y < pic.height; ++y) {
+      for (int x = 0; x < pic.width; ++x) {
+        const uint32_t argb = pic.argb[y * pic.argb_stride + x];
+        samples.insert(samples.end(), {uint8_t(argb >> 16), uint8_t(argb >> 8),
+                                       uint8_t(argb)});
+        if (with_alpha) samples.push_back(uint8_t(argb >> 24));
+      }
+    }
+    return samples;
+  };
+  // Checks that 'data' is decoded to the 'width' x 'height' RGB(A) 'samples'.
+  const auto check = [](const std::string& data, int width, int height,
+                        const std::vector<uint8_t>& samples, bool with_alpha) {
+    WebPPicture expected;
+    ASSERT_TRUE(WebPPictureInit(&expected));
+    expected.use_argb = 1;
+    expected.width = width;
+    expected.height = height;
+    ASSERT_TRUE(with_alpha ? WebPPictureImportRGBA(&expected, samples.data(),
+                                                   width * 4)
+                           : WebPPictureImportRGB(&expected, samples.data(),
+                                                  width * 3));
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    ASSERT_TRUE(libwebp::ReadPicture(
+        reinterpret_cast<const uint8_t*>(data.data()), data.size(), pic.get()));
+    ASSERT_TRUE(pic->use_argb);
+    ASSERT_EQ(pic->width, width);
+    ASSERT_EQ(pic->height, height);
+    for (int y = 0; y < height; ++y) {
+      ASSERT_TRUE(std::equal(expected.argb + y * expected.argb_stride,
+                             expected.argb + y * expected.argb_stride + width,
+                             pic->argb + y * pic->argb_stride))
+          << "row " << y;
+    }
+    WebPPictureFree(&expected);
+  };
+
+  check(EncodePNG(src, PNG_COLOR_TYPE_RGB), src.width, src.height,
+        get_samples(src, false), false);
+  check(EncodePNG(src, PNG_COLOR_TYPE_RGB_ALPHA), src.width, src.height,
+        get_samples(src, true), true);
+
+  // Opaque colors reduced to a 6x6x6 cube fit in a palette.
+  WebPPicture* const quantized = pics[0].get();
+  for (int y = 0; y < quantized->height; ++y) {
+    for (int x = 0; x < quantized->width; ++x) {
+      uint32_t& argb = quantized->argb[y * quantized->argb_stride + x];
+      uint32_t color = 0xff000000u;
+      for (int shift : {16, 8, 0}) {
+        color |= uint32_t(((argb >> shift) & 0xff) / 51 * 51) << shift;
+      }
+      argb = color;
+    }
+  }
+  const std::string paletted = EncodePNG(*quantized, PNG_COLOR_TYPE_PALETTE);
+  ASSERT_FALSE(paletted.empty());
+  check(paletted, quantized->width, quantized->height,
+        get_samples(*quantized, false), false);
+
+  const std::string jpeg = EncodeJPEG(src, /*quality=*/90);
+  int width, height;
+  const std::vector<uint8_t> rgb = DecodeJPEGToRGB(jpeg, &width, &height);
+  check(jpeg, width, height, rgb, false);
+}
+
+TEST(ReadPictureTest, DecodesJPEGToYUVLikeARGB) {
+  // Odd dimensions have partial chroma blocks on the right and bottom edges.
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(1, kDefaultWidth + 1, kDefaultHeight + 1, 0xff,
+                        WebPTestGenerator::kTexture)
+          .GeneratePics();
+  const std::string jpeg = EncodeJPEG(*pics[0], /*quality=*/90);
+  const auto read = [&](bool allow_yuv) {
+    libwebp::ReadPictureOption option;
+    option.allow_yuv = allow_yuv;
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    EXPECT_TRUE(libwebp::ReadPicture(
+        reinterpret_cast<const uint8_t*>(jpeg.data()), jpeg.size(), pic.get(),
+        option));
+    return pic;
+  };
+  const EnclosedWebPPicture yuv = read(true);
+  const EnclosedWebPPicture argb = read(false);
+  ASSERT_FALSE(yuv->use_argb);
+  ASSERT_EQ(yuv->colorspace, WEBP_YUV420);
+  ASSERT_TRUE(argb->use_argb);
+  ASSERT_EQ(yuv->width, argb->width);
+  ASSERT_EQ(yuv->height, argb->height);
+
+  // Both only differ by the rounding of the colorspace conversions.
+  float distortion[5];
+  ASSERT_TRUE(WebPPictureDistortion(yuv.get(), argb.get(), 0, distortion));
+  EXPECT_GT(distortion[4], 40.f);
+
+  // The luma samples are the limited-range JPEG ones.
+  WebPPicture converted;
+  ASSERT_TRUE(WebPPictureInit(&converted));
+  ASSERT_TRUE(WebPPictureCopy(argb.get(), &converted));
+  ASSERT_TRUE(WebPPictureARGBToYUVA(&converted, WEBP_YUV420));
+  int max_diff = 0;
+  for (int y = 0; y < yuv->height; ++y) {
+    for (int x = 0; x < yuv->width; ++x) {
+      const int diff = yuv->y[y * yuv->y_stride + x] -
+                       converted.y[y * converted.y_stride + x];
+      max_diff = std::max(max_diff, std::abs(diff));
+    }
+  }
+  EXPECT_LE(max_diff, 3);
+  WebPPictureFree(&converted);
+}
+
+TEST(MapFileTest, MapsRegularFilesAndReadsPipes) {
+  std::string content(100000, '\0');
+  std::mt19937 rng(1);
+  for (char& c : content) c = char(rng());
+  const auto check = [&](const std::string& path, int expected_is_mapped) {
+    const uint8_t* data;
+    size_t data_size;
+    int is_mapped;
+    ASSERT_TRUE(ImgIoUtilMapFile(path.c_str(), &data, &data_size, &is_mapped));
+    EXPECT_EQ(is_mapped, expected_is_mapped);
+    EXPECT_EQ(std::string(reinterpret_cast<const char*>(data), data_size),
+              content);
+    ImgIoUtilUnmapFile(data, data_size, is_mapped);
+  };
+
+  const std::string file_path = ::testing::TempDir() + "/map_file.bin";
+  std::ofstream(file_path, std::ios::binary) << content;
+  check(file_path, 1);
+
+  // A named pipe can only be opened once by its reader.
+  const std::string pipe_path = ::testing::TempDir() + "/map_file.fifo";
+  unlink(pipe_path.c_str());
+  ASSERT_EQ(mkfifo(pipe_path.c_str(), 0600), 0);
+  std::thread writer(
+      [&]() { std::ofstream(pipe_path, std::ios::binary) << content; });
+  check(pipe_path, 0);
+  writer.join();
+  unlink(pipe_path.c_str());
+}
+
+TEST(AnimReaderTest, ComposesGIFFrames) {
+  const int width = 4, height = 9;
+  const std::vector<uint32_t> palette = {0xffff0000u, 0xff00ff00u, 0xff0000ffu,
+                                         0xffffffffu};
+  const auto make_frame = [](int left, int top, int frame_width,
+                             int frame_height,
+                             const std::function<int(int, int)>& index) {
+    GIFFrame frame;
+    frame.left = left;
+    frame.top = top;
+    frame.width = frame_width;
+    frame.height = frame_height;
+    for (int y = 0; y < frame_height; ++y) {
+      for (int x = 0; x < frame_width; ++x) {
+        frame.indices.push_back(index(x, y));
+      }
+    }
+    return frame;
+  };
+  std::vector<GIFFrame> frames = {
+      make_frame(0, 0, width, height, [](int x, int y) { return (x + y) % 3; }),
+      make_frame(1, 2, 2, 3, [](int x, int y) { return (x + y) % 2 ? 1 : 3; }),
+      make_frame(0, 0, 2, height, [](int x, int y) { return (x + y) % 2; }),
+      make_frame(3, 0, 1, 2, [](int, int) { return 2; }),
+      make_frame(0, 0, width, height, [](int, int) { return 3; }),
+  };
+  frames[0].delay_cs = 20;
+  frames[1].delay_cs = 5;
+  frames[1].transparent = 3;
+  frames[1].dispose = 2;   // background
+  frames[2].delay_cs = 0;  // displayed for 100 ms
+  frames[2].dispose = 3;   // previous
+  frames[2].interlaced = true;
+  frames[2].palette = {0xffffff00u, 0xff00ffffu};
+  frames[4].max_lzw_bytes = 2;
+  const std::string gif = EncodeGIF(width, height, palette, frames);
+
+  // Expected canvases, starting fully transparent.
+  std::vector<uint32_t> canvas(width * height, 0);
+  const auto draw = [&](const GIFFrame& frame) {
+    const std::vector<uint32_t>& colors =
+        frame.palette.empty() ? palette : frame.palette;
+    for (int y = 0; y < frame.height; ++y) {
+      for (int x = 0; x < frame.width; ++x) {
+        const int index = frame.indices[y * frame.width + x];
+        if (index == frame.transparent) continue;
+        canvas[(frame.top + y) * width + frame.left + x] = colors[index];
+      }
+    }
+    return canvas;
+  };
+  std::vector<std::vector<uint32_t>> expected;
+  expected.push_back(draw(frames[0]));
+  expected.push_back(draw(frames[1]));
+  for (int y = 2; y < 5; ++y) canvas[y * width + 1] = canvas[y * width + 2] = 0;
+  const std::vector<uint32_t> previous = canvas;
+  expected.push_back(draw(frames[2]));
+  canvas = previous;
+  expected.push_back(draw(frames[3]));
+  const int expected_timestamps[] = {200, 250, 350, 450, 550};
+
+  AnimReader* const reader = AnimReaderNew(
+      reinterpret_cast<const uint8_t*>(gif.data()), gif.size());
+  ASSERT_NE(reader, nullptr);
+  WebPPicture pic;
+  ASSERT_TRUE(WebPPictureInit(&pic));
+  int timestamp_ms;
+  for (size_t f = 0; f < frames.size(); ++f) {
+    ASSERT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_FRAME_OK);
+    EXPECT_EQ(timestamp_ms, expected_timestamps[f]);
+    ASSERT_TRUE(pic.use_argb);
+    ASSERT_EQ(pic.width, width);
+    ASSERT_EQ(pic.height, height);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const uint32_t argb = pic.argb[y * pic.argb_stride + x];
+        if (f < expected.size()) {
+          EXPECT_EQ(argb, expected[f][y * width + x])
+              << "frame " << f << " at " << x << "," << y;
+        } else {
+          // The truncated image data only covers the start of the frame.
+          EXPECT_TRUE(argb == palette[3] || argb == canvas[y * width + x]);
+        }
+      }
+    }
+  }
+  EXPECT_EQ(pic.argb[0], palette[3]);
+  EXPECT_EQ(pic.argb[(height - 1) * pic.argb_stride + width - 1],
+            canvas.back());
+  EXPECT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_END);
+  AnimReaderDelete(reader);
+  WebPPictureFree(&pic);
+}
+
+TEST(AnimReaderTest, DecodesLargeGIFAndRejectsInvalidOnes) {
+  // Enough varied indices to use 12-bit codes and restart the code table.
+  const int width = 300, height = 200;
+  std::vector<uint32_t> palette;
+  for (uint32_t i = 0; i < 256; ++i) {
+    palette.push_back(0xff000000u | i * 0x10101u);
+  }
+  GIFFrame frame;
+  frame.width = width;
+  frame.height = height;
+  std::mt19937 rng(0);
+  for (int i = 0; i < width * height; ++i) {
+    frame.indices.push_back(
+        (rng() % 8 == 0) ? rng() % 256 : (i % width / 7 + i / width / 5) % 16);
+  }
+  const std::string gif = EncodeGIF(width, height, palette, {frame});
+  AnimReader* reader = AnimReaderNew(
+      reinterpret_cast<const uint8_t*>(gif.data()), gif.size());
+  ASSERT_NE(reader, nullptr);
+  WebPPicture pic;
+  ASSERT_TRUE(WebPPictureInit(&pic));
+  int timestamp_ms;
+  ASSERT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_FRAME_OK);
+  EXPECT_EQ(timestamp_ms, 100);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      ASSERT_EQ(pic.argb[y * pic.argb_stride + x],
+                palette[frame.indices[y * width + x]]);
+    }
+  }
+  EXPECT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_END);
+  AnimReaderDelete(reader);
+
+  // A file truncated within the image data.
+  const std::string truncated = gif.substr(0, gif.size() / 2);
+  reader = AnimReaderNew(reinterpret_cast<const uint8_t*>(truncated.data()),
+                         truncated.size());
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_ERROR);
+  AnimReaderDelete(reader);
+  WebPPictureFree(&pic);
+
+  // Logical screens larger than what WebP supports.
+  const std::string oversized =
+      EncodeGIF(WEBP_MAX_DIMENSION + 1, 1, palette, {});
+  EXPECT_EQ(AnimReaderNew(reinterpret_cast<const uint8_t*>(oversized.data()),
+                          oversized.size()),
+            nullptr);
+}
+
+TEST(AnimReaderTest, DecodesAnimatedWebP) {
+  const int pic_count = 3;
+  const int timestamps[pic_count + 1] = {0, 100, 250, 400};
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  WebPAnimEncoderOptions enc_options;
+  ASSERT_TRUE(WebPAnimEncoderOptionsInit(&enc_options));
+  std::unique_ptr<WebPAnimEncoder, void (*)(WebPAnimEncoder*)> enc(
+      WebPAnimEncoderNew(kDefaultWidth, kDefaultHeight, &enc_options),
+      WebPAnimEncoderDelete);
+  ASSERT_NE(enc, nullptr);
+  WebPConfig config;
+  ASSERT_TRUE(WebPConfigInit(&config));
+  config.lossless = 1;
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_TRUE(
+        WebPAnimEncoderAdd(enc.get(), pics[i].get(), timestamps[i], &config));
+  }
+  ASSERT_TRUE(
+      WebPAnimEncoderAdd(enc.get(), nullptr, timestamps[pic_count], nullptr));
+  WebPData webp_data;
+  WebPDataInit(&webp_data);
+  ASSERT_TRUE(WebPAnimEncoderAssemble(enc.get(), &webp_data));
+
+  AnimReader* const reader = AnimReaderNew(webp_data.bytes, webp_data.size);
+  ASSERT_NE(reader, nullptr);
+  WebPPicture pic;
+  ASSERT_TRUE(WebPPictureInit(&pic));
+  int timestamp_ms;
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_FRAME_OK);
+    EXPECT_EQ(timestamp_ms, timestamps[i + 1]);
+    ASSERT_EQ(pic.width, kDefaultWidth);
+    ASSERT_EQ(pic.height, kDefaultHeight);
+    for (int y = 0; y < kDefaultHeight; ++y) {
+      ASSERT_TRUE(std::equal(pic.argb + y * pic.argb_stride,
+                             pic.argb + y * pic.argb_stride + kDefaultWidth,
+                             pics[i]->argb + y * pics[i]->argb_stride));
+    }
+  }
+  EXPECT_EQ(AnimReaderReadFrame(reader, &pic, &timestamp_ms), ANIM_END);
+  AnimReaderDelete(reader);
+  WebPPictureFree(&pic);
+  WebPDataClear(&webp_data);
+}
+
+// Writes 'content' to a temporary file and opens it as a stream.
+StreamReader* OpenStream(const std::string& content, double default_fps) {
+  const std::string path = ::testing::TempDir() + "/stream.bin";
+  std::ofstream(path, std::ios::binary) << content;
+  return StreamReaderNew(path.c_str(), default_fps);
+}
+
+TEST(StreamReaderTest, ReadsPAMFrames) {
+  // 3x2 pixels, starting with whitespace values that must not be taken for
+  // the end of the header.
+  std::string gray, rgb, rgba;
+  for (int i = 0; i < 6; ++i) {
+    const char r = (i == 0) ? '\n' : (i == 1) ? ' ' : static_cast<char>(40 * i);
+    const char g = static_cast<char>(255 - 40 * i), b = '\x10';
+    const char a = static_cast<char>(50 * i);
+    gray += r;
+    rgb += {r, g, b};
+    rgba += {r, g, b, a};
+  }
+  const std::vector<std::string> headers = {
+      "P6\n3 2\n255\n",
+      "P6 3 2 255\n",                          // single line
+      "P6\n# comment\n3\n2\n# 255\n255\n",     // four lines and comments
+      "P5 3 2 255 ",                           // ends with a space
+      "P7\nWIDTH 3\nHEIGHT 2\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\n"
+      "ENDHDR\n",
+  };
+  std::string stream;
+  for (const std::string& header : headers) {
+    stream += header + (header[1] == '5' ? gray
+                        : header[1] == '6' ? rgb : rgba);
+  }
+
+  StreamReader* reader = OpenStream(stream, /*default_fps=*/25.);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_FALSE(StreamReaderIsYUV(reader));
+  WebPPicture pic;
+  ASSERT_TRUE(WebPPictureInit(&pic));
+  pic.use_argb = 1;
+  int timestamp_ms;
+  for (size_t f = 0; f < headers.size(); ++f) {
+    ASSERT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms),
+              STREAM_FRAME_OK);
+    EXPECT_EQ(timestamp_ms, 40 * (f + 1));
+    ASSERT_EQ(pic.width, 3);
+    ASSERT_EQ(pic.height, 2);
+    for (int i = 0; i < 6; ++i) {
+      const uint8_t* const rgba_px =
+          reinterpret_cast<const uint8_t*>(rgba.data()) + 4 * i;
+      const char type = headers[f][1];
+      const uint32_t expected =
+          (type == '5') ? 0xff000000u | 0x010101u * rgba_px[0]
+                        : ((type == '6') ? 0xffu : rgba_px[3]) << 24 |
+                              rgba_px[0] << 16 | rgba_px[1] << 8 | rgba_px[2];
+      EXPECT_EQ(pic.argb[(i / 3) * pic.argb_stride + i % 3], expected)
+          << "frame " << f << " pixel " << i;
+    }
+  }
+  EXPECT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms), STREAM_END);
+  StreamReaderDelete(reader);
+
+  // Truncated final frames are errors, after the complete frames.
+  for (const size_t size : {stream.size() - 1, stream.size() - rgba.size() - 3,
+                            stream.size() - rgba.size() - 40}) {
+    reader = OpenStream(stream.substr(0, size), /*default_fps=*/25.);
+    ASSERT_NE(reader, nullptr);
+    for (size_t f = 0; f + 1 < headers.size(); ++f) {
+      ASSERT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms),
+                STREAM_FRAME_OK);
+    }
+    EXPECT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms),
+              STREAM_ERROR);
+    StreamReaderDelete(reader);
+  }
+  EXPECT_EQ(OpenStream(stream, /*default_fps=*/0.), nullptr);
+  WebPPictureFree(&pic);
+}
+
+TEST(StreamReaderTest, ReadsY4MFrames) {
+  // 3x3 frames, with 2x2 chroma planes.
+  std::string frame = "FRAME\n";
+  for (int i = 0; i < 9 + 4 + 4; ++i) frame += static_cast<char>(15 * i);
+  const auto read = [&](const std::string& header, int num_frames,
+                        const std::function<void(const WebPPicture&)>& check) {
+    std::string stream = header;
+    for (int f = 0; f < num_frames; ++f) stream += frame;
+    StreamReader* const reader = OpenStream(stream, /*default_fps=*/25.);
+    ASSERT_NE(reader, nullptr);
+    EXPECT_TRUE(StreamReaderIsYUV(reader));
+    WebPPicture pic;
+    ASSERT_TRUE(WebPPictureInit(&pic));
+    int timestamp_ms;
+    // Frame rate of 29.97 fps.
+    const int expected_timestamps[] = {33, 67, 100};
+    for (int f = 0; f < num_frames; ++f) {
+      ASSERT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms),
+                STREAM_FRAME_OK);
+      EXPECT_EQ(timestamp_ms, expected_timestamps[f]);
+      ASSERT_FALSE(pic.use_argb);
+      ASSERT_EQ(pic.width, 3);
+      ASSERT_EQ(pic.height, 3);
+      check(pic);
+    }
+    EXPECT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms), STREAM_END);
+    StreamReaderDelete(reader);
+    WebPPictureFree(&pic);
+  };
+  const auto sample = [](const uint8_t* const plane, int stride, int i,
+                         int width) {
+    return plane[(i / width) * stride + i % width];
+  };
+
+  read("YUV4MPEG2 W3 H3 F30000:1001 Ip A1:1 C420jpeg\n", 3,
+       [&](const WebPPicture& pic) {
+         for (int i = 0; i < 9; ++i) {
+           EXPECT_EQ(sample(pic.y, pic.y_stride, i, 3), 15 * i);
+         }
+         for (int i = 0; i < 4; ++i) {
+           EXPECT_EQ(sample(pic.u, pic.uv_stride, i, 2), 15 * (9 + i));
+           EXPECT_EQ(sample(pic.v, pic.uv_stride, i, 2), 15 * (13 + i));
+         }
+       });
+  // Full-range samples are remapped to the limited range.
+  read("YUV4MPEG2 C420 W3 H3 F30000:1001 XCOLORRANGE=FULL\n", 2,
+       [&](const WebPPicture& pic) {
+         for (int i = 0; i < 9; ++i) {
+           EXPECT_EQ(sample(pic.y, pic.y_stride, i, 3),
+                     16 + (219 * 15 * i + 127) / 255);
+         }
+         for (int i = 0; i < 4; ++i) {
+           EXPECT_EQ(sample(pic.u, pic.uv_stride, i, 2),
+                     16 + (224 * 15 * (9 + i) + 127) / 255);
+           EXPECT_EQ(sample(pic.v, pic.uv_stride, i, 2),
+                     16 + (224 * 15 * (13 + i) + 127) / 255);
+         }
+       });
+
+  // A truncated final frame is an error.
+  std::string stream = "YUV4MPEG2 W3 H3 F25:1\n" + frame + frame;
+  stream.resize(stream.size() - 1);
+  StreamReader* const reader = OpenStream(stream, /*default_fps=*/25.);
+  ASSERT_NE(reader, nullptr);
+  WebPPicture pic;
+  ASSERT_TRUE(WebPPictureInit(&pic));
+  int timestamp_ms;
+  EXPECT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms),
+            STREAM_FRAME_OK);
+  EXPECT_EQ(timestamp_ms, 40);
+  EXPECT_EQ(StreamReaderReadFrame(reader, &pic, &timestamp_ms), STREAM_ERROR);
+  StreamReaderDelete(reader);
+  WebPPictureFree(&pic);
+  EXPECT_EQ(OpenStream("YUV4MPEG2 W3 H3 F25:1 C444\n" + frame, 25.), nullptr);
+}
+
+TEST(FrameCacheTest, MapsDecodedFrames) {
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(1, kDefaultWidth, kDefaultHeight, 0x80,
+                        WebPTestGenerator::kTexture)
+          .GeneratePics();
+  const WebPPicture& src = *pics[0];
+  uint8_t* encoded;
+  const size_t encoded_size = WebPEncodeLosslessBGRA(
+      reinterpret_cast<const uint8_t*>(src.argb), src.width, src.height,
+      src.argb_stride * sizeof(uint32_t), &encoded);
+  ASSERT_GT(encoded_size, 0u);
+  const std::string image_path = ::testing::TempDir() + "/frame.webp";
+  std::ofstream(image_path, std::ios::binary)
+      .write(reinterpret_cast<const char*>(encoded), encoded_size);
+  WebPFree(encoded);
+  const std::string cache_directory = ::testing::TempDir() + "/frame_cache";
+  mkdir(cache_directory.c_str(), 0755);
+
+  const auto read = [&](const libwebp::ReadPictureOption& option) {
+    EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+    WebPPictureInit(pic.get());
+    EXPECT_TRUE(libwebp::ReadCachedPicture(image_path.c_str(),
+                                           cache_directory, &pic, option));
+    return pic;
+  };
+  libwebp::ReadPictureOption option;
+  const EnclosedWebPPicture decoded = read(option);
+  EXPECT_EQ(decoded.get_deleter(), libwebp::WebPPictureDelete);
+  const EnclosedWebPPicture mapped = read(option);
+  ASSERT_EQ(mapped.get_deleter(), libwebp::UnmapPicture);
+  ASSERT_EQ(mapped->width, src.width);
+  ASSERT_EQ(mapped->height, src.height);
+  for (int y = 0; y < src.height; ++y) {
+    ASSERT_TRUE(std::equal(src.argb + y * src.argb_stride,
+                           src.argb + y * src.argb_stride + src.width,
+                           mapped->argb + y * mapped->argb_stride));
+  }
+
+  // Other decoding options are cached separately.
+  option.target_width = src.width / 2;
+  EXPECT_EQ(read(option).get_deleter(), libwebp::WebPPictureDelete);
+  const EnclosedWebPPicture downscaled = read(option);
+  EXPECT_EQ(downscaled.get_deleter(), libwebp::UnmapPicture);
+  EXPECT_EQ(downscaled->width, src.width / 2);
+}
+
+TEST(ReadPictureTest, FitsJPEGLikeOtherFormats) {
+  // 333 * 100 / 1000 rounds down, but 42 * 100 / 125 (the output of the 1/8
+  // DCT scaling) rounds up.
+  const std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(1, 1000, 333, 0xff, WebPTestGenerator::kGradient)
+          .GeneratePics();
+  const WebPPicture& src = *pics[0];
+  uint8_t* encoded;
+  const size_t encoded_size = WebPEncodeLosslessBGRA(
+      reinterpret_cast<const uint8_t*>(src.argb), src.width, src.height,
+      src.argb_stride * sizeof(uint32_t), &encoded);
+  ASSERT_GT(encoded_size, 0u);
+  const std::string webp(reinterpret_cast<const char*>(encoded), encoded_size);
+  WebPFree(encoded);
+  const std::string jpeg = EncodeJPEG(src, /*quality=*/90);
+
+  for (bool allow_yuv : {false, true}) {
+    libwebp::ReadPictureOption option;
+    option.target_width = 100;
+    option.allow_yuv = allow_yuv;
+    for (const std::string* const data : {&webp, &jpeg}) {
+      EnclosedWebPPicture pic(new WebPPicture, libwebp::WebPPictureDelete);
+      WebPPictureInit(pic.get());
+      ASSERT_TRUE(libwebp::ReadPicture(
+          reinterpret_cast<const uint8_t*>(data->data()), data->size(),
+          pic.get(), option));
+      EXPECT_EQ(pic->width, 100);
+      EXPECT_EQ(pic->height, 33);
+    }
+  }
+}
+
+TEST(ServiceTest, ServesRequestsOverSocket) {
+  const std::string socket_path = ::testing::TempDir() + "/thumbnailer.sock";
+  libwebp::ThumbnailerService service(thumbnailer::ThumbnailerOption(),
+                                      /*num_threads=*/2);
+  std::thread server([&]() { EXPECT_TRUE(service.Serve(socket_path)); });
+
+  // Connect once the service listens.
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(fd, 0);
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path.c_str());
+  bool connected = false;
+  for (int i = 0; i < 100 && !connected; ++i) {
+    connected = (connect(fd, reinterpret_cast<const sockaddr*>(&address),
+                         sizeof(address)) == 0);
+    if (!connected) usleep(10000);
+  }
+  ASSERT_TRUE(connected);
+
+  // Send the frames inline, losslessly encoded.
+  const int pic_count = 5;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/true).GeneratePics();
+  thumbnailer::ThumbnailerRequest request;
+  for (int i = 0; i < pic_count; ++i) {
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    WebPConfig config;
+    ASSERT_TRUE(WebPConfigInit(&config));
+    config.lossless = 1;
+    pics[i]->writer = WebPMemoryWrite;
+    pics[i]->custom_ptr = &writer;
+    ASSERT_TRUE(WebPEncode(&config, pics[i].get()));
+    thumbnailer::ThumbnailerRequest::Frame* const frame = request.add_frame();
+    frame->set_data(writer.mem, writer.size);
+    frame->set_timestamp_ms((i + 1) * 500);
+    WebPMemoryWriterClear(&writer);
+  }
+  request.mutable_option()->set_soft_max_size(kDefaultBudget / 2);
+
+  thumbnailer::ThumbnailerResponse response;
+  ASSERT_TRUE(libwebp::WriteDelimitedMessage(fd, request));
+  ASSERT_TRUE(libwebp::ReadDelimitedMessage(fd, &response));
+  EXPECT_EQ(response.status(), libwebp::Thumbnailer::kOk);
+  EXPECT_GT(response.webp().size(), 0);
+  EXPECT_LE(response.webp().size(), kDefaultBudget / 2);
+  EXPECT_GT(response.num_probes(), 0);
+
+  // Errors are reported on the same connection.
+  request.set_algorithm("unknown");
+  ASSERT_TRUE(libwebp::WriteDelimitedMessage(fd, request));
+  ASSERT_TRUE(libwebp::ReadDelimitedMessage(fd, &response));
+  EXPECT_NE(response.status(), libwebp::Thumbnailer::kOk);
+  EXPECT_FALSE(response.error().empty());
+
+  close(fd);
+  service.Stop();
+  server.join();
+}
+
+// Path of the thumbnailer binary, from the runfiles of 'bazel run' or from the
+// root of the workspace.
+std::string GetThumbnailerBinary() {
+  for (const char* const path :
+       {"src/thumbnailer", "bazel-bin/src/thumbnailer"}) {
+    if (access(path, X_OK) == 0) return path;
+  }
+  return "";
+}
+
+// Writes the ARGB picture 'pic' to 'path' as a lossless WebP image.
+bool WriteLosslessWebP(const WebPPicture& pic, const std::string& path) {
+  uint8_t* encoded;
+  const size_t encoded_size = WebPEncodeLosslessBGRA(
+      reinterpret_cast<const uint8_t*>(pic.argb), pic.width, pic.height,
+      pic.argb_stride * sizeof(uint32_t), &encoded);
+  if (encoded_size == 0) return false;
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(encoded), encoded_size);
+  WebPFree(encoded);
+  return bool(file);
+}
+
+// Runs the thumbnailer 'binary' with 'args'. Returns its exit status, and
+// what it printed to stderr in 'errors'.
+int RunThumbnailer(const std::string& binary, const std::string& args,
+                   std::string* const errors) {
+  const std::string errors_path = ::testing::TempDir() + "/thumbnailer.err";
+  const int status =
+      std::system((binary + " " + args + " 2> " + errors_path).c_str());
+  std::ifstream errors_file(errors_path);
+  std::stringstream errors_text;
+  errors_text << errors_file.rdbuf();
+  *errors = errors_text.str();
+  return status;
+}
+
+TEST(BatchTest, RunsMultiFrameJobs) {
+  const std::string binary = GetThumbnailerBinary();
+  if (binary.empty()) GTEST_SKIP() << "The thumbnailer binary is not built.";
+
+  // Two jobs of two and three losslessly encoded frames.
+  const std::string dir = ::testing::TempDir();
+  const int pic_count = 5;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, kDefaultWidth, kDefaultHeight, 0xff,
+                        WebPTestGenerator::kSprites)
+          .GeneratePics();
+  for (int i = 0; i < pic_count; ++i) {
+    ASSERT_TRUE(WriteLosslessWebP(
+        *pics[i], dir + "/batch_frame" + std::to_string(i) + ".webp"));
+  }
+  const std::vector<std::vector<int>> jobs = {{0, 1}, {2, 3, 4}};
+  thumbnailer::ThumbnailerBatch batch;
+  for (std::size_t j = 0; j < jobs.size(); ++j) {
+    const std::string name = dir + "/batch_job" + std::to_string(j);
+    std::ofstream frame_list(name + ".txt");
+    for (std::size_t i = 0; i < jobs[j].size(); ++i) {
+      frame_list << dir << "/batch_frame" << jobs[j][i] << ".webp "
+                 << (i + 1) * 100 << "\n";
+    }
+    thumbnailer::ThumbnailerJob* const job = batch.add_job();
+    job->set_frame_list(name + ".txt");
+    job->set_output(name + ".webp");
+    job->set_stats_output(name + ".textproto");
+  }
+  std::string manifest;
+  ASSERT_TRUE(google::protobuf::TextFormat::PrintToString(batch, &manifest));
+  std::ofstream(dir + "/batch.textproto") << manifest;
+
+  ASSERT_EQ(std::system((binary + " -batch -jobs=2 -decode_threads=2 " + dir +
+                         "/batch.textproto")
+                            .c_str()),
+            0);
+  for (std::size_t j = 0; j < jobs.size(); ++j) {
+    std::ifstream stats_file(dir + "/batch_job" + std::to_string(j) +
+                             ".textproto");
+    std::stringstream stats_text;
+    stats_text << stats_file.rdbuf();
+    thumbnailer::ThumbnailerStats stats;
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(
+        stats_text.str(), &stats));
+    ASSERT_EQ(stats.frame_size(), int(jobs[j].size()));
+    for (std::size_t i = 0; i < jobs[j].size(); ++i) {
+      EXPECT_EQ(stats.frame(i).timestamp_ms(), int((i + 1) * 100));
+    }
+    EXPECT_GT(stats.animation_size(), 0);
+  }
+}
+
+TEST(DecodeThreadsTest, KeepsFrameOrder) {
+  const std::string binary = GetThumbnailerBinary();
+  if (binary.empty()) GTEST_SKIP() << "The thumbnailer binary is not built.";
+
+  // More frames than threads, each of its own gray level.
+  const std::string dir = ::testing::TempDir();
+  const int pic_count = 9;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/false).GeneratePics();
+  std::ofstream frame_list(dir + "/decode_list.txt");
+  for (int i = 0; i < pic_count; ++i) {
+    WebPPicture* const pic = pics[i].get();
+    const uint32_t gray = 20 + 25 * i;
+    for (int y = 0; y < pic->height; ++y) {
+      std::fill(pic->argb + y * pic->argb_stride,
+                pic->argb + y * pic->argb_stride + pic->width,
+                0xff000000u | (gray << 16) | (gray << 8) | gray);
+    }
+    const std::string path =
+        dir + "/decode_frame" + std::to_string(i) + ".webp";
+    ASSERT_TRUE(WriteLosslessWebP(*pic, path));
+    frame_list << path << " " << (i + 1) * 100 << "\n";
+  }
+  frame_list.close();
+
+  std::string errors;
+  ASSERT_EQ(RunThumbnailer(binary,
+                           "-decode_threads=4 -o " + dir + "/decode.webp " +
+                               dir + "/decode_list.txt",
+                           &errors),
+            0)
+      << errors;
+  std::ifstream webp_file(dir + "/decode.webp", std::ios::binary);
+  const std::string webp((std::istreambuf_iterator<char>(webp_file)),
+                         std::istreambuf_iterator<char>());
+  WebPData webp_data = {reinterpret_cast<const uint8_t*>(webp.data()),
+                        webp.size()};
+  std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
+      WebPAnimDecoderNew(&webp_data, nullptr), WebPAnimDecoderDelete);
+  ASSERT_NE(dec, nullptr);
+  for (int i = 0; i < pic_count; ++i) {
+    uint8_t* rgba;
+    int timestamp;
+    ASSERT_TRUE(WebPAnimDecoderGetNext(dec.get(), &rgba, &timestamp));
+    EXPECT_EQ(timestamp, (i + 1) * 100);
+    EXPECT_NEAR(rgba[0], 20 + 25 * i, 4) << "frame " << i;
+  }
+  EXPECT_FALSE(WebPAnimDecoderHasMoreFrames(dec.get()));
+
+  // Of two bad files, the first one in list order is reported, whichever
+  // thread fails first.
+  std::ofstream(dir + "/decode_bad.webp") << "not an image";
+  std::ofstream bad_list(dir + "/decode_bad_list.txt");
+  for (int i = 0; i < pic_count; ++i) {
+    std::string path = dir + "/decode_frame" + std::to_string(i) + ".webp";
+    if (i == 6) path = dir + "/decode_bad.webp";
+    if (i == 3) path = dir + "/decode_missing.webp";
+    bad_list << path << " " << (i + 1) * 100 << "\n";
+  }
+  bad_list.close();
+  EXPECT_NE(RunThumbnailer(binary,
+                           "-decode_threads=4 -o " + dir + "/decode_bad.out " +
+                               dir + "/decode_bad_list.txt",
+                           &errors),
+            0);
+  EXPECT_NE(errors.find("Failed to read image " + dir + "/decode_missing.webp"),
+            std::string::npos)
+      << errors;
+  EXPECT_EQ(errors.find("decode_bad.webp"), std::string::npos) << errors;
+}
+
+TEST(AnimInputTest, ReadsGIFFrames) {
+  const std::string binary = GetThumbnailerBinary();
+  if (binary.empty()) GTEST_SKIP() << "The thumbnailer binary is not built.";
+
+  // Solid frames of their own color and delay.
+  const std::string dir = ::testing::TempDir();
+  const std::vector<uint32_t> palette = {0xffc02010u, 0xff10c020u,
+                                         0xff2010c0u};
+  std::vector<GIFFrame> frames(palette.size());
+  for (size_t i = 0; i < frames.size(); ++i) {
+    frames[i].width = kDefaultWidth;
+    frames[i].height = kDefaultHeight;
+    frames[i].indices.assign(kDefaultWidth * kDefaultHeight, i);
+    frames[i].delay_cs = 10 * (i + 1);
+  }
+  const std::string gif =
+      EncodeGIF(kDefaultWidth, kDefaultHeight, palette, frames);
+  std::ofstream(dir + "/anim.gif", std::ios::binary) << gif;
+
+  std::string errors;
+  ASSERT_EQ(RunThumbnailer(
+                binary, "-anim -o " + dir + "/anim.webp " + dir + "/anim.gif",
+                &errors),
+            0)
+      << errors;
+  std::ifstream webp_file(dir + "/anim.webp", std::ios::binary);
+  const std::string webp((std::istreambuf_iterator<char>(webp_file)),
+                         std::istreambuf_iterator<char>());
+  WebPData webp_data = {reinterpret_cast<const uint8_t*>(webp.data()),
+                        webp.size()};
+  std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
+      WebPAnimDecoderNew(&webp_data, nullptr), WebPAnimDecoderDelete);
+  ASSERT_NE(dec, nullptr);
+  const int expected_timestamps[] = {100, 300, 600};
+  for (size_t i = 0; i < frames.size(); ++i) {
+    uint8_t* rgba;
+    int timestamp;
+    ASSERT_TRUE(WebPAnimDecoderGetNext(dec.get(), &rgba, &timestamp));
+    EXPECT_EQ(timestamp, expected_timestamps[i]);
+    EXPECT_NEAR(rgba[0], (palette[i] >> 16) & 0xff, 8) << "frame " << i;
+    EXPECT_NEAR(rgba[1], (palette[i] >> 8) & 0xff, 8) << "frame " << i;
+    EXPECT_NEAR(rgba[2], palette[i] & 0xff, 8) << "frame " << i;
+  }
+  EXPECT_FALSE(WebPAnimDecoderHasMoreFrames(dec.get()));
+
+  // Truncated files are reported.
+  std::ofstream(dir + "/anim_truncated.gif", std::ios::binary)
+      << gif.substr(0, gif.size() - 10);
+  EXPECT_NE(RunThumbnailer(binary,
+                           "-anim -o " + dir + "/anim_truncated.webp " + dir +
+                               "/anim_truncated.gif",
+                           &errors),
+            0);
+  EXPECT_NE(errors.find("Failed to read animation"), std::string::npos)
+      << errors;
+}
+
+TEST(StreamInputTest, ReadsPAMFramesFromStdin) {
+  const std::string binary = GetThumbnailerBinary();
+  if (binary.empty()) GTEST_SKIP() << "The thumbnailer binary is not built.";
+
+  // Solid gray frames with single-line headers.
+  const std::string dir = ::testing::TempDir();
+  const int pic_count = 4;
+  std::string stream;
+  for (int i = 0; i < pic_count; ++i) {
+    stream += "P5 " + std::to_string(kDefaultWidth) + " " +
+              std::to_string(kDefaultHeight) + " 255\n" +
+              std::string(kDefaultWidth * kDefaultHeight, char(40 + 50 * i));
+  }
+  std::ofstream(dir + "/stream.pam", std::ios::binary) << stream;
+
+  std::string errors;
+  ASSERT_EQ(RunThumbnailer(binary,
+                           "-stream -fps=8 -o " + dir + "/stream.webp - < " +
+                               dir + "/stream.pam",
+                           &errors),
+            0)
+      << errors;
+  std::ifstream webp_file(dir + "/stream.webp", std::ios::binary);
+  const std::string webp((std::istreambuf_iterator<char>(webp_file)),
+                         std::istreambuf_iterator<char>());
+  WebPData webp_data = {reinterpret_cast<const uint8_t*>(webp.data()),
+                        webp.size()};
+  std::unique_ptr<WebPAnimDecoder, void (*)(WebPAnimDecoder*)> dec(
+      WebPAnimDecoderNew(&webp_data, nullptr), WebPAnimDecoderDelete);
+  ASSERT_NE(dec, nullptr);
+  for (int i = 0; i < pic_count; ++i) {
+    uint8_t* rgba;
+    int timestamp;
+    ASSERT_TRUE(WebPAnimDecoderGetNext(dec.get(), &rgba, &timestamp));
+    EXPECT_EQ(timestamp, 125 * (i + 1));
+    EXPECT_NEAR(rgba[0], 40 + 50 * i, 4) << "frame " << i;
+  }
+  EXPECT_FALSE(WebPAnimDecoderHasMoreFrames(dec.get()));
+
+  // A truncated final frame is reported.
+  std::ofstream(dir + "/stream_truncated.pam", std::ios::binary)
+      << stream.substr(0, stream.size() - 1);
+  EXPECT_NE(RunThumbnailer(binary,
+                           "-stream -o " + dir + "/stream_truncated.webp " +
+                               dir + "/stream_truncated.pam",
+                           &errors),
+            0);
+  EXPECT_NE(errors.find("Failed to read stream"), std::string::npos)
+      << errors;
+}
+
+TEST(AnimData2PSNRTest, MatchesOriginalFrames) {
+  const int pic_count = 10;
+  std::vector<EnclosedWebPPicture> pics =
+      WebPTestGenerator(pic_count, 0xff, /*randomized=*/false).GeneratePics();
+  std::vector<libwebp::Frame> frames;
+  for (int i = 0; i < pic_count; ++i) {
+    frames.push_back({std::move(pics[i]), (i + 1) * 500});
+  }
+
+  libwebp::Thumbnailer thumbnailer = libwebp::Thumbnailer();
+  for (const libwebp::Frame& frame : frames) {
+    ASSERT_EQ(thumbnailer.AddFrame(*frame.pic, frame.timestamp),
+              libwebp::Thumbnailer::kOk);
+  }
+  std::unique_ptr<WebPData, void (*)(WebPData*)> webp_data(
+      new WebPData, libwebp::WebPDataDelete);
+  WebPDataInit(webp_data.get());
+  ASSERT_EQ(thumbnailer.GenerateAnimation(webp_data.get()),
+            libwebp::Thumbnailer::kOk);
+
+  libwebp::ThumbnailStatsPSNR stats;
+  ASSERT_EQ(libwebp::AnimData2PSNR(frames, webp_data.get(), &stats),
+            libwebp::kOk);
+  EXPECT_EQ(stats.psnr.size(), pic_count);
+  EXPECT_GT(stats.min_psnr, 0);
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
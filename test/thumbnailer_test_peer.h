@@ -0,0 +1,88 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THUMBNAILER_TEST_THUMBNAILER_TEST_PEER_H_
+#define THUMBNAILER_TEST_THUMBNAILER_TEST_PEER_H_
+
+#include <memory>
+
+#include "../src/thumbnailer.h"
+
+namespace libwebp {
+
+// Gives access to the private steps of a Thumbnailer, so that they can be
+// tested and benchmarked in isolation.
+class ThumbnailerTestPeer {
+ public:
+  explicit ThumbnailerTestPeer(Thumbnailer* const thumbnailer)
+      : thumbnailer_(thumbnailer) {}
+
+  int NumFrames() const { return thumbnailer_->frames_.size(); }
+
+  // Sets the encoding settings of all frames.
+  void SetConfig(bool lossless, int quality, int near_lossless = 100) {
+    for (Thumbnailer::FrameData& frame : thumbnailer_->frames_) {
+      frame.config.lossless = lossless;
+      frame.config.quality = quality;
+      frame.config.near_lossless = near_lossless;
+      frame.near_lossless = lossless && near_lossless != 100;
+    }
+  }
+
+  // Forgets the cached sizes and PSNR of the frames and the cached
+  // animations, so that the next calls encode again.
+  void ClearCaches() {
+    for (Thumbnailer::FrameData& frame : thumbnailer_->frames_) {
+      frame.lossy_stats.reset(new Thumbnailer::FrameData::LossyStats);
+    }
+    thumbnailer_->assembly_cache_.clear();
+  }
+
+  // Returns true if the 'ind1'-th and 'ind2'-th frames share their lossy
+  // statistics, i.e. if they are in the same cluster.
+  bool SharesLossyStats(int ind1, int ind2) const {
+    return thumbnailer_->frames_[ind1].lossy_stats ==
+           thumbnailer_->frames_[ind2].lossy_stats;
+  }
+
+  // Returns the statistics gathered since the last ResetStats().
+  const thumbnailer::ThumbnailerStats& GetStats() const {
+    return thumbnailer_->stats_;
+  }
+  Thumbnailer::Status ResetStats() { return thumbnailer_->StartStats(); }
+
+  uint64_t GetEncoderBytes() const { return thumbnailer_->GetEncoderBytes(); }
+
+  Thumbnailer::Status GetPictureStats(int ind, size_t* const pic_size,
+                                      float* const pic_psnr) {
+    return thumbnailer_->GetPictureStats(ind, pic_size, pic_psnr);
+  }
+
+  // Returns the picture that the current config of the frame 'ind' encodes.
+  Thumbnailer::Status GetEncodingPicture(int ind,
+                                         const WebPPicture** const pic) {
+    return thumbnailer_->GetEncodingPicture(&thumbnailer_->frames_[ind], pic);
+  }
+
+  Thumbnailer::Status GenerateAnimationConfigured(WebPData* const webp_data) {
+    return thumbnailer_->GenerateAnimationConfigured(webp_data);
+  }
+
+ private:
+  Thumbnailer* const thumbnailer_;
+};
+
+}  // namespace libwebp
+
+#endif  // THUMBNAILER_TEST_THUMBNAILER_TEST_PEER_H_